@@ -0,0 +1,15 @@
+#!/bin/bash
+#  Request rate through mdbroker in memory, and with a journal synced
+#  every 10 msecs, every 1 msec, and every 64 KB
+journal=/tmp/mdbench_journal
+for options in "" "-j $journal" "-j $journal -J 1" "-j $journal -K 65536"; do
+    rm -rf $journal
+    ./mdbroker $options &
+    broker=$!
+    sleep 1
+    echo "mdbroker $options"
+    ./mdbench_payload
+    kill $broker
+    wait $broker 2>/dev/null
+done
+rm -rf $journal
@@ -0,0 +1,11 @@
+#!/bin/bash
+#  Request rate through mdbroker with 1 to 8 dispatch shards
+for shards in 1 2 4 8; do
+    ./mdbroker -s $shards &
+    broker=$!
+    sleep 1
+    echo -n "$shards shards: "
+    ./mdbench_shards 16 10
+    kill $broker
+    wait $broker 2>/dev/null
+done
@@ -0,0 +1,325 @@
+//  Majordomo end-to-end benchmark
+//  Embeds a broker and runs a number of client and worker threads against
+//  it over inproc, ipc or tcp, sweeping payload sizes and in-flight
+//  windows. For each run we print one CSV line with the throughput and
+//  the p50, p99 and p99.9 round-trip latency, after a comment line that
+//  repeats the full settings, so any report can be reproduced with the
+//  one command it names. Run with -h for the options.
+
+//  Lets us build this source without creating a library
+#include "mdbrkapi.c"
+#include "mdwrkapi.c"
+#include "mdcliapi2.c"
+#include <pthread.h>
+
+#define MAX_VALUES      32          //  Most values in one sweep list
+#define CLIENT_TIMEOUT  10000       //  Msecs without a reply is a failure
+
+//  .split benchmark settings
+//  These are the settings for a whole suite; the defaults run a sweep
+//  over all transports that takes a minute or so:
+
+typedef struct {
+    char *transports;               //  Comma-separated transport names
+    int clients;                    //  Client threads per run
+    int workers;                    //  Worker threads per transport
+    int credit;                     //  Requests in flight per worker
+    int count;                      //  Requests per client per run
+    int sizes [MAX_VALUES];         //  Payload sizes, in bytes
+    int nbr_sizes;
+    int windows [MAX_VALUES];       //  Requests in flight per client
+    int nbr_windows;
+} settings_t;
+
+//  Parse a comma-separated list of positive integers, returns the number
+//  of values or -1 if the list isn't valid
+
+static int
+s_parse_list (char *list, int *values)
+{
+    int nbr_values = 0;
+    char *next = list;
+    while (*next && nbr_values < MAX_VALUES) {
+        char *end;
+        long value = strtol (next, &end, 10);
+        if (end == next || value < 1 || (*end && *end != ','))
+            return -1;
+        values [nbr_values++] = (int) value;
+        next = *end? end + 1: end;
+    }
+    return nbr_values? nbr_values: -1;
+}
+
+//  Print a list the same way we parse it
+
+static void
+s_print_list (char *option, int *values, int nbr_values)
+{
+    printf (" %s ", option);
+    int value_nbr;
+    for (value_nbr = 0; value_nbr < nbr_values; value_nbr++)
+        printf ("%s%d", value_nbr? ",": "", values [value_nbr]);
+}
+
+//  .split echo worker
+//  Each worker thread echoes requests until the process exits. Workers
+//  are started once per transport and serve all its runs:
+
+typedef struct {
+    char *endpoint;                 //  Broker endpoint
+    char *service;                  //  Echo service for this transport
+    int credit;                     //  Requests in flight per worker
+} worker_args_t;
+
+static void *
+s_echo_worker (void *args)
+{
+    worker_args_t *worker_args = (worker_args_t *) args;
+    mdwrk_t *session = mdwrk_new (worker_args->endpoint,
+                                  worker_args->service, 0);
+    mdwrk_set_credit (session, worker_args->credit);
+    zmsg_t *reply = NULL;
+    while (true) {
+        zmsg_t *request = mdwrk_recv (session, &reply);
+        if (request == NULL)
+            break;
+        reply = request;
+    }
+    mdwrk_destroy (&session);
+    return NULL;
+}
+
+//  .split benchmark client
+//  Each client thread keeps its window of requests in flight until it
+//  has had count replies. Every request carries its send time in its
+//  first 8 bytes, which the worker echoes back, so replies can arrive in
+//  any order. Rejected requests come back with a short status instead:
+
+typedef struct {
+    mdcli_t *session;               //  Session to the broker
+    char *service;                  //  Echo service to call
+    size_t size;                    //  Payload size
+    int window;                     //  Requests in flight
+    int count;                      //  Requests to send
+    int received;                   //  Replies received
+    int rejected;                   //  Of which rejected by the broker
+    mdhist_t *latency;              //  Round trip times, usecs
+} client_t;
+
+static void
+s_client_send (client_t *self, byte *payload)
+{
+    int64_t sent_at = zclock_usecs ();
+    memcpy (payload, &sent_at, sizeof (sent_at));
+    zmsg_t *request = zmsg_new ();
+    zmsg_addmem (request, payload, self->size);
+    mdcli_send (self->session, self->service, &request);
+}
+
+static void *
+s_client (void *args)
+{
+    client_t *self = (client_t *) args;
+    byte *payload = (byte *) zmalloc (self->size);
+    int sent;
+    for (sent = 0; sent < self->window && sent < self->count; sent++)
+        s_client_send (self, payload);
+    while (self->received < self->count) {
+        zmsg_t *reply = mdcli_recv (self->session, NULL);
+        if (!reply)
+            break;              //  Timeout or interrupt
+        zframe_t *body = zmsg_first (reply);
+        if (body && zframe_size (body) == self->size) {
+            int64_t sent_at;
+            memcpy (&sent_at, zframe_data (body), sizeof (sent_at));
+            mdhist_record (self->latency, zclock_usecs () - sent_at);
+        }
+        else
+            self->rejected++;
+        zmsg_destroy (&reply);
+        self->received++;
+        if (sent < self->count) {
+            s_client_send (self, payload);
+            sent++;
+        }
+    }
+    free (payload);
+    return NULL;
+}
+
+//  .split run method
+//  One run starts all clients at once, waits for all of them, and prints
+//  one CSV line. Throughput counts only requests that were answered:
+
+static void
+s_run (settings_t *settings, char *transport, char *endpoint,
+       char *service, size_t size, int window)
+{
+    client_t *clients = (client_t *)
+        zmalloc (settings->clients * sizeof (client_t));
+    pthread_t *threads = (pthread_t *)
+        zmalloc (settings->clients * sizeof (pthread_t));
+    int client_nbr;
+    for (client_nbr = 0; client_nbr < settings->clients; client_nbr++) {
+        client_t *client = &clients [client_nbr];
+        client->session = mdcli_new (endpoint, 0);
+        mdcli_set_timeout (client->session, CLIENT_TIMEOUT);
+        mdcli_set_retries (client->session, 1);     //  Don't resend
+        client->service = service;
+        client->size = size;
+        client->window = window;
+        client->count = settings->count;
+        client->latency = mdhist_new ();
+    }
+    int64_t start = zclock_usecs ();
+    for (client_nbr = 0; client_nbr < settings->clients; client_nbr++)
+        pthread_create (&threads [client_nbr], NULL,
+                        s_client, &clients [client_nbr]);
+
+    mdhist_t *latency = mdhist_new ();
+    int received = 0;
+    int rejected = 0;
+    for (client_nbr = 0; client_nbr < settings->clients; client_nbr++) {
+        client_t *client = &clients [client_nbr];
+        pthread_join (threads [client_nbr], NULL);
+        received += client->received;
+        rejected += client->rejected;
+        mdhist_merge (latency, client->latency);
+        mdhist_destroy (&client->latency);
+        mdcli_destroy (&client->session);
+    }
+    double seconds = (zclock_usecs () - start) / 1e6;
+    int requests = settings->clients * settings->count;
+    int answered = received - rejected;
+    printf ("%s,%d,%d,%d,%zu,%d,%d,%d,%d,%.6f,%.0f,%.2f,"
+            "%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n",
+            transport, settings->clients, settings->workers,
+            settings->credit, size, window, requests, rejected,
+            requests - received, seconds, answered / seconds,
+            answered * (double) size / seconds / 1e6,
+            mdhist_percentile (latency, 50.0),
+            mdhist_percentile (latency, 99.0),
+            mdhist_percentile (latency, 99.9),
+            mdhist_max (latency));
+    fflush (stdout);
+    mdhist_destroy (&latency);
+    free (threads);
+    free (clients);
+}
+
+//  .split main task
+//  We bind the embedded broker to one endpoint per transport we test,
+//  start the workers for each, and then run the sweep:
+
+int main (int argc, char *argv [])
+{
+    settings_t settings = { 0 };
+    settings.transports = "inproc,ipc,tcp";
+    settings.clients = 1;
+    settings.workers = 1;
+    settings.credit = 16;
+    settings.count = 10000;
+    settings.nbr_sizes = s_parse_list ("64,1024,16384,262144",
+                                       settings.sizes);
+    settings.nbr_windows = s_parse_list ("1,16,64", settings.windows);
+
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-t") && argn + 1 < argc)
+            settings.transports = argv [++argn];
+        else
+        if (streq (argv [argn], "-c") && argn + 1 < argc)
+            settings.clients = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-w") && argn + 1 < argc)
+            settings.workers = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-k") && argn + 1 < argc)
+            settings.credit = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            settings.count = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-s") && argn + 1 < argc)
+            settings.nbr_sizes = s_parse_list (argv [++argn],
+                                               settings.sizes);
+        else
+        if (streq (argv [argn], "-W") && argn + 1 < argc)
+            settings.nbr_windows = s_parse_list (argv [++argn],
+                                                 settings.windows);
+        else
+            break;
+    }
+    if (argn < argc
+    ||  settings.clients < 1 || settings.workers < 1
+    ||  settings.credit < 1 || settings.count < 1
+    ||  settings.nbr_sizes < 0 || settings.nbr_windows < 0) {
+        printf ("syntax: mdbench [-t inproc,ipc,tcp] [-c clients]"
+                " [-w workers] [-k credit] [-n requests]"
+                " [-s size,...] [-W window,...]\n");
+        return 1;
+    }
+    //  Requests carry their send time, so need room for it
+    int size_nbr;
+    for (size_nbr = 0; size_nbr < settings.nbr_sizes; size_nbr++)
+        if (settings.sizes [size_nbr] < (int) sizeof (int64_t))
+            settings.sizes [size_nbr] = sizeof (int64_t);
+
+    printf ("# mdbench -t %s -c %d -w %d -k %d -n %d", settings.transports,
+            settings.clients, settings.workers, settings.credit,
+            settings.count);
+    s_print_list ("-s", settings.sizes, settings.nbr_sizes);
+    s_print_list ("-W", settings.windows, settings.nbr_windows);
+    printf ("\ntransport,clients,workers,credit,size,window,requests,"
+            "rejected,failed,seconds,requests_per_sec,mb_per_sec,"
+            "p50_usec,p99_usec,p999_usec,max_usec\n");
+
+    mdbrk_t *broker = mdbrk_new ();
+    char *transports = strdup (settings.transports);
+    char *transport = strtok (transports, ",");
+    while (transport) {
+        char *endpoint;
+        if (streq (transport, "inproc"))
+            endpoint = strdup ("inproc://mdbench");
+        else
+        if (streq (transport, "ipc"))
+            endpoint = zsys_sprintf ("ipc:///tmp/mdbench-%d.ipc", getpid ());
+        else
+        if (streq (transport, "tcp"))
+            endpoint = strdup ("tcp://127.0.0.1:5556");
+        else {
+            printf ("E: unknown transport '%s'\n", transport);
+            break;
+        }
+        int rc = mdbrk_bind (broker, endpoint);
+        assert (rc != -1);
+
+        //  Each transport has its own service and workers, which run
+        //  until the process exits, so we never free their arguments
+        worker_args_t *worker_args = (worker_args_t *)
+            zmalloc (sizeof (worker_args_t));
+        worker_args->endpoint = endpoint;
+        worker_args->service = zsys_sprintf ("echo-%s", transport);
+        worker_args->credit = settings.credit;
+        int worker_nbr;
+        for (worker_nbr = 0; worker_nbr < settings.workers; worker_nbr++) {
+            pthread_t worker;
+            pthread_create (&worker, NULL, s_echo_worker, worker_args);
+            pthread_detach (worker);
+        }
+        zclock_sleep (500);         //  Let workers register
+
+        for (size_nbr = 0; size_nbr < settings.nbr_sizes; size_nbr++) {
+            int window_nbr;
+            for (window_nbr = 0; window_nbr < settings.nbr_windows;
+                 window_nbr++)
+                s_run (&settings, transport, endpoint, worker_args->service,
+                       settings.sizes [size_nbr],
+                       settings.windows [window_nbr]);
+        }
+        transport = strtok (NULL, ",");
+    }
+    free (transports);
+    mdbrk_destroy (&broker);
+    return 0;
+}
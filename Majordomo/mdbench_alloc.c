@@ -0,0 +1,190 @@
+//  Allocation benchmark
+//  Counts calls to malloc, calloc and realloc per request forwarded
+//  through an embedded broker over inproc, split into the client thread,
+//  the worker thread and its agent, and everything else, which is the
+//  broker. We wrap
+//  the C library allocator, so calls from libzmq and CZMQ count too.
+//  Build it as mdbench_alloc, with the broker's pools, and as
+//  mdbench_alloc_malloc, with MDPOOL_MALLOC, to compare the two. Takes
+//  the number of requests as an optional argument.
+
+//  Lets us build this source without creating a library
+#include "mdbrkapi.c"
+
+//  .split worker agent counter
+//  The worker API talks to the broker from an agent thread it starts
+//  itself, and those allocations are the worker's too. We start the
+//  worker API's actors through a shim that publishes where the actor
+//  thread's count lives, so the main thread can read it:
+
+static __thread uint64_t s_thread_allocs;
+static uint64_t *s_agent_allocs;
+static zactor_fn *s_agent_task;
+
+static void
+s_counted_actor (zsock_t *pipe, void *args)
+{
+    __atomic_store_n (&s_agent_allocs, &s_thread_allocs, __ATOMIC_RELEASE);
+    s_agent_task (pipe, args);
+}
+
+static zactor_t *
+s_counted_actor_new (zactor_fn *task, void *args)
+{
+    s_agent_task = task;
+    return zactor_new (s_counted_actor, args);
+}
+
+#define zactor_new(task,args) s_counted_actor_new (task, args)
+#include "mdwrkapi.c"
+#undef zactor_new
+#include "mdcliapi2.c"
+#include <pthread.h>
+
+#define ENDPOINT    "inproc://mdbench_alloc"
+#define WINDOW      16              //  Requests in flight
+#define PAYLOAD     64              //  Bytes per request
+
+//  .split allocator wrappers
+//  These take the place of the C library functions for the whole
+//  process, and count each call for the calling thread:
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static uint64_t s_allocs;               //  All threads
+
+void *
+malloc (size_t size)
+{
+    __atomic_add_fetch (&s_allocs, 1, __ATOMIC_RELAXED);
+    s_thread_allocs++;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    __atomic_add_fetch (&s_allocs, 1, __ATOMIC_RELAXED);
+    s_thread_allocs++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    __atomic_add_fetch (&s_allocs, 1, __ATOMIC_RELAXED);
+    s_thread_allocs++;
+    return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+    __libc_free (ptr);
+}
+
+//  .split echo worker
+//  The worker publishes where its thread's count lives, so the main
+//  thread can read it:
+
+static uint64_t *s_worker_allocs;
+
+static void *
+s_echo_worker (void *args)
+{
+    __atomic_store_n (&s_worker_allocs, &s_thread_allocs, __ATOMIC_RELEASE);
+    mdwrk_t *session = mdwrk_new (ENDPOINT, "echo", 0);
+    mdwrk_set_credit (session, WINDOW);
+    zmsg_t *reply = NULL;
+    while (true) {
+        zmsg_t *request = mdwrk_recv (session, &reply);
+        if (request == NULL)
+            break;
+        reply = request;
+    }
+    mdwrk_destroy (&session);
+    return NULL;
+}
+
+//  Send count requests and wait for their replies, returns the number
+//  of replies we got
+
+static int
+s_echo_run (mdcli_t *session, int count)
+{
+    byte payload [PAYLOAD] = { 0 };
+    int sent, received = 0;
+    for (sent = 0; sent < WINDOW && sent < count; sent++) {
+        zmsg_t *request = zmsg_new ();
+        zmsg_addmem (request, payload, PAYLOAD);
+        mdcli_send (session, "echo", &request);
+    }
+    while (received < count) {
+        zmsg_t *reply = mdcli_recv (session, NULL);
+        if (!reply)
+            break;
+        zmsg_destroy (&reply);
+        received++;
+        if (sent < count) {
+            zmsg_t *request = zmsg_new ();
+            zmsg_addmem (request, payload, PAYLOAD);
+            mdcli_send (session, "echo", &request);
+            sent++;
+        }
+    }
+    return received;
+}
+
+int main (int argc, char *argv [])
+{
+    int count = argc > 1? atoi (argv [1]): 100000;
+    mdbrk_t *broker = mdbrk_new ();
+    int rc = mdbrk_bind (broker, ENDPOINT);
+    assert (rc != -1);
+    pthread_t worker;
+    pthread_create (&worker, NULL, s_echo_worker, NULL);
+    pthread_detach (worker);
+    zclock_sleep (500);             //  Let worker register
+
+    mdcli_t *session = mdcli_new (ENDPOINT, 0);
+    mdcli_set_timeout (session, 10000);
+    //  Warm up, so the broker's pools and libzmq's queues are grown
+    if (s_echo_run (session, count / 10 + WINDOW) < count / 10 + WINDOW) {
+        printf ("E: warm-up failed\n");
+        return 1;
+    }
+    uint64_t *worker_allocs = __atomic_load_n (&s_worker_allocs,
+                                               __ATOMIC_ACQUIRE);
+    uint64_t *agent_allocs = __atomic_load_n (&s_agent_allocs,
+                                              __ATOMIC_ACQUIRE);
+    uint64_t total = __atomic_load_n (&s_allocs, __ATOMIC_RELAXED);
+    uint64_t client = s_thread_allocs;
+    uint64_t served = __atomic_load_n (worker_allocs, __ATOMIC_RELAXED)
+                    + __atomic_load_n (agent_allocs, __ATOMIC_RELAXED);
+
+    int received = s_echo_run (session, count);
+    total = __atomic_load_n (&s_allocs, __ATOMIC_RELAXED) - total;
+    client = s_thread_allocs - client;
+    served = __atomic_load_n (worker_allocs, __ATOMIC_RELAXED)
+           + __atomic_load_n (agent_allocs, __ATOMIC_RELAXED) - served;
+    mdcli_destroy (&session);
+    if (received < count) {
+        printf ("E: only %d of %d replies\n", received, count);
+        return 1;
+    }
+#ifdef MDPOOL_MALLOC
+    char *allocator = "malloc";
+#else
+    char *allocator = "pool";
+#endif
+    printf ("%-8s allocations per request: %.2f total, %.2f client,"
+            " %.2f worker, %.2f broker\n", allocator,
+            (double) total / count, (double) client / count,
+            (double) served / count,
+            (double) (total - client - served) / count);
+    mdbrk_destroy (&broker);
+    return 0;
+}
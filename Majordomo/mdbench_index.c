@@ -0,0 +1,95 @@
+//  Worker index microbenchmark
+//  Compares the broker's old worker lookup path (hex-encode the identity
+//  frame, then look it up in a zhash_t) with a direct mdindex lookup on
+//  the raw identity bytes, for 10k and 100k registered workers.
+
+//  Lets us build this source without creating a library
+#include "mdindex.c"
+
+#define LOOKUPS     2000000     //  Lookups per measurement
+
+//  Build identities the way libzmq does: a zero byte followed by a
+//  32-bit counter starting at a random value
+
+static zframe_t **
+s_identities_new (int count)
+{
+    zframe_t **identities = (zframe_t **) zmalloc (count * sizeof (zframe_t *));
+    uint32_t next_id = (uint32_t) random ();
+    int index;
+    for (index = 0; index < count; index++) {
+        byte id [5] = { 0 };
+        uint32_t value = next_id++;
+        memcpy (id + 1, &value, sizeof (value));
+        identities [index] = zframe_new (id, sizeof (id));
+    }
+    return identities;
+}
+
+static void
+s_benchmark (int workers)
+{
+    zframe_t **identities = s_identities_new (workers);
+    int *order = (int *) zmalloc (LOOKUPS * sizeof (int));
+    int index;
+    for (index = 0; index < LOOKUPS; index++)
+        order [index] = random () % workers;
+
+    zhash_t *hash = zhash_new ();
+    mdindex_t *mdindex = mdindex_new ();
+    for (index = 0; index < workers; index++) {
+        char *id_string = zframe_strhex (identities [index]);
+        zhash_insert (hash, id_string, identities [index]);
+        free (id_string);
+        mdindex_insert (mdindex, zframe_data (identities [index]),
+                        zframe_size (identities [index]), identities [index]);
+    }
+
+    //  Old path: two hex encodings and allocations per message
+    int64_t start = zclock_usecs ();
+    int found = 0;
+    for (index = 0; index < LOOKUPS; index++) {
+        zframe_t *sender = identities [order [index]];
+        char *id_string = zframe_strhex (sender);
+        if (zhash_lookup (hash, id_string))
+            found++;
+        free (id_string);
+        id_string = zframe_strhex (sender);
+        if (zhash_lookup (hash, id_string))
+            found++;
+        free (id_string);
+    }
+    int64_t zhash_usecs = zclock_usecs () - start;
+    assert (found == LOOKUPS * 2);
+
+    //  New path: one lookup on raw identity bytes
+    start = zclock_usecs ();
+    found = 0;
+    for (index = 0; index < LOOKUPS; index++) {
+        zframe_t *sender = identities [order [index]];
+        if (mdindex_lookup (mdindex, zframe_data (sender), zframe_size (sender)))
+            found++;
+    }
+    int64_t mdindex_usecs = zclock_usecs () - start;
+    assert (found == LOOKUPS);
+
+    printf ("%7d workers: zhash+strhex %10.0f msgs/sec, "
+            "mdindex %10.0f msgs/sec (x%.1f)\n", workers,
+            LOOKUPS * 1e6 / zhash_usecs, LOOKUPS * 1e6 / mdindex_usecs,
+            (double) zhash_usecs / mdindex_usecs);
+
+    mdindex_destroy (&mdindex);
+    zhash_destroy (&hash);
+    for (index = 0; index < workers; index++)
+        zframe_destroy (&identities [index]);
+    free (identities);
+    free (order);
+}
+
+int main (int argc, char *argv [])
+{
+    srandom ((unsigned) zclock_time ());
+    s_benchmark (10000);
+    s_benchmark (100000);
+    return 0;
+}
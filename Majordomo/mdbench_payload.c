@@ -0,0 +1,90 @@
+//  Payload throughput benchmark
+//  Runs an echo worker and an asynchronous client against a broker at
+//  tcp://localhost:5555 and measures request throughput for payloads
+//  from 64 bytes to 4 MB. Start mdbroker first.
+
+//  Lets us build this source without creating a library
+#include "mdwrkapi.c"
+#include "mdcliapi2.c"
+#include <pthread.h>
+
+#define BROKER      "tcp://localhost:5555"
+#define WINDOW      64              //  Requests in flight
+#define VOLUME      (256 << 20)     //  Bytes sent per payload size
+
+//  Echo worker, runs until the process exits
+
+static void *
+s_echo_worker (void *args)
+{
+    mdwrk_t *session = mdwrk_new (BROKER, "echo", 0);
+    zmsg_t *reply = NULL;
+    while (true) {
+        zmsg_t *request = mdwrk_recv (session, &reply);
+        if (request == NULL)
+            break;
+        reply = request;
+    }
+    mdwrk_destroy (&session);
+    return NULL;
+}
+
+static zmsg_t *
+s_request_new (byte *payload, size_t size)
+{
+    zmsg_t *request = zmsg_new ();
+    zmsg_addmem (request, payload, size);
+    return request;
+}
+
+int main (int argc, char *argv [])
+{
+    pthread_t worker;
+    pthread_create (&worker, NULL, s_echo_worker, NULL);
+    pthread_detach (worker);
+    zclock_sleep (500);             //  Let worker register
+
+    mdcli_t *session = mdcli_new (BROKER, 0);
+    mdcli_set_timeout (session, 10000);
+
+    size_t size;
+    for (size = 64; size <= (4 << 20); size *= 4) {
+        int count = VOLUME / size;
+        if (count < 100)
+            count = 100;
+        if (count > 100000)
+            count = 100000;
+        byte *payload = (byte *) zmalloc (size);
+
+        int64_t start = zclock_usecs ();
+        int sent, received = 0;
+        for (sent = 0; sent < WINDOW && sent < count; sent++) {
+            zmsg_t *request = s_request_new (payload, size);
+            mdcli_send (session, "echo", &request);
+        }
+        while (received < count) {
+            zmsg_t *reply = mdcli_recv (session, NULL);
+            if (!reply)
+                break;
+            zmsg_destroy (&reply);
+            received++;
+            if (sent < count) {
+                zmsg_t *request = s_request_new (payload, size);
+                mdcli_send (session, "echo", &request);
+                sent++;
+            }
+        }
+        int64_t usecs = zclock_usecs () - start;
+        free (payload);
+        if (received < count) {
+            printf ("E: only %d of %d replies for %zu bytes\n",
+                    received, count, size);
+            break;
+        }
+        printf ("%8zu bytes: %8d requests, %10.0f requests/sec, "
+                "%8.1f MB/sec\n", size, count,
+                count * 1e6 / usecs, (double) count * size / usecs);
+    }
+    mdcli_destroy (&session);
+    return 0;
+}
@@ -0,0 +1,76 @@
+//  Consistent hash ring benchmark
+//  Checks how evenly an mdring spreads keys over 10 to 1000 workers, how
+//  many keys move when one worker joins or leaves, which should be about
+//  1/N, and how fast lookups are.
+
+//  Lets us build this source without creating a library
+#include "mdring.c"
+
+#define REPLICAS    100         //  Points per worker, as in the broker
+#define KEYS        1000000     //  Routing keys per measurement
+
+static void
+s_benchmark (int workers)
+{
+    uint64_t *keys = (uint64_t *) zmalloc (KEYS * sizeof (uint64_t));
+    void **owners = (void **) zmalloc (KEYS * sizeof (void *));
+    size_t *load = (size_t *) zmalloc ((workers + 1) * sizeof (size_t));
+    int index;
+    for (index = 0; index < KEYS; index++) {
+        char key [16];
+        snprintf (key, sizeof (key), "key-%d", index);
+        keys [index] = mdring_hash ((byte *) key, strlen (key));
+    }
+    //  Workers are numbered from 1, so their items are never NULL; the
+    //  identity bytes are the worker number
+    mdring_t *ring = mdring_new (REPLICAS);
+    intptr_t worker;
+    for (worker = 1; worker <= workers; worker++)
+        mdring_insert (ring, (byte *) &worker, sizeof (worker),
+                       (void *) worker);
+
+    int64_t start = zclock_usecs ();
+    for (index = 0; index < KEYS; index++)
+        owners [index] = mdring_lookup (ring, keys [index]);
+    int64_t usecs = zclock_usecs () - start;
+    for (index = 0; index < KEYS; index++)
+        load [(intptr_t) owners [index]]++;
+    size_t busiest = 0;
+    for (worker = 1; worker <= workers; worker++)
+        if (load [worker] > busiest)
+            busiest = load [worker];
+
+    //  One more worker joins, then leaves again
+    intptr_t joiner = workers + 1;
+    mdring_insert (ring, (byte *) &joiner, sizeof (joiner),
+                   (void *) joiner);
+    int moved_on_join = 0;
+    for (index = 0; index < KEYS; index++)
+        if (mdring_lookup (ring, keys [index]) != owners [index])
+            moved_on_join++;
+    mdring_delete (ring, (void *) joiner);
+    int moved_on_leave = 0;
+    for (index = 0; index < KEYS; index++)
+        if (mdring_lookup (ring, keys [index]) != owners [index])
+            moved_on_leave++;
+
+    printf ("%5d workers: %6.1f M lookups/sec, busiest %.2fx average, "
+            "join moves %.2f%% (1/N = %.2f%%), leave restores %s\n",
+            workers, (double) KEYS / usecs,
+            (double) busiest * workers / KEYS,
+            moved_on_join * 100.0 / KEYS, 100.0 / (workers + 1),
+            moved_on_leave? "no": "all");
+
+    mdring_destroy (&ring);
+    free (keys);
+    free (owners);
+    free (load);
+}
+
+int main (void)
+{
+    s_benchmark (10);
+    s_benchmark (100);
+    s_benchmark (1000);
+    return 0;
+}
@@ -0,0 +1,99 @@
+//  Sharded broker load generator
+//  Runs one echo worker and one asynchronous client per service against
+//  a broker at tcp://localhost:5555, and prints the total request rate.
+//  Spreading load over many services lets a sharded broker use all its
+//  shards; bench_shards.sh runs this against 1 to 8 shards.
+//
+//  Usage: mdbench_shards [services [seconds]]
+
+//  Lets us build this source without creating a library
+#include "mdwrkapi.c"
+#include "mdcliapi2.c"
+#include <pthread.h>
+
+#define BROKER      "tcp://localhost:5555"
+#define WINDOW      100             //  Requests in flight per client
+
+static int seconds = 10;
+
+//  Echo worker, runs until the process exits
+
+static void *
+s_echo_worker (void *args)
+{
+    mdwrk_t *session = mdwrk_new (BROKER, (char *) args, 0);
+    zmsg_t *reply = NULL;
+    while (true) {
+        zmsg_t *request = mdwrk_recv (session, &reply);
+        if (request == NULL)
+            break;
+        reply = request;
+    }
+    mdwrk_destroy (&session);
+    return NULL;
+}
+
+//  Client keeps WINDOW requests in flight until time is up, and returns
+//  how many replies it got
+
+static void
+s_send_request (mdcli_t *session, char *service)
+{
+    zmsg_t *request = zmsg_new ();
+    zmsg_addstr (request, "Hello world");
+    mdcli_send (session, service, &request);
+}
+
+static void *
+s_client (void *args)
+{
+    char *service = (char *) args;
+    mdcli_t *session = mdcli_new (BROKER, 0);
+    int64_t replies = 0;
+    int count;
+    for (count = 0; count < WINDOW; count++)
+        s_send_request (session, service);
+
+    int64_t end = zclock_time () + seconds * 1000;
+    while (zclock_time () < end) {
+        zmsg_t *reply = mdcli_recv (session, NULL);
+        if (!reply)
+            break;
+        zmsg_destroy (&reply);
+        replies++;
+        s_send_request (session, service);
+    }
+    mdcli_destroy (&session);
+    return (void *) (intptr_t) replies;
+}
+
+int main (int argc, char *argv [])
+{
+    int services = argc > 1? atoi (argv [1]): 16;
+    if (argc > 2)
+        seconds = atoi (argv [2]);
+
+    char **names = (char **) zmalloc (services * sizeof (char *));
+    pthread_t *clients = (pthread_t *) zmalloc (services * sizeof (pthread_t));
+    int index;
+    for (index = 0; index < services; index++) {
+        names [index] = (char *) zmalloc (32);
+        snprintf (names [index], 32, "echo-%d", index);
+        pthread_t worker;
+        pthread_create (&worker, NULL, s_echo_worker, names [index]);
+        pthread_detach (worker);
+    }
+    zclock_sleep (1000);            //  Let workers register
+
+    for (index = 0; index < services; index++)
+        pthread_create (&clients [index], NULL, s_client, names [index]);
+    int64_t replies = 0;
+    for (index = 0; index < services; index++) {
+        void *result;
+        pthread_join (clients [index], &result);
+        replies += (intptr_t) result;
+    }
+    printf ("%d services: %.0f requests/sec\n", services,
+            (double) replies / seconds);
+    return 0;
+}
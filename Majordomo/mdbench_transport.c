@@ -0,0 +1,108 @@
+//  Transport benchmark
+//  Embeds a broker bound to inproc, ipc and tcp endpoints at once, and
+//  measures the request rate through it over each transport. Each
+//  transport gets its own echo worker and service, so the runs don't
+//  share workers. Takes the number of requests as an optional argument.
+
+//  Lets us build this source without creating a library
+#include "mdbrkapi.c"
+#include "mdwrkapi.c"
+#include "mdcliapi2.c"
+#include <pthread.h>
+
+#define WINDOW      64              //  Requests in flight
+#define PAYLOAD     64              //  Bytes per request
+
+typedef struct {
+    char *name;                     //  Transport name
+    char *endpoint;                 //  Broker endpoint
+    char *service;                  //  Echo service for this transport
+} transport_t;
+
+static transport_t s_transports [] = {
+    { "inproc", "inproc://mdbench",       "echo-inproc" },
+    { "ipc",    "ipc:///tmp/mdbench.ipc", "echo-ipc" },
+    { "tcp",    "tcp://127.0.0.1:5556",   "echo-tcp" }
+};
+#define NBR_TRANSPORTS  (sizeof (s_transports) / sizeof (transport_t))
+
+//  Echo worker, runs until the process exits
+
+static void *
+s_echo_worker (void *args)
+{
+    transport_t *transport = (transport_t *) args;
+    mdwrk_t *session = mdwrk_new (transport->endpoint,
+                                  transport->service, 0);
+    mdwrk_set_credit (session, WINDOW);
+    zmsg_t *reply = NULL;
+    while (true) {
+        zmsg_t *request = mdwrk_recv (session, &reply);
+        if (request == NULL)
+            break;
+        reply = request;
+    }
+    mdwrk_destroy (&session);
+    return NULL;
+}
+
+static zmsg_t *
+s_echo_request (byte *payload)
+{
+    zmsg_t *request = zmsg_new ();
+    zmsg_addmem (request, payload, PAYLOAD);
+    return request;
+}
+
+int main (int argc, char *argv [])
+{
+    int count = argc > 1? atoi (argv [1]): 100000;
+    mdbrk_t *broker = mdbrk_new ();
+    size_t transport_nbr;
+    for (transport_nbr = 0; transport_nbr < NBR_TRANSPORTS; transport_nbr++) {
+        int rc = mdbrk_bind (broker, s_transports [transport_nbr].endpoint);
+        assert (rc != -1);
+        pthread_t worker;
+        pthread_create (&worker, NULL, s_echo_worker,
+                        &s_transports [transport_nbr]);
+        pthread_detach (worker);
+    }
+    zclock_sleep (500);             //  Let workers register
+
+    byte payload [PAYLOAD] = { 0 };
+    for (transport_nbr = 0; transport_nbr < NBR_TRANSPORTS; transport_nbr++) {
+        transport_t *transport = &s_transports [transport_nbr];
+        mdcli_t *session = mdcli_new (transport->endpoint, 0);
+        mdcli_set_timeout (session, 10000);
+
+        int64_t start = zclock_usecs ();
+        int sent, received = 0;
+        for (sent = 0; sent < WINDOW && sent < count; sent++) {
+            zmsg_t *request = s_echo_request (payload);
+            mdcli_send (session, transport->service, &request);
+        }
+        while (received < count) {
+            zmsg_t *reply = mdcli_recv (session, NULL);
+            if (!reply)
+                break;
+            zmsg_destroy (&reply);
+            received++;
+            if (sent < count) {
+                zmsg_t *request = s_echo_request (payload);
+                mdcli_send (session, transport->service, &request);
+                sent++;
+            }
+        }
+        int64_t usecs = zclock_usecs () - start;
+        mdcli_destroy (&session);
+        if (received < count) {
+            printf ("E: only %d of %d replies over %s\n",
+                    received, count, transport->name);
+            break;
+        }
+        printf ("%-8s %8d requests, %10.0f requests/sec\n",
+                transport->name, count, count * 1e6 / usecs);
+    }
+    mdbrk_destroy (&broker);
+    return 0;
+}
@@ -0,0 +1,97 @@
+//  Waiting list scaling benchmark
+//  Replays the broker's dispatch pattern (take the oldest worker off the
+//  service waiting list, unlink it from the broker waiting list, later
+//  queue it again when it replies) against zlist_t and against intrusive
+//  mdlist_t links, with 1k, 10k and 100k idle workers.
+
+//  Lets us build this source without creating a library
+#include "mdlist.c"
+
+#define DISPATCHES  1000000     //  Dispatches per measurement
+
+typedef struct {
+    int id;
+    mdlink_t broker_link;
+    mdlink_t service_link;
+} worker_t;
+
+//  Dispatch to a service whose single worker always sits behind every
+//  idle worker of other services, at the back of the broker list. This
+//  is the case where zlist_remove scans the whole list.
+
+static int64_t
+s_zlist_dispatch (worker_t *workers, int idle, int dispatches)
+{
+    zlist_t *broker_waiting = zlist_new ();
+    zlist_t *bulk_waiting = zlist_new ();
+    zlist_t *echo_waiting = zlist_new ();
+    int index;
+    for (index = 0; index < idle; index++) {
+        zlist_append (broker_waiting, &workers [index]);
+        zlist_append (bulk_waiting, &workers [index]);
+    }
+    zlist_append (broker_waiting, &workers [idle]);
+    zlist_append (echo_waiting, &workers [idle]);
+
+    int64_t start = zclock_usecs ();
+    for (index = 0; index < dispatches; index++) {
+        worker_t *worker = (worker_t *) zlist_pop (echo_waiting);
+        zlist_remove (broker_waiting, worker);
+        zlist_append (broker_waiting, worker);
+        zlist_append (echo_waiting, worker);
+    }
+    int64_t usecs = zclock_usecs () - start;
+
+    zlist_destroy (&broker_waiting);
+    zlist_destroy (&bulk_waiting);
+    zlist_destroy (&echo_waiting);
+    return usecs;
+}
+
+static int64_t
+s_mdlist_dispatch (worker_t *workers, int idle)
+{
+    mdlist_t broker_waiting, bulk_waiting, echo_waiting;
+    mdlist_init (&broker_waiting);
+    mdlist_init (&bulk_waiting);
+    mdlist_init (&echo_waiting);
+    memset (workers, 0, (idle + 1) * sizeof (worker_t));
+    int index;
+    for (index = 0; index < idle; index++) {
+        mdlist_append (&broker_waiting, &workers [index].broker_link);
+        mdlist_append (&bulk_waiting, &workers [index].service_link);
+    }
+    mdlist_append (&broker_waiting, &workers [idle].broker_link);
+    mdlist_append (&echo_waiting, &workers [idle].service_link);
+
+    int64_t start = zclock_usecs ();
+    for (index = 0; index < DISPATCHES; index++) {
+        worker_t *worker = mdlist_item (mdlist_pop (&echo_waiting),
+                                        worker_t, service_link);
+        mdlist_remove (&broker_waiting, &worker->broker_link);
+        mdlist_append (&broker_waiting, &worker->broker_link);
+        mdlist_append (&echo_waiting, &worker->service_link);
+    }
+    return zclock_usecs () - start;
+}
+
+int main (int argc, char *argv [])
+{
+    int sizes [] = { 1000, 10000, 100000 };
+    int index;
+    for (index = 0; index < 3; index++) {
+        int idle = sizes [index];
+        worker_t *workers = (worker_t *) zmalloc ((idle + 1) * sizeof (worker_t));
+        //  zlist is O(n) per dispatch, so we time fewer of them
+        int zlist_dispatches = DISPATCHES / (idle / 1000) / 10;
+        int64_t zlist_usecs =
+            s_zlist_dispatch (workers, idle, zlist_dispatches);
+        int64_t mdlist_usecs = s_mdlist_dispatch (workers, idle);
+        printf ("%7d idle workers: zlist %10.0f dispatches/sec, "
+                "mdlist %10.0f dispatches/sec\n", idle,
+                zlist_dispatches * 1e6 / zlist_usecs,
+                DISPATCHES * 1e6 / mdlist_usecs);
+        free (workers);
+    }
+    return 0;
+}
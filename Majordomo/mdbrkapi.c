@@ -0,0 +1,2879 @@
+//  mdbrk class - Majordomo Protocol Broker API
+//  A minimal C implementation of the Majordomo Protocol as defined in
+//  http://rfc.zeromq.org/spec:7 and http://rfc.zeromq.org/spec:8.
+
+#include "mdbrkapi.h"
+#include "mdopts.h"
+
+//  Lets us build this source without creating a library
+#include "mdindex.c"
+#include "mdlist.c"
+#include "mdwheel.c"
+#include "mdhist.c"
+#include "mdjournal.c"
+#include "mdcache.c"
+#include "mdring.c"
+#include "mdshared.c"
+#include "mdpool.c"
+
+//  We'd normally pull these from config data
+
+#define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
+#define HEARTBEAT_INTERVAL  2500    //  msecs
+#define HEARTBEAT_EXPIRY    HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS
+#define TIMER_RESOLUTION    10      //  msecs per timer wheel tick
+#define STATS_INTERVAL      10000   //  msecs between verbose stats logs
+#define BATCH_SIZE          100     //  Default messages per wakeup
+#define QUEUE_MAX_REQUESTS  100000  //  Default queued requests per service
+#define QUEUE_MAX_BYTES     (256 << 20)     //  Default per service
+#define BROKER_MAX_BYTES    (1024 << 20)    //  Default for all services
+#define PRIORITY_AGING      1000    //  Default msecs per class promotion
+#define MAX_CREDIT          1000    //  Most requests in flight per worker
+#define RATE_INTERVAL       1000    //  msecs between dispatch rate samples
+#define JOURNAL_INTERVAL    10      //  Default msecs between journal syncs
+#define JOURNAL_BYTES       (4 << 20)       //  Default bytes between syncs
+#define JOURNAL_SEGMENT     (64 << 20)      //  Size of journal segments
+#define CACHE_MAX_BYTES     (64 << 20)      //  Default reply cache size
+#define MAX_CACHE_RULES     16      //  Most services cached by config
+#define MAX_COALESCE_RULES  16      //  Most services coalesced by config
+#define MAX_STICKY_RULES    16      //  Most services routed by config
+#define SERVICE_CACHE       8       //  Recently used services, power of 2
+#define RING_REPLICAS       100     //  Ring points per sticky worker
+#define LOAD_FACTOR         125     //  Default percent of average load a
+                                    //  sticky worker may take
+#define SHARD_PIPE_HWM      10000   //  Messages queued each way between
+                                    //  the front and a shard
+
+//  .split broker configuration
+//  Settings made through the mdbrk class, shared by the front and all
+//  shards.
+//  Cache, coalesce and sticky rules turn those features on for services
+//  without their workers asking:
+
+typedef struct {
+    char *service;              //  Service name
+    int64_t ttl;                //  Msecs its replies may be cached
+} cache_rule_t;
+
+typedef struct {
+    int verbose;                //  Print activity to stdout
+    int batch_size;             //  Max messages handled per wakeup
+    size_t queue_max_requests;  //  Max queued requests per service
+    size_t queue_max_bytes;     //  Max queued bytes per service
+    size_t max_bytes;           //  Max queued bytes for all services
+    int64_t aging;              //  Msecs waited per class promotion
+    char *journal;              //  Journal directory, if any
+    int64_t journal_interval;   //  Max msecs a write waits for a sync
+    size_t journal_bytes;       //  Max bytes written between syncs
+    size_t cache_max_bytes;     //  Max bytes in reply cache
+    cache_rule_t cache_rules [MAX_CACHE_RULES];
+    int nbr_cache_rules;        //  Cache rules in use
+    char *coalesce_rules [MAX_COALESCE_RULES];  //  Coalesced services
+    int nbr_coalesce_rules;     //  Coalesce rules in use
+    char *sticky_rules [MAX_STICKY_RULES];      //  Sticky services
+    int nbr_sticky_rules;       //  Sticky rules in use
+    int64_t load_factor;        //  Percent of average load per worker
+    int nbr_shards;             //  Dispatch shards, if more than one
+    char *endpoint;             //  Front's pipe to us, if a shard
+} config_t;
+
+//  .split broker class structure
+//  The broker class defines a single broker instance:
+
+typedef struct {
+    void *ctx;                  //  Our context
+    zsock_t *socket;            //  Socket for clients & workers
+    void *raw_socket;           //  Raw Socket for clients & workers
+    zsock_t *pipe;              //  Pipe to front thread, if a shard
+    zsock_t *control;           //  Pipe to mdbrk class, unless a shard
+    void *raw_control;          //  Raw pipe to mdbrk class
+    config_t config;            //  Broker configuration
+    int verbose;                //  Print activity to stdout
+    mdindex_t *services;        //  Known services, by name
+    mdindex_t *workers;         //  Known workers, by routing identity
+    mdlist_t waiting;           //  List of waiting workers
+    mdwheel_t *timers;          //  Worker expiry and heartbeat timers
+    int64_t now;                //  Clock time for this loop iteration
+    int64_t now_usecs;          //  Same, in usecs, for latency stats
+    int64_t wall;               //  Wall clock time, for client deadlines
+    int64_t wall_offset;        //  Wall clock less our own, msecs
+    mdtimer_t stats_timer;      //  Fires when stats are due, if verbose
+    mdtimer_t rate_timer;       //  Fires when dispatch rates are due
+    uint64_t batches;           //  Wakeups that received messages
+    uint64_t batched;           //  Messages received in those wakeups
+    size_t queued_bytes;        //  Bytes queued for all services
+    mdjournal_t *journal;       //  Request journal, if durable
+    mdtimer_t sync_timer;       //  Fires when journal sync is due
+    mdcache_t *cache;           //  Replies of cacheable services
+    void *recent [SERVICE_CACHE];   //  Services last looked up
+    mdpool_t *pool;             //  Our services, workers and requests
+} broker_t;
+
+static broker_t *
+    s_broker_new (zsock_t *pipe, config_t *config);
+static void
+    s_broker_destroy (broker_t **self_p);
+static int
+    s_broker_control (zsock_t *control, zsock_t *socket, int nbr_shards);
+static void
+    s_broker_run (broker_t *self);
+static void
+    s_broker_handle (broker_t *self, zmsg_t *msg);
+static void
+    s_broker_worker_msg (broker_t *self, zframe_t *sender, zmsg_t *msg);
+static void
+    s_broker_client_msg (broker_t *self, zmsg_t *msg, int has_options);
+static void
+    s_broker_envelope (broker_t *self, zframe_t *identity,
+                       const char *header, const char *field,
+                       size_t field_size, int more);
+static void
+    s_broker_purge (broker_t *self);
+static void
+    s_broker_stats (mdtimer_t *timer, void *argument);
+static void
+    s_broker_rates (mdtimer_t *timer, void *argument);
+static void
+    s_broker_cache_stats (broker_t *self, zmsg_t *msg);
+static void
+    s_broker_commit (broker_t *self);
+static void
+    s_broker_sync (mdtimer_t *timer, void *argument);
+static void
+    s_broker_replay (void *argument, uint64_t sequence, const char *name,
+                     int priority, uint64_t correlation, int64_t deadline,
+                     zmsg_t *msg);
+
+//  .split request class structure
+//  The request class holds one queued client request:
+
+typedef struct {
+    mdlink_t link;              //  Link in service request queue
+    mdlist_t *queue;            //  Queue or worker backlog we're in
+    mdpool_t *pool;             //  Pool we were allocated from
+    zmsg_t *msg;                //  Request, wrapped in client envelope
+    size_t size;                //  Message size, for queue limits
+    int64_t arrived;            //  When the broker received it, usecs
+    int priority;               //  Priority class
+    uint64_t sequence;          //  Journal sequence number, if journaled
+    uint64_t key;               //  Reply cache key, if cacheable
+    uint64_t route;             //  Routing key hash, if routed
+    int64_t deadline;           //  When the client gives up, 0 = never
+    uint64_t correlation;       //  Client's request ID, 0 = none
+    int indexed;                //  In service's index of correlated
+                                //  requests
+} request_t;
+
+static request_t *
+    s_request_new (mdpool_t *pool, zmsg_t **msg_p, mdopts_t *options,
+                   int64_t now);
+static void
+    s_request_destroy (request_t **self_p);
+static int
+    s_request_expired (request_t *self, int64_t now);
+
+//  .split service class structure
+//  The service class defines a single service instance. It queues
+//  requests separately for each priority class. A sticky service also
+//  keeps its workers on a consistent hash ring, and routed requests wait
+//  in their worker's own backlog rather than in the service queues:
+
+typedef struct {
+    broker_t *broker;           //  Broker instance
+    char *name;                 //  Service name
+    size_t name_size;           //  Service name length
+    mdlist_t requests [MDPC_PRIORITIES];    //  Queued client requests
+    size_t queued;              //  Requests queued in all classes
+    mdlist_t waiting;           //  List of waiting workers
+    mdlist_t registered;        //  List of all our workers
+    size_t workers;             //  How many workers we have
+    size_t queued_bytes;        //  Bytes in queued requests
+    uint64_t rejected;          //  Requests refused when queue was full
+    uint64_t expired;           //  Requests dropped past their deadline
+    uint64_t dispatched;        //  Requests sent to workers
+    uint64_t rate_mark;         //  Dispatched at last rate sample
+    uint32_t rate;              //  Dispatches per second, last sample
+    int64_t cache_ttl;          //  Msecs replies stay cached, 0 = never
+    mdindex_t *flights;         //  Requests in flight, if coalescing
+    mdring_t *ring;             //  Workers by routing key, if sticky
+    mdindex_t *correlated;      //  Queued requests by client identity and
+                                //  correlation ID, for cancels
+    size_t outstanding;         //  Requests sent and not yet replied to
+    size_t backlogged;          //  Requests in worker backlogs
+    uint64_t routed;            //  Requests routed by key
+    uint64_t overflowed;        //  Routed requests over the load bound
+    mdhist_t *queue_wait;       //  Usecs from arrival to dispatch
+    mdhist_t *service_time;     //  Usecs from dispatch to reply
+} service_t;
+
+static service_t *
+    s_service_lookup (broker_t *self, const byte *name, size_t size);
+static service_t *
+    s_service_require (broker_t *self, const byte *name, size_t size);
+static void
+    s_service_destroy (void *argument);
+static void
+    s_service_dispatch (service_t *service, request_t *request);
+static int
+    s_service_journal (service_t *self, request_t *request);
+static void
+    s_service_flush (service_t *self);
+static int
+    s_service_route (service_t *self, request_t *request);
+static void
+    s_service_enqueue (service_t *self, request_t *request);
+static void
+    s_service_index (service_t *self, request_t *request);
+static void
+    s_service_unindex (service_t *self, request_t *request);
+static void
+    s_service_coalesce (service_t *self);
+static void
+    s_service_sticky (service_t *self);
+static void
+    s_service_reply (service_t *self, zframe_t **client_p, zmsg_t **reply_p,
+                     uint64_t key, uint64_t correlation);
+static request_t *
+    s_service_next (service_t *self);
+static int
+    s_service_admit (service_t *self, size_t size);
+static void
+    s_service_reject (service_t *self, request_t **request_p);
+static void
+    s_service_drop (service_t *self, request_t **request_p);
+static void
+    s_service_cancel (service_t *self, zframe_t *client,
+                      uint64_t correlation);
+static void
+    s_service_latency (service_t *self, zmsg_t *msg);
+static void
+    s_service_stats (service_t *self, zmsg_t *msg);
+static void
+    s_service_workers (service_t *self, zmsg_t *msg, uint32_t offset,
+                       uint32_t count);
+
+//  .split flight class structure
+//  A coalescing service tracks each distinct request it has accepted
+//  until the reply comes back. Identical requests that arrive meanwhile
+//  only add their client's identity to the flight, the correlation ID
+//  the client wants back, and when the client gives up:
+
+typedef struct {
+    uint64_t key;               //  Hash of service and request
+    zmsg_t *waiters;            //  Identity, correlation ID and deadline
+                                //  frame triples
+} flight_t;
+
+static int64_t
+    s_flight_prune (flight_t *self, int64_t now);
+static void
+    s_flight_destroy (void *argument);
+
+//  .split worker class structure
+//  The worker class defines a single worker, idle or active. It keeps a
+//  record of what we need to know about each request it has outstanding,
+//  one per unit of credit. A worker that asked for tags gets each request
+//  with a tag naming its record, and returns the tag with the reply, so
+//  it may answer in any order. Other workers answer in order, so their
+//  reply is for the oldest record outstanding:
+
+typedef struct {
+    int64_t dispatched;         //  When we sent it, usecs
+    uint64_t sequence;          //  Journal sequence number, if any
+    uint64_t key;               //  Reply cache key, if any
+    uint64_t correlation;       //  Client's request ID, if any
+    uint32_t generation;        //  Bumped each time record is used
+    int busy;                   //  Request is outstanding
+    mdlink_t link;              //  In worker's sent or unused list
+} inflight_t;
+
+typedef struct {
+    broker_t *broker;           //  Broker instance
+    char *id_string;            //  Printable identity, if verbose
+    zframe_t *identity;         //  Identity frame for routing
+    service_t *service;         //  Owning service, if known
+    int64_t expiry;             //  When worker expires, if no heartbeat
+    uint32_t credit;            //  Requests worker accepts at once
+    uint32_t outstanding;       //  Requests sent and not yet replied to
+    int budgets;                //  Worker wants request budgets
+    int tags;                   //  Worker wants request tags
+    uint32_t batch;             //  Most requests per BATCH, 1 = no batches
+    inflight_t *inflight;       //  Records, one per unit of credit
+    mdlist_t sent;              //  Outstanding records, oldest first
+    mdlist_t unused;            //  Records free for new requests
+    mdlink_t broker_link;       //  Link in broker waiting list
+    mdlink_t service_link;      //  Link in service waiting list
+    mdlink_t member_link;       //  Link in service list of all workers
+    mdlist_t backlog;           //  Requests routed here, if sticky
+    mdtimer_t expiry_timer;     //  Fires at expiry
+    mdtimer_t heartbeat_timer;  //  Fires when HEARTBEAT is due
+} worker_t;
+
+static worker_t *
+    s_worker_require (broker_t *self, zframe_t *identity);
+static void
+    s_worker_delete (worker_t *self, int disconnect);
+static void
+    s_worker_destroy (void *argument);
+static void
+    s_worker_send (worker_t *self, char *command, char *option,
+                   zmsg_t **msg_p);
+static void
+    s_worker_reply (worker_t *self, zmsg_t **reply_p, uint64_t tag);
+static void
+    s_worker_waiting (worker_t *self);
+static void
+    s_worker_expired (mdtimer_t *timer, void *argument);
+static void
+    s_worker_heartbeat (mdtimer_t *timer, void *argument);
+static inflight_t *
+    s_service_assign (service_t *self, worker_t *worker,
+                      request_t *request);
+static void
+    s_service_send (service_t *self, worker_t *worker,
+                    request_t **request_p);
+static void
+    s_service_batch (service_t *self, worker_t *worker,
+                     request_t **request_p);
+static request_t *
+    s_service_backlog_next (service_t *self, worker_t *worker);
+
+//  .split utility functions
+//  MMI requests and replies carry binary integers in network byte order:
+
+static uint32_t
+s_get_uint32 (byte *buffer)
+{
+    return ((uint32_t) buffer [0] << 24) | ((uint32_t) buffer [1] << 16)
+         | ((uint32_t) buffer [2] << 8)  |  (uint32_t) buffer [3];
+}
+
+static byte *
+s_put_uint32 (byte *buffer, uint32_t value)
+{
+    buffer [0] = (byte) (value >> 24);
+    buffer [1] = (byte) (value >> 16);
+    buffer [2] = (byte) (value >> 8);
+    buffer [3] = (byte) value;
+    return buffer + 4;
+}
+
+static byte *
+s_put_uint64 (byte *buffer, uint64_t value)
+{
+    buffer = s_put_uint32 (buffer, (uint32_t) (value >> 32));
+    return s_put_uint32 (buffer, (uint32_t) value);
+}
+
+//  .split broker constructor and destructor
+//  Here are the constructor and destructor for the broker. A standalone
+//  broker owns its ROUTER socket; a broker running as a dispatch shard
+//  talks to the front thread over its actor pipe instead, and sends
+//  everything it would send on the ROUTER socket to the pipe. A durable
+//  broker queues again every request left in its journal. Returns NULL
+//  if it can't open its journal:
+
+static broker_t *
+s_broker_new (zsock_t *pipe, config_t *config)
+{
+    broker_t *self = (broker_t *) zmalloc (sizeof (broker_t));
+
+    //  Initialize broker state
+    self->ctx = zmq_ctx_new ();
+    self->pipe = pipe;
+    self->socket = pipe? pipe: zsock_new_router (NULL);
+    assert ( self->socket );
+    self->raw_socket = zsock_resolve (self->socket);
+    //  We drain the socket after each wakeup, so never block on it
+    zsock_set_rcvtimeo (self->socket, 0);
+    self->config = *config;
+    self->verbose = config->verbose;
+    self->services = mdindex_new ();
+    self->workers = mdindex_new ();
+    mdlist_init (&self->waiting);
+    //  We read the wall clock once, and keep it in step with our own
+    //  clock after that, so each loop reads only one clock
+    self->now_usecs = zclock_usecs ();
+    self->now = self->now_usecs / 1000;
+    self->wall_offset = zclock_time () - self->now;
+    self->wall = self->now + self->wall_offset;
+    self->timers = mdwheel_new (self->now, TIMER_RESOLUTION);
+    mdtimer_init (&self->stats_timer, s_broker_stats, self);
+    if (self->verbose)
+        mdwheel_schedule (self->timers, &self->stats_timer,
+                          self->now + STATS_INTERVAL);
+    mdtimer_init (&self->rate_timer, s_broker_rates, self);
+    mdwheel_schedule (self->timers, &self->rate_timer,
+                      self->now + RATE_INTERVAL);
+    mdtimer_init (&self->sync_timer, s_broker_sync, self);
+    self->cache = mdcache_new (config->cache_max_bytes);
+    self->pool = mdpool_new ();
+    if (config->journal) {
+        self->journal = mdjournal_new (config->journal, JOURNAL_SEGMENT);
+        if (!self->journal) {
+            s_broker_destroy (&self);
+            return NULL;            //  We can't run durable without it
+        }
+        size_t replayed = mdjournal_replay (self->journal,
+                                            s_broker_replay, self);
+        zclock_log ("I: replayed %zu requests from %s",
+                    replayed, config->journal);
+    }
+    return self;
+}
+
+static void
+s_broker_destroy (broker_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        broker_t *self = *self_p;
+        if (!self->pipe)
+            zsock_destroy (&self->socket);
+        zmq_ctx_destroy (&self->ctx);
+        service_t *service = (service_t *) mdindex_first (self->services);
+        while (service) {
+            s_service_destroy (service);
+            service = (service_t *) mdindex_next (self->services);
+        }
+        mdindex_destroy (&self->services);
+        worker_t *worker = (worker_t *) mdindex_first (self->workers);
+        while (worker) {
+            s_worker_destroy (worker);
+            worker = (worker_t *) mdindex_next (self->workers);
+        }
+        mdindex_destroy (&self->workers);
+        mdwheel_destroy (&self->timers);
+        mdjournal_destroy (&self->journal);
+        mdcache_destroy (&self->cache);
+        mdpool_destroy (&self->pool);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split broker control method
+//  This method handles one command from the mdbrk class. BIND binds the
+//  broker socket to an endpoint, and we reply with the port number, or
+//  -1 if the bind failed. We can bind as many endpoints as we like, of
+//  any transport. Note that MDP uses a single socket for both clients
+//  and workers. The front of a sharded broker handles the same commands.
+//  Returns -1 when the mdbrk instance is destroyed:
+
+static int
+s_broker_control (zsock_t *control, zsock_t *socket, int nbr_shards)
+{
+    zmsg_t *msg = zmsg_recv (control);
+    if (!msg)
+        return -1;              //  Interrupted
+    char *command = zmsg_popstr (msg);
+    int rc = 0;
+    if (!command || streq (command, "$TERM"))
+        rc = -1;
+    else
+    if (streq (command, "BIND")) {
+        char *endpoint = zmsg_popstr (msg);
+        int port = endpoint? zsock_bind (socket, "%s", endpoint): -1;
+        if (port == -1)
+            zclock_log ("E: can't bind to %s", endpoint? endpoint: "");
+        else
+        if (nbr_shards > 1)
+            zclock_log ("I: MDP broker/0.2.0 is active at %s with %d shards",
+                        endpoint, nbr_shards);
+        else
+            zclock_log ("I: MDP broker/0.2.0 is active at %s", endpoint);
+        zsock_send (control, "i", port);
+        free (endpoint);
+    }
+    else
+        zclock_log ("E: invalid command '%s'", command);
+    free (command);
+    zmsg_destroy (&msg);
+    return rc;
+}
+
+//  .split broker run method
+//  This method gets and processes messages forever or until interrupted.
+//  We wake up no later than the next worker timer, and read the clock
+//  once per iteration. We use the monotonic clock in usecs, which also
+//  times requests for the latency histograms. Each wakeup drains up to
+//  batch_size messages before we do any timer work, so under load we pay
+//  for one poll and one clock read per batch rather than per message. A
+//  shard also stops when its actor is destroyed, and an unsharded broker
+//  when its mdbrk instance is:
+
+static void
+s_broker_run (broker_t *self)
+{
+    int terminated = 0;
+    while (!terminated) {
+        zmq_pollitem_t items [] = {
+            { self->raw_socket,  0, ZMQ_POLLIN, 0 },
+            { self->raw_control, 0, ZMQ_POLLIN, 0 } };
+        int64_t timeout = mdwheel_timeout (self->timers, self->now);
+        if (timeout < 0 || timeout > HEARTBEAT_INTERVAL)
+            timeout = HEARTBEAT_INTERVAL;
+        int rc = zmq_poll (items, self->control? 2: 1,
+                           timeout * ZMQ_POLL_MSEC);
+        self->now_usecs = zclock_usecs ();
+        self->now = self->now_usecs / 1000;
+        self->wall = self->now + self->wall_offset;
+        if (rc == -1) {
+            if (self->verbose)
+                zclock_log ("I: polling error ( rc == -1)");
+            break;              //  Interrupted
+        }
+
+        //  Process input messages, if any. The socket has a zero receive
+        //  timeout, so zmsg_recv fails with EAGAIN once it is empty.
+        if (items [0].revents & ZMQ_POLLIN) {
+            int received = 0;
+            while (received < self->config.batch_size) {
+                zmsg_t *msg = zmsg_recv (self->socket);
+                if (!msg) {
+                    if (zmq_errno () == EAGAIN)
+                        break;  //  Drained
+                    if (self->verbose)
+                        zclock_log ("I: read empty message.");
+                    terminated = 1;
+                    break;      //  Interrupted
+                }
+                s_broker_handle (self, msg);
+                received++;
+            }
+            if (received) {
+                self->batches++;
+                self->batched += received;
+            }
+        }
+        if (self->control
+        &&  (items [1].revents & ZMQ_POLLIN)
+        &&  s_broker_control (self->control, self->socket, 1) == -1)
+            terminated = 1;
+        //  Disconnect and delete any expired workers
+        //  Send heartbeats to idle workers if needed
+        s_broker_purge (self);
+    }
+}
+
+//  .split broker handle method
+//  This method processes one message from a client or worker, which
+//  starts with the sender's routing identity and an empty delimiter.
+//  A client request keeps that envelope, as it is the envelope we send
+//  on to the worker:
+
+static void
+s_broker_handle (broker_t *self, zmsg_t *msg)
+{
+    if (self->verbose) {
+        zclock_log ("I: received message:");
+        zmsg_dump (msg);
+    }
+    zmsg_first (msg);           //  Sender
+    zmsg_next (msg);            //  Empty delimiter
+    zframe_t *header = zmsg_next (msg);
+
+    if (header && zframe_streq (header, MDPC_CLIENT))
+        s_broker_client_msg (self, msg, 0);
+    else
+    if (header && zframe_streq (header, MDPC_CLIENT_OPTS))
+        s_broker_client_msg (self, msg, 1);
+    else
+    if (header && zframe_streq (header, MDPW_WORKER)) {
+        zframe_t *sender = zmsg_pop (msg);
+        zframe_t *empty  = zmsg_pop (msg);
+        header = zmsg_pop (msg);
+        s_broker_worker_msg (self, sender, msg);
+        zframe_destroy (&sender);
+        zframe_destroy (&empty);
+        zframe_destroy (&header);
+    }
+    else {
+        zclock_log ("E: invalid message:");
+        zmsg_dump (msg);
+        zmsg_destroy (&msg);
+    }
+}
+
+//  .split broker envelope method
+//  Send the routing envelope and protocol header that go in front of a
+//  message body: the peer's identity, an empty delimiter, the protocol
+//  header, and the command or service name. These are all short, and
+//  libzmq keeps short frames inside the message itself, so sending them
+//  straight from our own buffers allocates nothing, where stacking them
+//  onto the body would allocate a frame and a list node for each. The
+//  caller sends the body next, if more is set:
+
+static void
+s_broker_envelope (broker_t *self, zframe_t *identity, const char *header,
+                   const char *field, size_t field_size, int more)
+{
+    zmq_send (self->raw_socket, zframe_data (identity),
+              zframe_size (identity), ZMQ_SNDMORE);
+    zmq_send (self->raw_socket, "", 0, ZMQ_SNDMORE);
+    zmq_send (self->raw_socket, header, strlen (header), ZMQ_SNDMORE);
+    zmq_send (self->raw_socket, field, field_size, more? ZMQ_SNDMORE: 0);
+}
+
+//  Send the envelope for a reply to a client. A client that gave its
+//  request a correlation ID gets it back in an options frame after the
+//  service name, so it can match replies to requests in any order:
+
+static void
+s_broker_client_envelope (broker_t *self, zframe_t *client,
+                          const char *service, size_t service_size,
+                          uint64_t correlation, int more)
+{
+    if (!correlation) {
+        s_broker_envelope (self, client, MDPC_CLIENT,
+                           service, service_size, more);
+        return;
+    }
+    s_broker_envelope (self, client, MDPC_CLIENT_OPTS,
+                       service, service_size, 1);
+    mdopts_t options;
+    mdopts_init (&options);
+    options.correlation = correlation;
+    byte buffer [MDOPTS_MAX];
+    size_t size = mdopts_pack (&options, buffer);
+    zmq_send (self->raw_socket, buffer, size, more? ZMQ_SNDMORE: 0);
+}
+
+//  .split broker worker_msg method
+//  This method processes one READY, REPLY, HEARTBEAT, or
+//  DISCONNECT message sent to the broker by a worker:
+
+static void
+s_broker_worker_msg (broker_t *self, zframe_t *sender, zmsg_t *msg)
+{
+    assert (zmsg_size (msg) >= 1);     //  At least, command
+
+    zframe_t *command = zmsg_pop (msg);
+    worker_t *worker = (worker_t *) mdindex_lookup (self->workers,
+        zframe_data (sender), zframe_size (sender));
+    int worker_ready = (worker != NULL);
+    if (!worker)
+        worker = s_worker_require (self, sender);
+    else
+    if (worker->service) {
+        //  Any message from a ready worker shows it's alive, whether or
+        //  not it has requests outstanding
+        worker->expiry = self->now + HEARTBEAT_EXPIRY;
+        mdwheel_schedule (self->timers, &worker->expiry_timer,
+                          worker->expiry);
+    }
+
+    if (zframe_streq (command, MDPW_READY)) {
+        if (worker_ready)               //  Not first command in session
+            s_worker_delete (worker, 1);
+        else
+        if (zframe_size (sender) >= 4  //  Reserved service name
+        &&  memcmp (zframe_data (sender), "mmi.", 4) == 0)
+            s_worker_delete (worker, 1);
+        else
+        if (!zmsg_first (msg)
+        ||  zframe_size (zmsg_first (msg)) > MDP_MAX_SERVICE) {
+            zclock_log ("E: invalid service name");
+            s_worker_delete (worker, 1);
+        }
+        else {
+            //  Attach worker to service and mark as idle. The worker may
+            //  add options after the service name, giving its credit,
+            //  letting us cache its replies, and asking for sticky
+            //  routing, for request budgets and tags, and for batches. A
+            //  batch never holds more requests than the worker's credit.
+            zframe_t *service_frame = zmsg_pop (msg);
+            zframe_t *options_frame = zmsg_pop (msg);
+            mdopts_t options;
+            mdopts_init (&options);
+            if (options_frame && mdopts_decode (&options, options_frame)) {
+                zclock_log ("E: invalid worker options");
+                mdopts_init (&options);
+            }
+            worker->credit = options.credit < MAX_CREDIT?
+                             options.credit: MAX_CREDIT;
+            worker->budgets = options.budgets;
+            worker->tags = options.tags;
+            worker->batch = options.batch < worker->credit?
+                            options.batch: worker->credit;
+            worker->inflight = (inflight_t *) mdpool_alloc (self->pool,
+                worker->credit * sizeof (inflight_t));
+            uint32_t index;
+            for (index = 0; index < worker->credit; index++)
+                mdlist_append (&worker->unused,
+                               &worker->inflight [index].link);
+            worker->service = s_service_require (self,
+                zframe_data (service_frame), zframe_size (service_frame));
+            if (options.cache_ttl)
+                worker->service->cache_ttl = options.cache_ttl;
+            if (options.coalesce)
+                s_service_coalesce (worker->service);
+            if (options.sticky)
+                s_service_sticky (worker->service);
+            worker->service->workers++;
+            mdlist_append (&worker->service->registered,
+                           &worker->member_link);
+            if (worker->service->ring)
+                mdring_insert (worker->service->ring,
+                               zframe_data (worker->identity),
+                               zframe_size (worker->identity), worker);
+            s_worker_waiting (worker);
+            zframe_destroy (&service_frame);
+            zframe_destroy (&options_frame);
+        }
+    }
+    else
+    if (zframe_streq (command, MDPW_REPLY)) {
+        if (worker_ready) {
+            //  A worker that takes tags puts the request's tag in an
+            //  options frame before the client envelope
+            mdopts_t options;
+            mdopts_init (&options);
+            if (worker->tags) {
+                zframe_t *options_frame = zmsg_pop (msg);
+                if (!options_frame
+                ||  mdopts_decode (&options, options_frame))
+                    zclock_log ("E: invalid reply options");
+                zframe_destroy (&options_frame);
+            }
+            s_worker_reply (worker, &msg, options.tag);
+            s_worker_waiting (worker);
+        }
+        else
+            s_worker_delete (worker, 1);
+    }
+    else
+    if (zframe_streq (command, MDPW_BATCH)) {
+        //  Split the batch into its replies, and handle each as if it
+        //  came in its own REPLY
+        if (worker_ready) {
+            zframe_t *header;
+            while ((header = zmsg_pop (msg))) {
+                mdopts_t options;
+                int rc = mdopts_decode (&options, header);
+                zframe_destroy (&header);
+                if (rc == -1 || options.frames < 2
+                ||  options.frames > zmsg_size (msg)) {
+                    zclock_log ("E: invalid batch item");
+                    break;
+                }
+                zmsg_t *reply = zmsg_new ();
+                uint32_t frame_nbr;
+                for (frame_nbr = 0; frame_nbr < options.frames; frame_nbr++) {
+                    zframe_t *frame = zmsg_pop (msg);
+                    zmsg_append (reply, &frame);
+                }
+                s_worker_reply (worker, &reply, options.tag);
+            }
+            s_worker_waiting (worker);
+        }
+        else
+            s_worker_delete (worker, 1);
+    }
+    else
+    if (zframe_streq (command, MDPW_HEARTBEAT)) {
+        if (!worker_ready)              //  Expiry was refreshed above
+            s_worker_delete (worker, 1);
+    }
+    else
+    if (zframe_streq (command, MDPW_DISCONNECT))
+        s_worker_delete (worker, 0);
+    else {
+        zclock_log ("E: invalid input message");
+        zmsg_dump (msg);
+    }
+    zframe_destroy (&command);
+    zmsg_destroy (&msg);
+}
+
+//  .split broker client_msg method
+//  Process a request coming from a client. We implement MMI requests
+//  directly here: mmi.service, mmi.latency, which returns the latency
+//  summaries of the named service, and mmi.stats, mmi.workers and
+//  mmi.cache, which return the binary records described in mdp.h. The
+//  name of the service asked about is the first frame of the body, and
+//  mmi.workers may take a second frame saying which workers to list. An
+//  empty name asks mmi.stats for all services; in sharded mode, that
+//  means all services of one shard, and mmi.cache reports on the cache
+//  of the shard owning the named service. Requests to cacheable services
+//  may be answered from the cache. If the client sent request options,
+//  they follow the service name; a routing key among them only matters
+//  to sticky services. A client deadline is on the wall clock, and we
+//  move it to our own clock as the request arrives. A correlation ID goes
+//  back to the client with whatever answer the request gets. A client may
+//  also cancel a request it sent, by its correlation ID; the cancel has
+//  no body:
+
+static void
+s_broker_client_msg (broker_t *self, zmsg_t *msg, int has_options)
+{
+    assert (zmsg_size (msg) >= 4 + has_options);
+
+    //  The message starts with the client envelope, which we leave where
+    //  it is, and we take the protocol header, service name and options
+    //  out from behind it. What is left is the request wrapped in its
+    //  client envelope, without our having to build a new one.
+    zframe_t *sender = zmsg_first (msg);
+    zmsg_next (msg);                        //  Empty delimiter
+    zframe_t *header = zmsg_next (msg);
+    zframe_t *service_frame = zmsg_next (msg);
+    zframe_t *options_frame = has_options? zmsg_next (msg): NULL;
+    zmsg_remove (msg, header);
+    zframe_destroy (&header);
+    zmsg_remove (msg, service_frame);
+    mdopts_t options;
+    mdopts_init (&options);
+    uint64_t route = 0;
+    if (has_options) {
+        zmsg_remove (msg, options_frame);
+        int rc = mdopts_decode (&options, options_frame);
+        if (rc == 0 && options.route_size)
+            route = mdring_hash (options.route, options.route_size);
+        zframe_destroy (&options_frame);
+        if (rc == -1) {
+            zclock_log ("E: invalid request options");
+            zframe_destroy (&service_frame);
+            zmsg_destroy (&msg);
+            return;
+        }
+    }
+    if (zframe_size (service_frame) > MDP_MAX_SERVICE) {
+        zclock_log ("E: service name too long");
+        zframe_destroy (&service_frame);
+        zmsg_destroy (&msg);
+        return;
+    }
+    if (options.cancel) {
+        service_t *service = s_service_lookup (self,
+            zframe_data (service_frame), zframe_size (service_frame));
+        if (service && options.correlation)
+            s_service_cancel (service, sender, options.correlation);
+        zframe_destroy (&service_frame);
+        zmsg_destroy (&msg);
+        return;
+    }
+    assert (zmsg_size (msg) >= 3);          //  Envelope and body
+    service_t *service = s_service_require (self,
+        zframe_data (service_frame), zframe_size (service_frame));
+
+    //  Answer repeated requests to cacheable services from the cache,
+    //  keyed on the request body after the client envelope
+    uint64_t key = 0;
+    if (service->cache_ttl || service->flights)
+        key = mdcache_key (service->name, msg);
+    if (service->cache_ttl) {
+        zmsg_t *reply = mdcache_lookup (self->cache, key, self->now);
+        if (reply) {
+            s_broker_client_envelope (self, sender, service->name,
+                                      service->name_size,
+                                      options.correlation,
+                                      zmsg_size (reply) > 0);
+            zmsg_send (&reply, self->socket);
+            zframe_destroy (&service_frame);
+            zmsg_destroy (&msg);
+            return;
+        }
+    }
+    //  Wait for an identical request in flight, if we coalesce them
+    if (service->flights) {
+        flight_t *flight = (flight_t *) mdindex_lookup (service->flights,
+            (byte *) &key, sizeof (key));
+        if (flight) {
+            int64_t deadline = 0;
+            if (options.deadline) {
+                deadline = self->now + (options.deadline - self->wall);
+                if (deadline <= 0)
+                    deadline = 1;
+            }
+            zframe_t *client = zframe_dup (sender);
+            zmsg_append (flight->waiters, &client);
+            zmsg_addmem (flight->waiters, &options.correlation,
+                         sizeof (options.correlation));
+            zmsg_addmem (flight->waiters, &deadline, sizeof (deadline));
+            zframe_destroy (&service_frame);
+            zmsg_destroy (&msg);
+            return;
+        }
+    }
+
+    //  If we got a MMI service request, process that internally
+    if (zframe_size (service_frame) >= 4
+    &&  memcmp (zframe_data (service_frame), "mmi.", 4) == 0) {
+        zmsg_first (msg);                   //  Client identity
+        zmsg_next (msg);                    //  Empty delimiter
+        zframe_t *query = zmsg_next (msg);
+        if (!query) {
+            zmsg_addmem (msg, "", 0);
+            query = zmsg_last (msg);
+        }
+        zframe_t *page = zmsg_next (msg);
+        uint32_t offset = 0;
+        uint32_t count = MDPC_WORKERS_PAGE;
+        if (page) {
+            if (zframe_size (page) == 8) {
+                offset = s_get_uint32 (zframe_data (page));
+                count = s_get_uint32 (zframe_data (page) + 4);
+            }
+            zmsg_remove (msg, page);
+            zframe_destroy (&page);
+        }
+        service_t *target = s_service_lookup (self,
+            zframe_data (query), zframe_size (query));
+
+        char *return_code;
+        if (zframe_streq (service_frame, "mmi.service"))
+            return_code = target && target->workers?
+                MDPC_OK: MDPC_NOT_FOUND;
+        else
+        if (zframe_streq (service_frame, "mmi.latency")
+        ||  zframe_streq (service_frame, "mmi.workers"))
+            return_code = target? MDPC_OK: MDPC_NOT_FOUND;
+        else
+        if (zframe_streq (service_frame, "mmi.stats"))
+            return_code = target || zframe_size (query) == 0?
+                MDPC_OK: MDPC_NOT_FOUND;
+        else
+        if (zframe_streq (service_frame, "mmi.cache"))
+            return_code = MDPC_OK;
+        else
+            return_code = MDPC_NOT_IMPLEMENTED;
+        zframe_reset (query, return_code, strlen (return_code));
+
+        if (streq (return_code, MDPC_OK)) {
+            if (zframe_streq (service_frame, "mmi.latency"))
+                s_service_latency (target, msg);
+            else
+            if (zframe_streq (service_frame, "mmi.workers"))
+                s_service_workers (target, msg, offset, count);
+            else
+            if (zframe_streq (service_frame, "mmi.cache"))
+                s_broker_cache_stats (self, msg);
+            else
+            if (zframe_streq (service_frame, "mmi.stats") && target)
+                s_service_stats (target, msg);
+            else
+            if (zframe_streq (service_frame, "mmi.stats")) {
+                target = (service_t *) mdindex_first (self->services);
+                while (target) {
+                    if (strncmp (target->name, "mmi.", 4))
+                        s_service_stats (target, msg);
+                    target = (service_t *) mdindex_next (self->services);
+                }
+            }
+        }
+
+        //  Remove client return envelope and send the reply behind the
+        //  protocol header and service name
+        zframe_t *client = zmsg_unwrap (msg);
+        s_broker_client_envelope (self, client,
+                                  (char *) zframe_data (service_frame),
+                                  zframe_size (service_frame),
+                                  options.correlation, 1);
+        zmsg_send (&msg, self->socket);
+        zframe_destroy (&client);
+    }
+    else {
+        //  Else dispatch the message to the requested service
+        request_t *request = s_request_new (self->pool, &msg, &options,
+                                            self->now_usecs);
+        request->key = key;
+        request->correlation = options.correlation;
+        if (service->ring)
+            request->route = route;
+        if (options.deadline) {
+            request->deadline = self->now + (options.deadline - self->wall);
+            if (request->deadline <= 0)
+                request->deadline = 1;
+        }
+        s_service_dispatch (service, request);
+    }
+    zframe_destroy (&service_frame);
+}
+
+//  .split broker purge method
+//  This method deletes any workers that haven't pinged us in a while,
+//  and sends heartbeats to workers that are due one. Each ready worker,
+//  busy or not, has an expiry and a heartbeat timer on the broker's
+//  timer wheel, so we only touch workers whose timers have fired. This
+//  is essential when we have large numbers of workers (we call this
+//  method after each batch of messages):
+
+static void
+s_broker_purge (broker_t *self)
+{
+    mdwheel_execute (self->timers, self->now);
+}
+
+//  .split broker stats method
+//  In verbose mode we log how well batching works every STATS_INTERVAL
+//  msecs, and the queue depths and latencies of busy services:
+
+static void
+s_broker_stats (mdtimer_t *timer, void *argument)
+{
+    broker_t *self = (broker_t *) argument;
+    zclock_log ("I: %" PRIu64 " messages in %" PRIu64 " batches, "
+                "average batch size %.1f", self->batched, self->batches,
+                self->batches? (double) self->batched / self->batches: 0.0);
+    if (mdcache_hits (self->cache) || mdcache_misses (self->cache))
+        zclock_log ("I: cache hits=%" PRIu64 " misses=%" PRIu64
+                    " evictions=%" PRIu64 " entries=%zu bytes=%zu",
+                    mdcache_hits (self->cache), mdcache_misses (self->cache),
+                    mdcache_evictions (self->cache),
+                    mdcache_size (self->cache), mdcache_bytes (self->cache));
+    zclock_log ("I: pool holds %zu KB", mdpool_bytes (self->pool) >> 10);
+    service_t *service = (service_t *) mdindex_first (self->services);
+    while (service) {
+        if (service->queued)
+            zclock_log ("I: %s queued high=%zu normal=%zu low=%zu bulk=%zu",
+                service->name,
+                mdlist_size (&service->requests [MDPC_PRIORITY_HIGH]),
+                mdlist_size (&service->requests [MDPC_PRIORITY_NORMAL]),
+                mdlist_size (&service->requests [MDPC_PRIORITY_LOW]),
+                mdlist_size (&service->requests [MDPC_PRIORITY_BULK]));
+        if (service->expired)
+            zclock_log ("I: %s dropped %" PRIu64 " expired requests",
+                        service->name, service->expired);
+        if (service->routed)
+            zclock_log ("I: %s routed=%" PRIu64 " overflowed=%" PRIu64
+                        " backlogged=%zu", service->name, service->routed,
+                        service->overflowed, service->backlogged);
+        if (mdhist_count (service->queue_wait)) {
+            zmsg_t *summaries = zmsg_new ();
+            s_service_latency (service, summaries);
+            char *summary;
+            while ((summary = zmsg_popstr (summaries))) {
+                zclock_log ("I: %s %s", service->name, summary);
+                free (summary);
+            }
+            zmsg_destroy (&summaries);
+        }
+        service = (service_t *) mdindex_next (self->services);
+    }
+    mdwheel_schedule (self->timers, timer, self->now + STATS_INTERVAL);
+}
+
+//  Every RATE_INTERVAL msecs we sample how many requests each service
+//  dispatched, for mmi.stats:
+
+static void
+s_broker_rates (mdtimer_t *timer, void *argument)
+{
+    broker_t *self = (broker_t *) argument;
+    service_t *service = (service_t *) mdindex_first (self->services);
+    while (service) {
+        service->rate = (uint32_t) ((service->dispatched - service->rate_mark)
+                                    * 1000 / RATE_INTERVAL);
+        service->rate_mark = service->dispatched;
+        service = (service_t *) mdindex_next (self->services);
+    }
+    mdwheel_schedule (self->timers, timer, self->now + RATE_INTERVAL);
+}
+
+//  .split broker cache stats method
+//  Append the mmi.cache record: hits, misses, evictions, expirations,
+//  entries and bytes, 8 bytes each:
+
+static void
+s_broker_cache_stats (broker_t *self, zmsg_t *msg)
+{
+    zframe_t *frame = zframe_new (NULL, MDPC_CACHE_RECORD);
+    byte *buffer = zframe_data (frame);
+    buffer = s_put_uint64 (buffer, mdcache_hits (self->cache));
+    buffer = s_put_uint64 (buffer, mdcache_misses (self->cache));
+    buffer = s_put_uint64 (buffer, mdcache_evictions (self->cache));
+    buffer = s_put_uint64 (buffer, mdcache_expirations (self->cache));
+    buffer = s_put_uint64 (buffer, mdcache_size (self->cache));
+    buffer = s_put_uint64 (buffer, mdcache_bytes (self->cache));
+    zmsg_append (msg, &frame);
+}
+
+//  .split broker journal methods
+//  A durable broker appends each request it accepts to its journal, and
+//  a tombstone when the request is answered. We sync the journal once
+//  config.journal_bytes have been written, or config.journal_interval
+//  msecs after the first write since the last sync, whichever comes
+//  first, so one sync covers every request in that window:
+
+static void
+s_broker_commit (broker_t *self)
+{
+    size_t pending = mdjournal_pending (self->journal);
+    if (pending >= self->config.journal_bytes) {
+        mdjournal_sync (self->journal);
+        mdwheel_cancel (self->timers, &self->sync_timer);
+    }
+    else
+    if (pending && !mdtimer_scheduled (&self->sync_timer))
+        mdwheel_schedule (self->timers, &self->sync_timer,
+                          self->now + self->config.journal_interval);
+}
+
+static void
+s_broker_sync (mdtimer_t *timer, void *argument)
+{
+    broker_t *self = (broker_t *) argument;
+    mdjournal_sync (self->journal);
+}
+
+//  Queue a request left in the journal by a previous run. The request
+//  keeps its client envelope and correlation ID, so the reply goes to the
+//  same identity if that client connects again; a client with a generated
+//  identity will simply have retried by then. The journal holds the
+//  client's deadline on the wall clock, and we drop requests whose client
+//  gave up while we were down:
+
+static void
+s_broker_replay (void *argument, uint64_t sequence, const char *name,
+                 int priority, uint64_t correlation, int64_t deadline,
+                 zmsg_t *msg)
+{
+    broker_t *self = (broker_t *) argument;
+    if (deadline && deadline <= self->wall) {
+        mdjournal_remove (self->journal, sequence);
+        zmsg_destroy (&msg);
+        return;
+    }
+    service_t *service = s_service_require (self,
+                                            (byte *) name, strlen (name));
+
+    mdopts_t options;
+    mdopts_init (&options);
+    options.priority = priority;
+    request_t *request = s_request_new (self->pool, &msg, &options,
+                                        self->now_usecs);
+    request->sequence = sequence;
+    request->correlation = correlation;
+    if (deadline)
+        request->deadline = self->now + (deadline - self->wall);
+    s_service_enqueue (service, request);
+}
+
+//  .split service methods
+//  Here is the implementation of the methods that work on a service:
+
+//  Locate a service by the raw bytes of its name, as they arrive in a
+//  frame. We intern each service name once, and never delete services,
+//  so we can remember the last few services we found in a small table
+//  indexed by name length and last byte. Clients mostly call the same
+//  few services, so most lookups are one memcmp and never hash the name
+//  or allocate:
+
+static service_t *
+s_service_lookup (broker_t *self, const byte *name, size_t size)
+{
+    size_t slot = (size + (size? name [size - 1]: 0)) & (SERVICE_CACHE - 1);
+    service_t *service = (service_t *) self->recent [slot];
+    if (service
+    &&  service->name_size == size
+    &&  memcmp (service->name, name, size) == 0)
+        return service;
+
+    service = (service_t *) mdindex_lookup (self->services, name, size);
+    if (service)
+        self->recent [slot] = service;
+    return service;
+}
+
+//  Lazy constructor that locates a service by name or creates a new
+//  service if there is no service already with that name. A new service
+//  is cacheable, coalescing or sticky if the configuration says so.
+//  Names are at most MDP_MAX_SERVICE bytes.
+
+static service_t *
+s_service_require (broker_t *self, const byte *name, size_t size)
+{
+    assert (size <= MDP_MAX_SERVICE);
+    service_t *service = s_service_lookup (self, name, size);
+    if (service == NULL) {
+        service = (service_t *) mdpool_alloc (self->pool,
+                                              sizeof (service_t));
+        service->broker = self;
+        service->name = (char *) mdpool_alloc (self->pool, size + 1);
+        memcpy (service->name, name, size);
+        service->name_size = size;
+        int priority;
+        for (priority = 0; priority < MDPC_PRIORITIES; priority++)
+            mdlist_init (&service->requests [priority]);
+        mdlist_init (&service->waiting);
+        mdlist_init (&service->registered);
+        int rule;
+        for (rule = 0; rule < self->config.nbr_cache_rules; rule++)
+            if (streq (self->config.cache_rules [rule].service,
+                       service->name))
+                service->cache_ttl = self->config.cache_rules [rule].ttl;
+        for (rule = 0; rule < self->config.nbr_coalesce_rules; rule++)
+            if (streq (self->config.coalesce_rules [rule], service->name))
+                s_service_coalesce (service);
+        for (rule = 0; rule < self->config.nbr_sticky_rules; rule++)
+            if (streq (self->config.sticky_rules [rule], service->name))
+                s_service_sticky (service);
+        service->queue_wait = mdhist_new ();
+        service->service_time = mdhist_new ();
+        mdindex_insert (self->services, name, size, service);
+        if (self->verbose)
+            zclock_log ("I: added service: %s", service->name);
+    }
+    return service;
+}
+
+//  Service destructor, called for each service when the broker is
+//  destroyed.
+
+static void
+s_service_destroy (void *argument)
+{
+    service_t *service = (service_t *) argument;
+    request_t *request;
+    while ((request = s_service_next (service)))
+        s_request_destroy (&request);
+    mdhist_destroy (&service->queue_wait);
+    mdhist_destroy (&service->service_time);
+    if (service->flights) {
+        flight_t *flight = (flight_t *) mdindex_first (service->flights);
+        while (flight) {
+            s_flight_destroy (flight);
+            flight = (flight_t *) mdindex_next (service->flights);
+        }
+        mdindex_destroy (&service->flights);
+    }
+    mdring_destroy (&service->ring);
+    mdindex_destroy (&service->correlated);
+    mdpool_t *pool = service->broker->pool;
+    mdpool_free (pool, service->name, service->name_size + 1);
+    mdpool_free (pool, service, sizeof (service_t));
+}
+
+//  .split service dispatch method
+//  This method sends requests to waiting workers. A request that would
+//  have to wait in a full queue is refused instead, before it reaches
+//  the journal, and so is one the journal can't take, as we could not
+//  promise to keep it. One whose client has already given up is dropped.
+//  We also drop requests that expire while queued, as we take them off
+//  the queues. A sticky service routes a request with a routing key to
+//  its worker, and only queues it if that worker is over its load bound:
+
+static void
+s_service_dispatch (service_t *self, request_t *request)
+{
+    assert (self);
+    if (request && s_request_expired (request, self->broker->now))
+        s_service_drop (self, &request);
+    if (request) {              //  Queue request if any
+        if (mdlist_size (&self->waiting) == 0
+        &&  !s_service_admit (self, request->size))
+            s_service_reject (self, &request);
+        else
+        if (s_service_journal (self, request))
+            s_service_reject (self, &request);
+        else {
+            if (self->flights && request->key) {
+                flight_t *flight = (flight_t *) zmalloc (sizeof (flight_t));
+                flight->key = request->key;
+                flight->waiters = zmsg_new ();
+                mdindex_insert (self->flights, (byte *) &flight->key,
+                                sizeof (uint64_t), flight);
+            }
+            if (!request->route || !s_service_route (self, request))
+                s_service_enqueue (self, request);
+        }
+    }
+    s_service_flush (self);
+}
+
+//  Write a request to the journal, if we keep one. We move its deadline
+//  back to the wall clock, as our own clock restarts with us. Returns 0
+//  if the request is safe, or -1 if the journal could not take it:
+
+static int
+s_service_journal (service_t *self, request_t *request)
+{
+    broker_t *broker = self->broker;
+    if (!broker->journal)
+        return 0;
+    int64_t deadline = request->deadline?
+        request->deadline + (broker->wall - broker->now): 0;
+    request->sequence = mdjournal_append (broker->journal, self->name,
+        request->priority, request->correlation, deadline, request->msg);
+    if (request->sequence == 0) {
+        zclock_log ("E: journal failed, rejected request for %s",
+                    self->name);
+        return -1;
+    }
+    s_broker_commit (broker);
+    return 0;
+}
+
+//  Send queued requests to waiting workers, for as long as we have both.
+//  Each worker is linked into both waiting lists, so taking it off the
+//  broker list is O(1) no matter how many other workers are idle. A
+//  worker that takes batches gets as many of the queued requests as it
+//  will take at once, so batches fill up when requests queue, and we
+//  never hold a request back to wait for more:
+
+static void
+s_service_flush (service_t *self)
+{
+    while (mdlist_size (&self->waiting) && self->queued) {
+        worker_t *worker = mdlist_item (mdlist_first (&self->waiting),
+                                        worker_t, service_link);
+        request_t *request = s_service_next (self);
+        if (s_request_expired (request, self->broker->now))
+            s_service_drop (self, &request);
+        if (!request)
+            continue;           //  Nobody wants it any more
+        if (worker->batch > 1)
+            s_service_batch (self, worker, &request);
+        else
+            s_service_send (self, worker, &request);
+    }
+}
+
+//  .split service send methods
+//  Hand one request to one of our workers. A worker stays on the waiting
+//  lists, behind the others, until it has as many requests outstanding
+//  as its credit allows. We record how long each request waited, and
+//  when we sent it, so the reply can give us the worker's service time.
+//  Returns the request's record:
+
+static inflight_t *
+s_service_assign (service_t *self, worker_t *worker, request_t *request)
+{
+    mdlist_remove (&self->waiting, &worker->service_link);
+    mdlist_remove (&self->broker->waiting, &worker->broker_link);
+    inflight_t *inflight = mdlist_item (mdlist_pop (&worker->unused),
+                                        inflight_t, link);
+    assert (inflight);
+    mdlist_append (&worker->sent, &inflight->link);
+    if (++inflight->generation == 0)
+        inflight->generation = 1;   //  So no tag is ever zero
+    inflight->busy = 1;
+    worker->outstanding++;
+    if (worker->outstanding < worker->credit) {
+        mdlist_append (&self->broker->waiting, &worker->broker_link);
+        mdlist_append (&self->waiting, &worker->service_link);
+    }
+    self->outstanding++;
+    mdhist_record (self->queue_wait,
+                   self->broker->now_usecs - request->arrived);
+    self->dispatched++;
+    inflight->dispatched = self->broker->now_usecs;
+    inflight->sequence = request->sequence;
+    inflight->key = request->key;
+    inflight->correlation = request->correlation;
+    return inflight;
+}
+
+//  Return the tag of a request's record: the record's index, and its
+//  generation, so a reply to an earlier use of the record doesn't match
+
+static uint64_t
+s_inflight_tag (worker_t *worker, inflight_t *inflight)
+{
+    return ((uint64_t) inflight->generation << 32)
+         | (uint32_t) (inflight - worker->inflight);
+}
+
+//  Send one request to one of our workers in a REQUEST. A worker that
+//  asked for budgets or tags gets an options frame before the client
+//  envelope, with the msecs left until the client's deadline, and the
+//  request's tag:
+
+static void
+s_service_send (service_t *self, worker_t *worker, request_t **request_p)
+{
+    request_t *request = *request_p;
+    inflight_t *inflight = s_service_assign (self, worker, request);
+    if (worker->budgets || worker->tags) {
+        mdopts_t options;
+        mdopts_init (&options);
+        if (worker->budgets && request->deadline)
+            options.budget = request->deadline - self->broker->now;
+        if (worker->tags)
+            options.tag = s_inflight_tag (worker, inflight);
+        zframe_t *options_frame = mdopts_encode (&options);
+        zmsg_prepend (request->msg, &options_frame);
+    }
+    s_worker_send (worker, MDPW_REQUEST, NULL, &request->msg);
+    s_request_destroy (request_p);
+}
+
+//  Send a worker that takes batches as many queued requests as its batch
+//  size and credit allow, starting with this one, in one BATCH. Each item
+//  has its own client envelope, and its own budget and tag if the worker
+//  asked for them. We move the frames of each request into the batch, so
+//  we still never copy a request body:
+
+static void
+s_service_batch (service_t *self, worker_t *worker, request_t **request_p)
+{
+    zmsg_t *batch = zmsg_new ();
+    request_t *request = *request_p;
+    *request_p = NULL;
+    uint32_t items = 0;
+    while (request) {
+        inflight_t *inflight = s_service_assign (self, worker, request);
+        mdopts_t options;
+        mdopts_init (&options);
+        options.frames = (uint32_t) zmsg_size (request->msg);
+        if (worker->budgets && request->deadline)
+            options.budget = request->deadline - self->broker->now;
+        if (worker->tags)
+            options.tag = s_inflight_tag (worker, inflight);
+        zframe_t *header = mdopts_encode (&options);
+        zmsg_append (batch, &header);
+        zframe_t *frame;
+        while ((frame = zmsg_pop (request->msg)))
+            zmsg_append (batch, &frame);
+        s_request_destroy (&request);
+        if (++items == worker->batch
+        ||  worker->outstanding == worker->credit)
+            break;
+        while (self->queued && !request) {
+            request = s_service_next (self);
+            if (s_request_expired (request, self->broker->now))
+                s_service_drop (self, &request);
+        }
+    }
+    s_worker_send (worker, MDPW_BATCH, NULL, &batch);
+}
+
+//  .split service route method
+//  Route a request with a routing key to the worker that owns the key on
+//  the ring. This is consistent hashing with bounded loads: no worker may
+//  take more than config.load_factor percent of the average load, counting
+//  requests outstanding and in backlogs, and this request. If the owner
+//  has credit we send the request at once, else it waits in the owner's
+//  backlog, which the owner serves before the service queues. Returns 0
+//  if the owner is over its bound, and the request goes to the service
+//  queues for whichever worker is waiting:
+
+static int
+s_service_route (service_t *self, request_t *request)
+{
+    worker_t *worker = (worker_t *) mdring_lookup (self->ring,
+                                                   request->route);
+    if (!worker)
+        return 0;               //  No workers yet
+    size_t total = self->outstanding + self->backlogged + 1;
+    size_t bound = (total * self->broker->config.load_factor
+                  + 100 * self->workers - 1) / (100 * self->workers);
+    if (worker->outstanding + mdlist_size (&worker->backlog) >= bound) {
+        self->overflowed++;
+        return 0;
+    }
+    self->routed++;
+    if (worker->outstanding < worker->credit
+    &&  mdlist_size (&worker->backlog) == 0)
+        s_service_send (self, worker, &request);
+    else {
+        mdlist_append (&worker->backlog, &request->link);
+        request->queue = &worker->backlog;
+        s_service_index (self, request);
+        self->backlogged++;
+        self->queued_bytes += request->size;
+        self->broker->queued_bytes += request->size;
+    }
+    return 1;
+}
+
+//  Take the oldest request off a worker's backlog, if any
+
+static request_t *
+s_service_backlog_next (service_t *self, worker_t *worker)
+{
+    request_t *request = mdlist_item (mdlist_pop (&worker->backlog),
+                                      request_t, link);
+    if (request) {
+        s_service_unindex (self, request);
+        self->backlogged--;
+        self->queued_bytes -= request->size;
+        self->broker->queued_bytes -= request->size;
+    }
+    return request;
+}
+
+//  Add a request to the queue for its priority class
+
+static void
+s_service_enqueue (service_t *self, request_t *request)
+{
+    mdlist_append (&self->requests [request->priority], &request->link);
+    request->queue = &self->requests [request->priority];
+    s_service_index (self, request);
+    self->queued++;
+    self->queued_bytes += request->size;
+    self->broker->queued_bytes += request->size;
+}
+
+//  .split service cancel index
+//  Hedging clients cancel requests by client identity and correlation
+//  ID, and under overload they cancel many, so we index each queued
+//  request that has a correlation ID. The key is the correlation ID and
+//  as much of the identity as fits; a cancel checks the whole identity.
+//  A client that reuses a correlation ID for requests queued together
+//  can only cancel the first of them:
+
+static size_t
+s_service_key (zframe_t *client, uint64_t correlation, byte *key)
+{
+    size_t size = zframe_size (client);
+    if (size > MDINDEX_MAX_KEY - sizeof (correlation))
+        size = MDINDEX_MAX_KEY - sizeof (correlation);
+    memcpy (key, &correlation, sizeof (correlation));
+    memcpy (key + sizeof (correlation), zframe_data (client), size);
+    return sizeof (correlation) + size;
+}
+
+//  Index a request we have queued or backlogged
+
+static void
+s_service_index (service_t *self, request_t *request)
+{
+    if (!request->correlation)
+        return;
+    if (!self->correlated)
+        self->correlated = mdindex_new ();
+    byte key [MDINDEX_MAX_KEY];
+    size_t size = s_service_key (zmsg_first (request->msg),
+                                 request->correlation, key);
+    request->indexed =
+        mdindex_insert (self->correlated, key, size, request) == 0;
+}
+
+//  Remove a request from the index as we take it off its queue
+
+static void
+s_service_unindex (service_t *self, request_t *request)
+{
+    if (!request->indexed)
+        return;
+    byte key [MDINDEX_MAX_KEY];
+    size_t size = s_service_key (zmsg_first (request->msg),
+                                 request->correlation, key);
+    mdindex_delete (self->correlated, key, size);
+    request->indexed = 0;
+}
+
+//  Start coalescing identical requests to this service
+
+static void
+s_service_coalesce (service_t *self)
+{
+    if (!self->flights)
+        self->flights = mdindex_new ();
+}
+
+//  Start routing requests to this service by key, putting any workers we
+//  already have on the ring
+
+static void
+s_service_sticky (service_t *self)
+{
+    if (self->ring)
+        return;
+    self->ring = mdring_new (RING_REPLICAS);
+    mdlink_t *link = mdlist_first (&self->registered);
+    while (link) {
+        worker_t *worker = mdlist_item (link, worker_t, member_link);
+        mdring_insert (self->ring, zframe_data (worker->identity),
+                       zframe_size (worker->identity), worker);
+        link = mdlist_next (&self->registered, link);
+    }
+}
+
+//  .split service reply method
+//  Send a reply to the client that asked for it, and to the clients of
+//  any identical requests we coalesced with it that haven't given up yet.
+//  They all get the same shared frames, so fanning out a reply doesn't
+//  copy its body:
+
+static void
+s_service_reply (service_t *self, zframe_t **client_p, zmsg_t **reply_p,
+                 uint64_t key, uint64_t correlation)
+{
+    zmsg_t *reply = *reply_p;
+    *reply_p = NULL;
+    int more = zmsg_size (reply) > 0;
+
+    flight_t *flight = NULL;
+    if (self->flights && key)
+        flight = (flight_t *) mdindex_delete (self->flights,
+            (byte *) &key, sizeof (key));
+    if (!flight || zmsg_size (flight->waiters) == 0) {
+        s_broker_client_envelope (self->broker, *client_p, self->name,
+                                  self->name_size, correlation, more);
+        zframe_destroy (client_p);
+        zmsg_send (&reply, self->broker->socket);
+    }
+    else {
+        int64_t deadline = 0;
+        zmsg_pushmem (flight->waiters, &deadline, sizeof (deadline));
+        zmsg_pushmem (flight->waiters, &correlation, sizeof (correlation));
+        zmsg_prepend (flight->waiters, client_p);
+        mdshared_t *shared = mdshared_new (&reply);
+        zframe_t *client;
+        while ((client = zmsg_pop (flight->waiters))) {
+            zframe_t *correlation_frame = zmsg_pop (flight->waiters);
+            memcpy (&correlation, zframe_data (correlation_frame),
+                    sizeof (correlation));
+            zframe_destroy (&correlation_frame);
+            zframe_t *deadline_frame = zmsg_pop (flight->waiters);
+            memcpy (&deadline, zframe_data (deadline_frame),
+                    sizeof (deadline));
+            zframe_destroy (&deadline_frame);
+            if (deadline && deadline <= self->broker->now) {
+                zframe_destroy (&client);
+                continue;       //  Client has given up
+            }
+            s_broker_client_envelope (self->broker, client, self->name,
+                                      self->name_size, correlation, more);
+            zframe_destroy (&client);
+            if (more)
+                mdshared_send (shared, self->broker->socket);
+        }
+        mdshared_destroy (&shared);
+    }
+    if (flight)
+        s_flight_destroy (flight);
+}
+
+//  .split service priority method
+//  Take the next request off the service queues. We serve classes in
+//  strict priority order, except that a request is promoted by one class
+//  for every config.aging msecs it has waited, so bulk requests are not
+//  starved by a steady stream of urgent ones. Each class is FIFO, so we
+//  only need to look at the head of each queue:
+
+static request_t *
+s_service_next (service_t *self)
+{
+    int64_t aging = self->broker->config.aging;
+    request_t *next = NULL;
+    int64_t next_rank = 0;
+    int priority;
+    for (priority = 0; priority < MDPC_PRIORITIES; priority++) {
+        request_t *request = mdlist_item (
+            mdlist_first (&self->requests [priority]), request_t, link);
+        if (!request)
+            continue;
+        int64_t rank = priority;
+        if (aging > 0)
+            rank -= (self->broker->now_usecs - request->arrived)
+                  / (aging * 1000);
+        if (!next || rank < next_rank) {
+            next = request;
+            next_rank = rank;
+        }
+        if (aging <= 0)
+            break;              //  Strict priority, first class wins
+    }
+    if (next) {
+        mdlist_remove (&self->requests [next->priority], &next->link);
+        s_service_unindex (self, next);
+        self->queued--;
+        self->queued_bytes -= next->size;
+        self->broker->queued_bytes -= next->size;
+    }
+    return next;
+}
+
+//  .split service queue limits
+//  Return true if a request of this size fits in the service queue and
+//  in the broker's overall budget. A limit of zero means no limit:
+
+static int
+s_service_admit (service_t *self, size_t size)
+{
+    config_t *config = &self->broker->config;
+    if (config->queue_max_requests
+    &&  self->queued >= config->queue_max_requests)
+        return 0;
+    if (config->queue_max_bytes
+    &&  self->queued_bytes + size > config->queue_max_bytes)
+        return 0;
+    if (config->max_bytes
+    &&  self->broker->queued_bytes + size > config->max_bytes)
+        return 0;
+    return 1;
+}
+
+//  Refuse a request by replying at once with MDPC_UNAVAILABLE in place of
+//  the reply body, so the client fails fast instead of timing out:
+
+static void
+s_service_reject (service_t *self, request_t **request_p)
+{
+    zframe_t *client = zmsg_unwrap ((*request_p)->msg);
+    uint64_t correlation = (*request_p)->correlation;
+    s_request_destroy (request_p);
+
+    s_broker_client_envelope (self->broker, client, self->name,
+                              self->name_size, correlation, 1);
+    zmq_send (self->broker->raw_socket, MDPC_UNAVAILABLE,
+              strlen (MDPC_UNAVAILABLE), 0);
+    zframe_destroy (&client);
+    self->rejected++;
+    if (self->broker->verbose)
+        zclock_log ("W: queue full, rejected request for %s", self->name);
+}
+
+//  Drop a request whose client has given up on it. We don't reply, as
+//  nobody is waiting. If clients coalesced with it are still waiting, we
+//  keep the request for them instead, until the last of them gives up,
+//  and leave it in *request_p for the caller to send on:
+
+static void
+s_service_drop (service_t *self, request_t **request_p)
+{
+    request_t *request = *request_p;
+    if (self->flights && request->key) {
+        flight_t *flight = (flight_t *) mdindex_lookup (self->flights,
+            (byte *) &request->key, sizeof (uint64_t));
+        int64_t deadline = flight?
+            s_flight_prune (flight, self->broker->now): -1;
+        if (deadline >= 0) {
+            request->deadline = deadline;
+            if (self->broker->verbose)
+                zclock_log ("I: deadline passed, kept request for %s for"
+                            " coalesced clients", self->name);
+            return;
+        }
+        s_flight_destroy (mdindex_delete (self->flights,
+            (byte *) &request->key, sizeof (uint64_t)));
+    }
+    if (request->sequence) {
+        mdjournal_remove (self->broker->journal, request->sequence);
+        s_broker_commit (self->broker);
+    }
+    s_request_destroy (request_p);
+    self->expired++;
+    if (self->broker->verbose)
+        zclock_log ("W: deadline passed, dropped request for %s", self->name);
+}
+
+//  .split service cancel method
+//  Take back a queued or backlogged request that its client no longer
+//  wants. Once a worker has the request, it's too late, and the client
+//  drops the reply. A request that other clients coalesced with stays,
+//  as they still want its reply:
+
+static void
+s_service_cancel (service_t *self, zframe_t *client, uint64_t correlation)
+{
+    if (!self->correlated)
+        return;
+    byte key [MDINDEX_MAX_KEY];
+    size_t size = s_service_key (client, correlation, key);
+    request_t *request = (request_t *) mdindex_lookup (self->correlated,
+                                                       key, size);
+    if (!request || !zframe_eq (zmsg_first (request->msg), client))
+        return;
+    if (self->flights && request->key) {
+        flight_t *flight = (flight_t *) mdindex_lookup (self->flights,
+            (byte *) &request->key, sizeof (uint64_t));
+        if (flight && zmsg_size (flight->waiters))
+            return;
+        s_flight_destroy (mdindex_delete (self->flights,
+            (byte *) &request->key, sizeof (uint64_t)));
+    }
+    s_service_unindex (self, request);
+    mdlist_remove (request->queue, &request->link);
+    if (request->queue == &self->requests [request->priority])
+        self->queued--;
+    else
+        self->backlogged--;
+    self->queued_bytes -= request->size;
+    self->broker->queued_bytes -= request->size;
+    if (request->sequence) {
+        mdjournal_remove (self->broker->journal, request->sequence);
+        s_broker_commit (self->broker);
+    }
+    s_request_destroy (&request);
+    if (self->broker->verbose)
+        zclock_log ("I: cancelled queued request for %s", self->name);
+}
+
+//  .split service latency method
+//  Append one summary frame for queue wait and one for service time to
+//  a message. Reading a histogram is a single pass over its buckets, so
+//  we can answer this between requests without holding up dispatch:
+
+static void
+s_service_latency (service_t *self, zmsg_t *msg)
+{
+    char *summary = mdhist_summary (self->queue_wait, "queue");
+    zmsg_addstr (msg, summary);
+    free (summary);
+    summary = mdhist_summary (self->service_time, "service");
+    zmsg_addstr (msg, summary);
+    free (summary);
+}
+
+//  .split service stats methods
+//  These append the binary mmi.stats and mmi.workers records. The stats
+//  record is a fixed header and the name. Worker records go into one
+//  frame, which we size first and then fill in place, with at most one
+//  page of workers per reply, so the reply stays small however many
+//  workers the service has. We find the page by walking the service's
+//  list of workers from the start:
+
+static void
+s_service_stats (service_t *self, zmsg_t *msg)
+{
+    size_t name_size = strlen (self->name);
+    zframe_t *frame = zframe_new (NULL, MDPC_STATS_HEADER + name_size);
+    byte *buffer = zframe_data (frame);
+    buffer = s_put_uint32 (buffer,
+                           (uint32_t) (self->queued + self->backlogged));
+    buffer = s_put_uint32 (buffer, (uint32_t) mdlist_size (&self->waiting));
+    buffer = s_put_uint32 (buffer, (uint32_t) self->workers);
+    buffer = s_put_uint32 (buffer, self->rate);
+    buffer = s_put_uint64 (buffer, self->dispatched);
+    buffer = s_put_uint64 (buffer, self->rejected);
+    buffer = s_put_uint64 (buffer, self->expired);
+    int priority;
+    for (priority = 0; priority < MDPC_PRIORITIES; priority++)
+        buffer = s_put_uint32 (buffer,
+            (uint32_t) mdlist_size (&self->requests [priority]));
+    memcpy (buffer, self->name, name_size);
+    zmsg_append (msg, &frame);
+}
+
+static void
+s_service_workers (service_t *self, zmsg_t *msg, uint32_t offset,
+                   uint32_t count)
+{
+    if (count > MDPC_WORKERS_PAGE)
+        count = MDPC_WORKERS_PAGE;
+    mdlink_t *first = mdlist_first (&self->registered);
+    uint32_t index;
+    for (index = 0; index < offset && first; index++)
+        first = mdlist_next (&self->registered, first);
+
+    size_t size = 0;
+    mdlink_t *link;
+    for (link = first, index = 0; link && index < count;
+         link = mdlist_next (&self->registered, link), index++) {
+        worker_t *worker = mdlist_item (link, worker_t, member_link);
+        size += 1 + zframe_size (worker->identity) + 1 + 4 + 4 + 4;
+    }
+    mdlink_t *rest = link;
+    zframe_t *frame = zframe_new (NULL, size);
+    byte *buffer = zframe_data (frame);
+    for (link = first; link != rest;
+         link = mdlist_next (&self->registered, link)) {
+        worker_t *worker = mdlist_item (link, worker_t, member_link);
+        size_t id_size = zframe_size (worker->identity);
+        *buffer++ = (byte) id_size;
+        memcpy (buffer, zframe_data (worker->identity), id_size);
+        buffer += id_size;
+        *buffer++ = worker->outstanding == 0? MDPC_WORKER_IDLE:
+                    worker->outstanding < worker->credit? MDPC_WORKER_BUSY:
+                    MDPC_WORKER_FULL;
+        buffer = s_put_uint32 (buffer, worker->outstanding);
+        buffer = s_put_uint32 (buffer, worker->credit);
+        int32_t expires = (int32_t) (worker->expiry - self->broker->now);
+        buffer = s_put_uint32 (buffer, (uint32_t) expires);
+    }
+    zmsg_append (msg, &frame);
+    if (rest) {
+        //  More workers follow; tell the client where to ask from
+        byte more [4];
+        s_put_uint32 (more, offset + index);
+        zmsg_addmem (msg, more, sizeof (more));
+    }
+}
+
+//  .split request methods
+//  A request takes ownership of the client's message. Requests come and
+//  go with every message, so they live in the broker's pool:
+
+static request_t *
+s_request_new (mdpool_t *pool, zmsg_t **msg_p, mdopts_t *options,
+               int64_t now)
+{
+    request_t *self = (request_t *) mdpool_alloc (pool, sizeof (request_t));
+    self->pool = pool;
+    self->msg = *msg_p;
+    self->size = zmsg_content_size (self->msg);
+    self->arrived = now;
+    self->priority = options->priority;
+    *msg_p = NULL;
+    return self;
+}
+
+static void
+s_request_destroy (request_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        request_t *self = *self_p;
+        zmsg_destroy (&self->msg);
+        mdpool_free (self->pool, self, sizeof (request_t));
+        *self_p = NULL;
+    }
+}
+
+//  Return true if the request's client has given up on it
+
+static int
+s_request_expired (request_t *self, int64_t now)
+{
+    return self->deadline && self->deadline <= now;
+}
+
+//  .split worker methods
+//  Here is the implementation of the methods that work on a worker:
+
+//  Lazy constructor that locates a worker by identity, or creates a new
+//  worker if there is no worker already with that identity. We only
+//  build the printable identity when we're going to log it.
+
+static worker_t *
+s_worker_require (broker_t *self, zframe_t *identity)
+{
+    assert (identity);
+
+    //  self->workers is keyed off raw worker identity
+    worker_t *worker = (worker_t *) mdindex_lookup (self->workers,
+        zframe_data (identity), zframe_size (identity));
+
+    if (worker == NULL) {
+        worker = (worker_t *) mdpool_alloc (self->pool, sizeof (worker_t));
+        worker->broker = self;
+        worker->identity = zframe_dup (identity);
+        mdlist_init (&worker->backlog);
+        mdlist_init (&worker->sent);
+        mdlist_init (&worker->unused);
+        mdtimer_init (&worker->expiry_timer, s_worker_expired, worker);
+        mdtimer_init (&worker->heartbeat_timer, s_worker_heartbeat, worker);
+        mdindex_insert (self->workers, zframe_data (worker->identity),
+                        zframe_size (worker->identity), worker);
+        if (self->verbose) {
+            worker->id_string = zframe_strhex (identity);
+            zclock_log ("I: registering new worker: %s", worker->id_string);
+        }
+    }
+    return worker;
+}
+
+//  This method deletes the current worker. We don't keep a copy of the
+//  requests we sent it, so can't queue those it had not answered again.
+//  We leave journaled ones live in the journal, so the next run of the
+//  broker replays them, and the clients of the others will retry them;
+//  we drop clients waiting on them if coalesced. Requests still in its
+//  backlog go back to the service queues for other workers, and its keys
+//  move to the workers next to it on the ring.
+
+static void
+s_worker_delete (worker_t *self, int disconnect)
+{
+    assert (self);
+    if (disconnect)
+        s_worker_send (self, MDPW_DISCONNECT, NULL, NULL);
+
+    service_t *service = self->service;
+    if (service) {
+        mdlist_remove (&service->waiting, &self->service_link);
+        mdlist_remove (&service->registered, &self->member_link);
+        service->workers--;
+        service->outstanding -= self->outstanding;
+        if (service->ring)
+            mdring_delete (service->ring, self);
+        request_t *request;
+        while ((request = s_service_backlog_next (service, self)))
+            s_service_enqueue (service, request);
+    }
+    mdlist_remove (&self->broker->waiting, &self->broker_link);
+    mdlink_t *link;
+    for (link = mdlist_first (&self->sent); link;
+         link = mdlist_next (&self->sent, link)) {
+        inflight_t *inflight = mdlist_item (link, inflight_t, link);
+        if (self->service->flights && inflight->key)
+            s_flight_destroy (mdindex_delete (self->service->flights,
+                (byte *) &inflight->key, sizeof (uint64_t)));
+    }
+    mdwheel_cancel (self->broker->timers, &self->expiry_timer);
+    mdwheel_cancel (self->broker->timers, &self->heartbeat_timer);
+    mdindex_delete (self->broker->workers,
+        zframe_data (self->identity), zframe_size (self->identity));
+
+    //  Tell the front thread to stop routing this worker to us. Routing
+    //  identities are never empty, so an empty first frame marks this as
+    //  a notice rather than a message for the ROUTER socket.
+    if (self->broker->pipe) {
+        zmsg_t *notice = zmsg_new ();
+        zmsg_addmem (notice, "", 0);
+        zmsg_addmem (notice, zframe_data (self->identity),
+                     zframe_size (self->identity));
+        zmsg_send (&notice, self->broker->pipe);
+    }
+    s_worker_destroy (self);
+    if (service)
+        s_service_flush (service);
+}
+
+//  Worker destructor is called when the worker is deleted, or for any
+//  remaining workers when the broker is destroyed.
+
+static void
+s_worker_destroy (void *argument)
+{
+    worker_t *self = (worker_t *) argument;
+    mdlink_t *link;
+    while ((link = mdlist_pop (&self->backlog))) {
+        request_t *request = mdlist_item (link, request_t, link);
+        s_request_destroy (&request);
+    }
+    zframe_destroy (&self->identity);
+    free (self->id_string);
+    mdpool_t *pool = self->broker->pool;
+    mdpool_free (pool, self->inflight, self->credit * sizeof (inflight_t));
+    mdpool_free (pool, self, sizeof (worker_t));
+}
+
+//  .split flight methods
+//  Forget the clients of a flight that have given up, and return when
+//  the last of the others gives up, 0 if one of them never does, or -1
+//  if none are left:
+
+static int64_t
+s_flight_prune (flight_t *self, int64_t now)
+{
+    int64_t latest = -1;
+    zmsg_t *live = zmsg_new ();
+    zframe_t *client;
+    while ((client = zmsg_pop (self->waiters))) {
+        zframe_t *correlation = zmsg_pop (self->waiters);
+        zframe_t *deadline_frame = zmsg_pop (self->waiters);
+        int64_t deadline;
+        memcpy (&deadline, zframe_data (deadline_frame), sizeof (deadline));
+        if (deadline == 0 || deadline > now) {
+            if (deadline == 0)
+                latest = 0;
+            else
+            if (latest && deadline > latest)
+                latest = deadline;
+            zmsg_append (live, &client);
+            zmsg_append (live, &correlation);
+            zmsg_append (live, &deadline_frame);
+        }
+        else {
+            zframe_destroy (&client);
+            zframe_destroy (&correlation);
+            zframe_destroy (&deadline_frame);
+        }
+    }
+    zmsg_destroy (&self->waiters);
+    self->waiters = live;
+    return latest;
+}
+
+//  Destroys a flight and the identities of its waiting clients; does
+//  nothing if there is no flight:
+
+static void
+s_flight_destroy (void *argument)
+{
+    flight_t *self = (flight_t *) argument;
+    if (self) {
+        zmsg_destroy (&self->waiters);
+        free (self);
+    }
+}
+
+//  .split worker send method
+//  This method formats and sends a command to a worker. The caller may
+//  also provide a command option, and a message payload. We take
+//  ownership of the payload and send the envelope ahead of it, so
+//  request bodies are never copied inside the broker:
+
+static void
+s_worker_send (worker_t *self, char *command, char *option, zmsg_t **msg_p)
+{
+    zmsg_t *msg = msg_p? *msg_p: NULL;
+    if (msg_p)
+        *msg_p = NULL;
+
+    if (self->broker->verbose) {
+        zclock_log ("I: sending %s to worker",
+            mdps_commands [(int) *command]);
+        if (msg)
+            zmsg_dump (msg);
+    }
+    int more = msg && zmsg_size (msg) > 0;
+    s_broker_envelope (self->broker, self->identity, MDPW_WORKER,
+                       command, strlen (command), option || more);
+    if (option)
+        zmq_send (self->broker->raw_socket, option, strlen (option),
+                  more? ZMQ_SNDMORE: 0);
+    if (msg)
+        zmsg_send (&msg, self->broker->socket);
+}
+
+//  .split worker reply method
+//  Handle one reply from a worker, from a REPLY or from a BATCH. A worker
+//  that takes tags tells us which request this answers; we drop a reply
+//  whose tag matches no request outstanding, as its request is no longer
+//  ours to answer. Other workers answer in order, so the reply is for the
+//  oldest request outstanding. We remove the client return envelope, and
+//  send the reply; a reply to a cacheable request goes in the cache first:
+
+static void
+s_worker_reply (worker_t *self, zmsg_t **reply_p, uint64_t tag)
+{
+    broker_t *broker = self->broker;
+    inflight_t *inflight = NULL;
+    if (self->tags) {
+        uint32_t index = (uint32_t) tag;
+        if (index < self->credit
+        &&  self->inflight [index].busy
+        &&  self->inflight [index].generation == (uint32_t) (tag >> 32))
+            inflight = &self->inflight [index];
+        else {
+            if (broker->verbose)
+                zclock_log ("W: dropping reply with unknown tag");
+            zmsg_destroy (reply_p);
+            return;
+        }
+    }
+    else
+        inflight = mdlist_item (mdlist_first (&self->sent),
+                                inflight_t, link);
+    if (inflight) {
+        mdlist_remove (&self->sent, &inflight->link);
+        mdlist_append (&self->unused, &inflight->link);
+        inflight->busy = 0;
+        self->outstanding--;
+        self->service->outstanding--;
+    }
+    uint64_t key = inflight? inflight->key: 0;
+    uint64_t correlation = inflight? inflight->correlation: 0;
+    zframe_t *client = zmsg_unwrap (*reply_p);
+    if (key && self->service->cache_ttl)
+        mdcache_store (broker->cache, key, *reply_p,
+                       broker->now + self->service->cache_ttl);
+    s_service_reply (self->service, &client, reply_p, key, correlation);
+    if (inflight) {
+        mdhist_record (self->service->service_time,
+                       broker->now_usecs - inflight->dispatched);
+        if (broker->journal) {
+            mdjournal_remove (broker->journal, inflight->sequence);
+            s_broker_commit (broker);
+        }
+    }
+}
+
+//  This worker is now waiting for work, as it has credit left. Its expiry
+//  and heartbeat timers run from now until it's deleted, busy or not, so
+//  a worker that dies with requests outstanding still expires. A sticky
+//  worker serves its own backlog before the service queues.
+
+static void
+s_worker_waiting (worker_t *self)
+{
+    //  Queue to broker and service waiting lists, at the back even if
+    //  the worker was already waiting
+    assert (self->broker);
+    mdlist_remove (&self->broker->waiting, &self->broker_link);
+    mdlist_remove (&self->service->waiting, &self->service_link);
+    mdlist_append (&self->broker->waiting, &self->broker_link);
+    mdlist_append (&self->service->waiting, &self->service_link);
+    self->expiry = self->broker->now + HEARTBEAT_EXPIRY;
+    mdwheel_schedule (self->broker->timers, &self->expiry_timer,
+                      self->expiry);
+    if (!mdtimer_scheduled (&self->heartbeat_timer))
+        mdwheel_schedule (self->broker->timers, &self->heartbeat_timer,
+                          self->broker->now + HEARTBEAT_INTERVAL);
+    request_t *request;
+    while (self->outstanding < self->credit
+    &&    (request = s_service_backlog_next (self->service, self))) {
+        if (s_request_expired (request, self->broker->now))
+            s_service_drop (self->service, &request);
+        if (request)
+            s_service_send (self->service, self, &request);
+    }
+    s_service_dispatch (self->service, NULL);
+}
+
+//  .split worker timer handlers
+//  These are called from the broker's timer wheel. A worker that hasn't
+//  sent us anything before its expiry is deleted, along with whatever it
+//  had outstanding:
+
+static void
+s_worker_expired (mdtimer_t *timer, void *argument)
+{
+    worker_t *self = (worker_t *) argument;
+    if (self->broker->verbose)
+        zclock_log ("I: deleting expired worker: %s", self->id_string);
+    s_worker_delete (self, 0);
+}
+
+//  A ready worker gets a HEARTBEAT every HEARTBEAT_INTERVAL msecs
+
+static void
+s_worker_heartbeat (mdtimer_t *timer, void *argument)
+{
+    worker_t *self = (worker_t *) argument;
+    s_worker_send (self, MDPW_HEARTBEAT, NULL, NULL);
+    mdwheel_schedule (self->broker->timers, timer,
+                      self->broker->now + HEARTBEAT_INTERVAL);
+}
+
+//  .split shard actor
+//  In sharded mode each dispatch shard is a full broker instance running
+//  in its own actor thread. The front thread sends it every message for
+//  the services it owns over a pipe of its own, and forwards everything
+//  the shard sends back to the ROUTER socket. We make that pipe rather
+//  than use the actor pipe, so we can bound it without touching the
+//  process-wide pipe setting; the actor pipe only stops the shard. Shards
+//  share no state, so they need no locks:
+
+static zsock_t *
+s_shard_pipe_new (void)
+{
+    zsock_t *pipe = zsock_new (ZMQ_PAIR);
+    assert (pipe);
+    zsock_set_sndhwm (pipe, SHARD_PIPE_HWM);
+    zsock_set_rcvhwm (pipe, SHARD_PIPE_HWM);
+    return pipe;
+}
+
+static void
+s_broker_shard (zsock_t *pipe, void *args)
+{
+    config_t *config = (config_t *) args;
+    zsock_t *front = s_shard_pipe_new ();
+    int rc = zsock_connect (front, "%s", config->endpoint);
+    assert (rc == 0);
+    zsock_signal (pipe, 0);
+    broker_t *self = s_broker_new (front, config);
+    zsock_signal (pipe, self? 0: 1);
+    if (self) {
+        self->control = pipe;
+        self->raw_control = zsock_resolve (pipe);
+        s_broker_run (self);
+        s_broker_destroy (&self);
+    }
+    zsock_destroy (&front);
+}
+
+//  .split front class structure
+//  The front owns the ROUTER socket and routes messages to shards. A
+//  service belongs to the shard its name hashes to, and so does every
+//  worker that registers for it. Workers only name their service in
+//  READY, so we remember which shard each worker went to. A durable
+//  shard keeps its own journal in a subdirectory; restarting with a
+//  different number of shards would replay requests to the wrong shard.
+//
+//  Shards block when they send to a full pipe, so the front must never
+//  block on a shard, or the two could wait on each other for good. When
+//  a shard's pipe is full, the front refuses client requests for it at
+//  once, as the shard would refuse a request it has no room for, and
+//  holds worker messages in a list of its own until the pipe has room.
+//  Workers have at most their credit of replies to send, so that list
+//  stays short:
+
+typedef struct {
+    zsock_t *socket;            //  Socket for clients & workers
+    void *raw_socket;           //  Raw Socket for clients & workers
+    zsock_t *control;           //  Pipe to mdbrk class
+    config_t config;            //  Broker configuration
+    config_t *shard_configs;    //  Configuration of each shard
+    int verbose;                //  Print activity to stdout
+    zactor_t **shards;          //  Dispatch shards
+    zsock_t **pipes;            //  Pipe to each shard
+    zlist_t **overflow;         //  Worker messages each pipe had no room
+                                //  for, oldest first
+    int nbr_shards;             //  Number of shards
+    mdindex_t *workers;         //  Shard number + 1, by worker identity
+} front_t;
+
+static void
+    s_front_destroy (front_t **self_p);
+
+//  Start the shards, and return NULL if any of them could not start
+
+static front_t *
+s_front_new (int nbr_shards, config_t *config)
+{
+    front_t *self = (front_t *) zmalloc (sizeof (front_t));
+    self->socket = zsock_new_router (NULL);
+    assert ( self->socket );
+    self->raw_socket = zsock_resolve (self->socket);
+    self->config = *config;
+    self->verbose = config->verbose;
+    self->workers = mdindex_new ();
+    self->nbr_shards = nbr_shards;
+
+    //  Each shard gets an equal part of the overall memory budget
+    self->config.max_bytes /= nbr_shards;
+    self->config.cache_max_bytes /= nbr_shards;
+    self->shards = (zactor_t **) zmalloc (nbr_shards * sizeof (zactor_t *));
+    self->shard_configs = (config_t *)
+        zmalloc (nbr_shards * sizeof (config_t));
+    if (config->journal)
+        mkdir (config->journal, 0755);
+
+    self->pipes = (zsock_t **) zmalloc (nbr_shards * sizeof (zsock_t *));
+    self->overflow = (zlist_t **) zmalloc (nbr_shards * sizeof (zlist_t *));
+    int shard;
+    for (shard = 0; shard < nbr_shards; shard++) {
+        self->shard_configs [shard] = self->config;
+        if (config->journal)
+            self->shard_configs [shard].journal =
+                zsys_sprintf ("%s/shard-%d", config->journal, shard);
+        self->shard_configs [shard].endpoint =
+            zsys_sprintf ("inproc://mdbrk-%p-%d", (void *) self, shard);
+        self->pipes [shard] = s_shard_pipe_new ();
+        int rc = zsock_bind (self->pipes [shard], "%s",
+                             self->shard_configs [shard].endpoint);
+        assert (rc == 0);
+        self->overflow [shard] = zlist_new ();
+        self->shards [shard] =
+            zactor_new (s_broker_shard, &self->shard_configs [shard]);
+    }
+    int started = 1;
+    for (shard = 0; shard < nbr_shards; shard++)
+        if (zsock_wait (self->shards [shard]))
+            started = 0;
+    if (!started)
+        s_front_destroy (&self);
+    return self;
+}
+
+static void
+s_front_destroy (front_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        front_t *self = *self_p;
+        int shard;
+        for (shard = 0; shard < self->nbr_shards; shard++) {
+            zactor_destroy (&self->shards [shard]);
+            zsock_destroy (&self->pipes [shard]);
+            zmsg_t *msg;
+            while ((msg = (zmsg_t *) zlist_pop (self->overflow [shard])))
+                zmsg_destroy (&msg);
+            zlist_destroy (&self->overflow [shard]);
+            free (self->shard_configs [shard].endpoint);
+            if (self->config.journal)
+                free (self->shard_configs [shard].journal);
+        }
+        free (self->shards);
+        free (self->pipes);
+        free (self->overflow);
+        free (self->shard_configs);
+        mdindex_destroy (&self->workers);
+        zsock_destroy (&self->socket);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split front routing
+//  Pick the shard for a message from the ROUTER socket. Clients name the
+//  service in every request, and MMI requests name the service they ask
+//  about in their body. Messages we can't route go to shard 0, which
+//  will reject them the same way a standalone broker would. Sets
+//  *client_p if the message is a client request:
+
+static int
+s_front_shard_of (front_t *self, zframe_t *service)
+{
+    return mdindex_hash (zframe_data (service), zframe_size (service))
+         % self->nbr_shards;
+}
+
+static int
+s_front_route (front_t *self, zmsg_t *msg, int *client_p)
+{
+    zframe_t *sender = zmsg_first (msg);
+    zframe_t *empty  = zmsg_next (msg);
+    zframe_t *header = zmsg_next (msg);
+    zframe_t *frame  = zmsg_next (msg);
+    *client_p = 0;
+    if (!empty || !header || !frame)
+        return 0;
+
+    if (zframe_streq (header, MDPC_CLIENT)
+    ||  zframe_streq (header, MDPC_CLIENT_OPTS)) {
+        *client_p = 1;
+        if (zframe_size (frame) >= 4
+        &&  memcmp (zframe_data (frame), "mmi.", 4) == 0) {
+            //  The service asked about is the first frame of the body
+            if (zframe_streq (header, MDPC_CLIENT_OPTS))
+                zmsg_next (msg);
+            frame = zmsg_next (msg);
+            if (!frame)
+                return 0;
+        }
+        return s_front_shard_of (self, frame);
+    }
+    byte *id = zframe_data (sender);
+    size_t id_size = zframe_size (sender);
+    if (zframe_streq (frame, MDPW_READY)) {
+        zframe_t *service = zmsg_next (msg);
+        if (!service)
+            return 0;
+        int shard = s_front_shard_of (self, service);
+        mdindex_delete (self->workers, id, id_size);
+        mdindex_insert (self->workers, id, id_size,
+                        (void *) (intptr_t) (shard + 1));
+        return shard;
+    }
+    intptr_t shard = (intptr_t) mdindex_lookup (self->workers, id, id_size);
+    return shard? (int) shard - 1: 0;
+}
+
+//  .split front reject method
+//  Refuse a client request whose shard has no room for it, with the same
+//  MDPC_UNAVAILABLE reply a shard sends when its queue is full. We drop
+//  cancels, which need no reply:
+
+static void
+s_front_reject (front_t *self, zmsg_t **msg_p)
+{
+    zmsg_t *msg = *msg_p;
+    zmsg_t *reply = zmsg_new ();
+    zframe_t *frame = zmsg_pop (msg);   //  Client identity
+    zmsg_append (reply, &frame);
+    frame = zmsg_pop (msg);             //  Empty delimiter
+    zmsg_append (reply, &frame);
+    zframe_t *header = zmsg_pop (msg);
+    zframe_t *service = zmsg_pop (msg);
+    mdopts_t options;
+    mdopts_init (&options);
+    if (zframe_streq (header, MDPC_CLIENT_OPTS)) {
+        zframe_t *options_frame = zmsg_pop (msg);
+        if (!options_frame || mdopts_decode (&options, options_frame))
+            zclock_log ("E: invalid request options");
+        zframe_destroy (&options_frame);
+    }
+    if (options.cancel)
+        zmsg_destroy (&reply);
+    else
+    if (options.correlation) {
+        zmsg_addstr (reply, MDPC_CLIENT_OPTS);
+        zmsg_append (reply, &service);
+        mdopts_t reply_options;
+        mdopts_init (&reply_options);
+        reply_options.correlation = options.correlation;
+        zframe_t *options_frame = mdopts_encode (&reply_options);
+        zmsg_append (reply, &options_frame);
+    }
+    else {
+        zmsg_addstr (reply, MDPC_CLIENT);
+        zmsg_append (reply, &service);
+    }
+    if (reply) {
+        zmsg_addstr (reply, MDPC_UNAVAILABLE);
+        zmsg_send (&reply, self->socket);
+        if (self->verbose)
+            zclock_log ("W: shard pipe full, rejected request");
+    }
+    zframe_destroy (&header);
+    zframe_destroy (&service);
+    zmsg_destroy (msg_p);
+}
+
+//  .split front send method
+//  Send a message to a shard, without ever blocking. Only the front
+//  sends on a shard pipe, so once the pipe says it has room, a send
+//  won't block. A worker message the pipe has no room for waits, after
+//  any others already waiting, and a client request is refused:
+
+static void
+s_front_send (front_t *self, int shard, zmsg_t **msg_p, int client)
+{
+    zlist_t *overflow = self->overflow [shard];
+    if (zlist_size (overflow) == 0
+    &&  (zsock_events (self->pipes [shard]) & ZMQ_POLLOUT))
+        zmsg_send (msg_p, self->pipes [shard]);
+    else
+    if (client)
+        s_front_reject (self, msg_p);
+    else {
+        zlist_append (overflow, *msg_p);
+        *msg_p = NULL;
+    }
+}
+
+//  Send the worker messages waiting for a shard's pipe, for as long as
+//  it has room
+
+static void
+s_front_drain (front_t *self, int shard)
+{
+    zlist_t *overflow = self->overflow [shard];
+    while (zlist_size (overflow)
+    &&    (zsock_events (self->pipes [shard]) & ZMQ_POLLOUT)) {
+        zmsg_t *msg = (zmsg_t *) zlist_pop (overflow);
+        zmsg_send (&msg, self->pipes [shard]);
+    }
+}
+
+//  .split front run method
+//  Pass messages between the ROUTER socket and the shards until
+//  interrupted or our mdbrk instance is destroyed. A message from a shard
+//  with an empty first frame is a notice that the shard deleted a worker.
+//  We wait for room on a shard's pipe only while we hold messages for it.
+//  The mdbrk pipe is the last poll item:
+
+static void
+s_front_run (front_t *self)
+{
+    int nbr_items = self->nbr_shards + 2;
+    zmq_pollitem_t *items = (zmq_pollitem_t *)
+        zmalloc (nbr_items * sizeof (zmq_pollitem_t));
+    items [0].socket = self->raw_socket;
+    items [0].events = ZMQ_POLLIN;
+    int shard;
+    for (shard = 0; shard < self->nbr_shards; shard++)
+        items [shard + 1].socket = zsock_resolve (self->pipes [shard]);
+    items [nbr_items - 1].socket = zsock_resolve (self->control);
+    items [nbr_items - 1].events = ZMQ_POLLIN;
+    while (true) {
+        for (shard = 0; shard < self->nbr_shards; shard++)
+            items [shard + 1].events = ZMQ_POLLIN
+                | (zlist_size (self->overflow [shard])? ZMQ_POLLOUT: 0);
+        int rc = zmq_poll (items, nbr_items, -1);
+        if (rc == -1) {
+            if (self->verbose)
+                zclock_log ("I: polling error ( rc == -1)");
+            break;              //  Interrupted
+        }
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (self->socket);
+            if (!msg)
+                break;          //  Interrupted
+            int client;
+            shard = s_front_route (self, msg, &client);
+            s_front_send (self, shard, &msg, client);
+        }
+        for (shard = 0; shard < self->nbr_shards; shard++) {
+            if (items [shard + 1].revents & ZMQ_POLLOUT)
+                s_front_drain (self, shard);
+            if (!(items [shard + 1].revents & ZMQ_POLLIN))
+                continue;
+            zmsg_t *msg = zmsg_recv (self->pipes [shard]);
+            if (!msg)
+                break;
+            if (zframe_size (zmsg_first (msg)) == 0) {
+                zframe_t *identity = zmsg_next (msg);
+                byte *id = zframe_data (identity);
+                size_t id_size = zframe_size (identity);
+                if ((intptr_t) mdindex_lookup (self->workers, id, id_size)
+                    == shard + 1)
+                    mdindex_delete (self->workers, id, id_size);
+                zmsg_destroy (&msg);
+            }
+            else
+                zmsg_send (&msg, self->socket);
+        }
+        if ((items [nbr_items - 1].revents & ZMQ_POLLIN)
+        &&  s_broker_control (self->control, self->socket,
+                              self->nbr_shards) == -1)
+            break;              //  mdbrk instance destroyed
+    }
+    free (items);
+}
+
+//  .split mdbrk class structure
+//  The mdbrk class runs a broker, or a front and its shards, in an actor
+//  thread. We bind the broker from the calling thread, so an application
+//  can embed a broker and bind it to inproc endpoints for its own clients
+//  and workers, as well as to ipc and tcp endpoints for other processes.
+//  CZMQ sockets all share one context, so mdcli and mdwrk instances in
+//  the same process can connect to those inproc endpoints:
+
+struct _mdbrk_t {
+    zactor_t *actor;            //  Broker or front thread, once bound
+    config_t config;            //  Broker configuration, whose strings
+                                //  we own
+};
+
+//  .split broker actor
+//  This is the actor thread. With more than one shard, we run a front
+//  that owns the ROUTER socket, and the shards in actors of their own.
+//  We signal once as zactor_new expects, and then again with a nonzero
+//  status if the broker could not start. Shards do the same:
+
+static void
+s_mdbrk_actor (zsock_t *pipe, void *args)
+{
+    config_t *config = (config_t *) args;
+    zsock_signal (pipe, 0);
+    if (config->nbr_shards > 1) {
+        front_t *front = s_front_new (config->nbr_shards, config);
+        zsock_signal (pipe, front? 0: 1);
+        if (front) {
+            front->control = pipe;
+            s_front_run (front);
+            s_front_destroy (&front);
+        }
+    }
+    else {
+        broker_t *broker = s_broker_new (NULL, config);
+        zsock_signal (pipe, broker? 0: 1);
+        if (broker) {
+            broker->control = pipe;
+            broker->raw_control = zsock_resolve (pipe);
+            s_broker_run (broker);
+            s_broker_destroy (&broker);
+        }
+    }
+}
+
+//  .split constructor and destructor
+//  The constructor sets up a broker with default settings. We start the
+//  broker thread on the first call to mdbrk_bind, so settings made after
+//  construction are in place when it runs:
+
+mdbrk_t *
+mdbrk_new (void)
+{
+    mdbrk_t *self = (mdbrk_t *) zmalloc (sizeof (mdbrk_t));
+    config_t *config = &self->config;
+    config->batch_size = BATCH_SIZE;
+    config->queue_max_requests = QUEUE_MAX_REQUESTS;
+    config->queue_max_bytes = QUEUE_MAX_BYTES;
+    config->max_bytes = BROKER_MAX_BYTES;
+    config->aging = PRIORITY_AGING;
+    config->journal_interval = JOURNAL_INTERVAL;
+    config->journal_bytes = JOURNAL_BYTES;
+    config->cache_max_bytes = CACHE_MAX_BYTES;
+    config->load_factor = LOAD_FACTOR;
+    config->nbr_shards = 1;
+    return self;
+}
+
+//  Destructor, stops the broker thread
+
+void
+mdbrk_destroy (mdbrk_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdbrk_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        config_t *config = &self->config;
+        free (config->journal);
+        int rule;
+        for (rule = 0; rule < config->nbr_cache_rules; rule++)
+            free (config->cache_rules [rule].service);
+        for (rule = 0; rule < config->nbr_coalesce_rules; rule++)
+            free (config->coalesce_rules [rule]);
+        for (rule = 0; rule < config->nbr_sticky_rules; rule++)
+            free (config->sticky_rules [rule]);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split configure broker
+//  We provide these methods to configure the broker, which must all be
+//  done before the first mdbrk_bind. Values below the smallest that
+//  makes sense are raised to it.
+
+//  Print activity to stdout
+
+void
+mdbrk_set_verbose (mdbrk_t *self, int verbose)
+{
+    assert (!self->actor);
+    self->config.verbose = verbose;
+}
+
+//  Run a front thread and this many dispatch shards, if more than one
+
+void
+mdbrk_set_shards (mdbrk_t *self, int shards)
+{
+    assert (!self->actor);
+    self->config.nbr_shards = shards > 1? shards: 1;
+}
+
+//  Set the most messages the broker handles per wakeup
+
+void
+mdbrk_set_batch (mdbrk_t *self, int size)
+{
+    assert (!self->actor);
+    self->config.batch_size = size > 1? size: 1;
+}
+
+//  Set the most requests each service may queue. Requests past this
+//  limit, or the byte limits below, get MDPC_UNAVAILABLE at once.
+
+void
+mdbrk_set_queue_requests (mdbrk_t *self, size_t requests)
+{
+    assert (!self->actor);
+    self->config.queue_max_requests = requests;
+}
+
+//  Set the most bytes each service may queue
+
+void
+mdbrk_set_queue_bytes (mdbrk_t *self, size_t bytes)
+{
+    assert (!self->actor);
+    self->config.queue_max_bytes = bytes;
+}
+
+//  Set the most bytes all services together may queue
+
+void
+mdbrk_set_max_bytes (mdbrk_t *self, size_t bytes)
+{
+    assert (!self->actor);
+    self->config.max_bytes = bytes;
+}
+
+//  Set how many msecs a queued request waits before it's promoted by one
+//  priority class; zero or less means strict priority
+
+void
+mdbrk_set_aging (mdbrk_t *self, int64_t aging)
+{
+    assert (!self->actor);
+    self->config.aging = aging;
+}
+
+//  Keep a journal of queued requests in this directory, so they survive
+//  a restart
+
+void
+mdbrk_set_journal (mdbrk_t *self, const char *directory)
+{
+    assert (directory);
+    assert (!self->actor);
+    free (self->config.journal);
+    self->config.journal = strdup (directory);
+}
+
+//  Set the most msecs a journal write waits for a sync
+
+void
+mdbrk_set_journal_interval (mdbrk_t *self, int64_t interval)
+{
+    assert (!self->actor);
+    self->config.journal_interval = interval;
+}
+
+//  Set the most bytes written to the journal between syncs
+
+void
+mdbrk_set_journal_bytes (mdbrk_t *self, size_t bytes)
+{
+    assert (!self->actor);
+    self->config.journal_bytes = bytes;
+}
+
+//  Cache replies of this service for ttl msecs, whatever its workers ask
+//  for. Returns -1 if we have no room for another rule.
+
+int
+mdbrk_set_cache (mdbrk_t *self, const char *service, int64_t ttl)
+{
+    assert (service);
+    assert (!self->actor);
+    config_t *config = &self->config;
+    if (config->nbr_cache_rules == MAX_CACHE_RULES)
+        return -1;
+    config->cache_rules [config->nbr_cache_rules].service = strdup (service);
+    config->cache_rules [config->nbr_cache_rules].ttl = ttl;
+    config->nbr_cache_rules++;
+    return 0;
+}
+
+//  Set the most bytes of replies the broker caches
+
+void
+mdbrk_set_cache_bytes (mdbrk_t *self, size_t bytes)
+{
+    assert (!self->actor);
+    self->config.cache_max_bytes = bytes;
+}
+
+//  Coalesce identical requests to this service. Returns -1 if we have no
+//  room for another rule.
+
+int
+mdbrk_set_coalesce (mdbrk_t *self, const char *service)
+{
+    assert (service);
+    assert (!self->actor);
+    config_t *config = &self->config;
+    if (config->nbr_coalesce_rules == MAX_COALESCE_RULES)
+        return -1;
+    config->coalesce_rules [config->nbr_coalesce_rules++] = strdup (service);
+    return 0;
+}
+
+//  Route requests to this service to workers by routing key. Returns -1
+//  if we have no room for another rule.
+
+int
+mdbrk_set_sticky (mdbrk_t *self, const char *service)
+{
+    assert (service);
+    assert (!self->actor);
+    config_t *config = &self->config;
+    if (config->nbr_sticky_rules == MAX_STICKY_RULES)
+        return -1;
+    config->sticky_rules [config->nbr_sticky_rules++] = strdup (service);
+    return 0;
+}
+
+//  Set the percent of a sticky service's average load that any one of
+//  its workers may take, 100 or more
+
+void
+mdbrk_set_load_factor (mdbrk_t *self, int64_t percent)
+{
+    assert (!self->actor);
+    self->config.load_factor = percent > 100? percent: 100;
+}
+
+//  .split bind method
+//  Bind the broker to an endpoint, such as inproc://mdbroker,
+//  ipc:///tmp/mdbroker or tcp://*:5555. We can call this as often as we
+//  like. Returns the port number for tcp, 0 for other transports, or -1
+//  if the bind failed or the broker could not start, as when it can't
+//  open its journal:
+
+int
+mdbrk_bind (mdbrk_t *self, const char *endpoint)
+{
+    assert (self);
+    assert (endpoint);
+    if (!self->actor) {
+        self->actor = zactor_new (s_mdbrk_actor, &self->config);
+        assert (self->actor);
+        if (zsock_wait (self->actor)) {
+            zactor_destroy (&self->actor);
+            return -1;
+        }
+    }
+    zstr_sendx (self->actor, "BIND", endpoint, NULL);
+    int rc = -1;
+    if (zsock_recv (self->actor, "i", &rc) == -1)
+        rc = -1;                //  Interrupted
+    return rc;
+}
+
+//  .split wait method
+//  Block until the broker thread stops, which it does when we're
+//  interrupted. Bind the broker first:
+
+void
+mdbrk_wait (mdbrk_t *self)
+{
+    assert (self);
+    assert (self->actor);
+    zsock_wait (self->actor);
+}
@@ -0,0 +1,63 @@
+/*  =====================================================================
+ *  mdbrkapi.h - Majordomo Protocol Broker API
+ *  Runs a Majordomo broker in a background thread, so an application can
+ *  embed one and reach it over inproc as well as over ipc and tcp.
+ *  ===================================================================== */
+
+#ifndef __MDBRKAPI_H_INCLUDED__
+#define __MDBRKAPI_H_INCLUDED__
+
+#include "czmq.h"
+#include "mdp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdbrk_t mdbrk_t;
+
+mdbrk_t *
+    mdbrk_new (void);
+void
+    mdbrk_destroy (mdbrk_t **self_p);
+void
+    mdbrk_set_verbose (mdbrk_t *self, int verbose);
+void
+    mdbrk_set_shards (mdbrk_t *self, int shards);
+void
+    mdbrk_set_batch (mdbrk_t *self, int size);
+void
+    mdbrk_set_queue_requests (mdbrk_t *self, size_t requests);
+void
+    mdbrk_set_queue_bytes (mdbrk_t *self, size_t bytes);
+void
+    mdbrk_set_max_bytes (mdbrk_t *self, size_t bytes);
+void
+    mdbrk_set_aging (mdbrk_t *self, int64_t aging);
+void
+    mdbrk_set_journal (mdbrk_t *self, const char *directory);
+void
+    mdbrk_set_journal_interval (mdbrk_t *self, int64_t interval);
+void
+    mdbrk_set_journal_bytes (mdbrk_t *self, size_t bytes);
+int
+    mdbrk_set_cache (mdbrk_t *self, const char *service, int64_t ttl);
+void
+    mdbrk_set_cache_bytes (mdbrk_t *self, size_t bytes);
+int
+    mdbrk_set_coalesce (mdbrk_t *self, const char *service);
+int
+    mdbrk_set_sticky (mdbrk_t *self, const char *service);
+void
+    mdbrk_set_load_factor (mdbrk_t *self, int64_t percent);
+int
+    mdbrk_bind (mdbrk_t *self, const char *endpoint);
+void
+    mdbrk_wait (mdbrk_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+//  mdcache class - Reply cache
+//  Entries sit in an mdindex keyed on their 8-byte key, and on a list in
+//  order of use, least recently used first. When a new reply would take
+//  us over our memory limit we evict from the front of the list. Expired
+//  entries are dropped when a lookup finds them, or evicted in turn.
+
+#include "mdcache.h"
+#include "mdindex.h"
+#include "mdlist.h"
+
+//  .split entry structure
+//  We charge each entry for its reply body plus its own bookkeeping:
+
+typedef struct {
+    mdlink_t link;              //  Link in list of entries by last use
+    uint64_t key;               //  Hash of service and request
+    zmsg_t *reply;              //  Reply body
+    size_t size;                //  Bytes charged for this entry
+    int64_t expires;            //  When entry goes stale
+} entry_t;
+
+//  Structure of our class
+
+struct _mdcache_t {
+    mdindex_t *entries;         //  Entries by key
+    mdlist_t lru;               //  Entries, least recently used first
+    size_t bytes;               //  Bytes charged for all entries
+    size_t max_bytes;           //  Most bytes we may hold
+    uint64_t hits;              //  Lookups we answered
+    uint64_t misses;            //  Lookups we couldn't answer
+    uint64_t evictions;         //  Entries dropped to make room
+    uint64_t expirations;       //  Entries dropped as stale
+};
+
+static void
+s_entry_delete (mdcache_t *self, entry_t *entry)
+{
+    mdindex_delete (self->entries, (byte *) &entry->key, sizeof (uint64_t));
+    mdlist_remove (&self->lru, &entry->link);
+    self->bytes -= entry->size;
+    zmsg_destroy (&entry->reply);
+    free (entry);
+}
+
+//  .split constructor and destructor
+
+mdcache_t *
+mdcache_new (size_t max_bytes)
+{
+    mdcache_t *self = (mdcache_t *) zmalloc (sizeof (mdcache_t));
+    self->entries = mdindex_new ();
+    mdlist_init (&self->lru);
+    self->max_bytes = max_bytes;
+    return self;
+}
+
+void
+mdcache_destroy (mdcache_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdcache_t *self = *self_p;
+        mdlink_t *link;
+        while ((link = mdlist_first (&self->lru)))
+            s_entry_delete (self, mdlist_item (link, entry_t, link));
+        mdindex_destroy (&self->entries);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split key method
+//  Hash the service name and every frame of the request body, with each
+//  frame's size mixed in so frame boundaries count. The request is still
+//  wrapped in its client envelope, which we skip, as identical requests
+//  from different clients have the same key. This is FNV-1a on 64
+//  bits with a murmur3 finalizer; zero is never returned, so callers can
+//  use it to mean "no key":
+
+static inline uint64_t
+s_hash_bytes (uint64_t hash, const byte *data, size_t size)
+{
+    size_t index;
+    for (index = 0; index < size; index++) {
+        hash ^= data [index];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t
+mdcache_key (const char *service, zmsg_t *request)
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = s_hash_bytes (hash, (byte *) service, strlen (service) + 1);
+    zframe_t *frame = zmsg_first (request);
+    while (frame && zframe_size (frame) > 0)
+        frame = zmsg_next (request);
+    frame = frame? zmsg_next (request): NULL;
+    while (frame) {
+        uint64_t size = zframe_size (frame);
+        hash = s_hash_bytes (hash, (byte *) &size, sizeof (size));
+        hash = s_hash_bytes (hash, zframe_data (frame), zframe_size (frame));
+        frame = zmsg_next (request);
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash? hash: 1;
+}
+
+//  .split lookup and store methods
+//  Return a copy of the cached reply for key, or NULL if there is none
+//  or it has expired:
+
+zmsg_t *
+mdcache_lookup (mdcache_t *self, uint64_t key, int64_t now)
+{
+    assert (self);
+    entry_t *entry = (entry_t *) mdindex_lookup (self->entries,
+        (byte *) &key, sizeof (key));
+    if (entry && entry->expires <= now) {
+        s_entry_delete (self, entry);
+        self->expirations++;
+        entry = NULL;
+    }
+    if (!entry) {
+        self->misses++;
+        return NULL;
+    }
+    mdlist_remove (&self->lru, &entry->link);
+    mdlist_append (&self->lru, &entry->link);
+    self->hits++;
+    return zmsg_dup (entry->reply);
+}
+
+//  Store a copy of reply under key, replacing any previous reply, and
+//  evict entries as needed to stay within our memory limit. A reply
+//  that is too big to ever fit is not stored:
+
+void
+mdcache_store (mdcache_t *self, uint64_t key, zmsg_t *reply, int64_t expires)
+{
+    assert (self);
+    size_t size = sizeof (entry_t) + zmsg_content_size (reply);
+    if (size > self->max_bytes)
+        return;
+
+    entry_t *entry = (entry_t *) mdindex_lookup (self->entries,
+        (byte *) &key, sizeof (key));
+    if (entry)
+        s_entry_delete (self, entry);
+    while (self->bytes + size > self->max_bytes) {
+        s_entry_delete (self, mdlist_item (mdlist_first (&self->lru),
+                                           entry_t, link));
+        self->evictions++;
+    }
+    entry = (entry_t *) zmalloc (sizeof (entry_t));
+    entry->key = key;
+    entry->reply = zmsg_dup (reply);
+    entry->size = size;
+    entry->expires = expires;
+    mdindex_insert (self->entries, (byte *) &entry->key, sizeof (uint64_t),
+                    entry);
+    mdlist_append (&self->lru, &entry->link);
+    self->bytes += size;
+}
+
+//  .split counters
+//  Return cache counters and usage:
+
+uint64_t
+mdcache_hits (mdcache_t *self)
+{
+    assert (self);
+    return self->hits;
+}
+
+uint64_t
+mdcache_misses (mdcache_t *self)
+{
+    assert (self);
+    return self->misses;
+}
+
+uint64_t
+mdcache_evictions (mdcache_t *self)
+{
+    assert (self);
+    return self->evictions;
+}
+
+uint64_t
+mdcache_expirations (mdcache_t *self)
+{
+    assert (self);
+    return self->expirations;
+}
+
+size_t
+mdcache_size (mdcache_t *self)
+{
+    assert (self);
+    return mdindex_size (self->entries);
+}
+
+size_t
+mdcache_bytes (mdcache_t *self)
+{
+    assert (self);
+    return self->bytes;
+}
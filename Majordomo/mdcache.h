@@ -0,0 +1,49 @@
+/*  =====================================================================
+ *  mdcache.h - Reply cache
+ *  Bounded LRU cache of replies keyed by a 64-bit hash of the service
+ *  name and request body, with a time to live per entry. Used by the
+ *  Majordomo broker to answer repeated requests to cacheable services
+ *  without a round trip to a worker.
+ *  ===================================================================== */
+
+#ifndef __MDCACHE_H_INCLUDED__
+#define __MDCACHE_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdcache_t mdcache_t;
+
+mdcache_t *
+    mdcache_new (size_t max_bytes);
+void
+    mdcache_destroy (mdcache_t **self_p);
+uint64_t
+    mdcache_key (const char *service, zmsg_t *request);
+zmsg_t *
+    mdcache_lookup (mdcache_t *self, uint64_t key, int64_t now);
+void
+    mdcache_store (mdcache_t *self, uint64_t key, zmsg_t *reply,
+                   int64_t expires);
+uint64_t
+    mdcache_hits (mdcache_t *self);
+uint64_t
+    mdcache_misses (mdcache_t *self);
+uint64_t
+    mdcache_evictions (mdcache_t *self);
+uint64_t
+    mdcache_expirations (mdcache_t *self);
+size_t
+    mdcache_size (mdcache_t *self);
+size_t
+    mdcache_bytes (mdcache_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,25 @@
 //  Implements the MDP/Worker spec at http://rfc.zeromq.org/spec:7.
 
 #include "mdcliapi.h"
+#include "mdopts.h"
+
+//  Lets us build this source without creating a library
+#include "mdshared.c"
+#include "mdhist.c"
+
+//  We hedge a request once we have this many latencies for its service,
+//  and update the hedge delay each time we get this many more. Every
+//  HEDGE_WINDOW latencies we start afresh, so the estimate follows the
+//  service as it speeds up or slows down.
+#define HEDGE_SAMPLES   64
+#define HEDGE_WINDOW    1024
+
+//  Recent latencies of one service
+
+typedef struct {
+    mdhist_t *latencies;        //  Round trips since last reset, usecs
+    int64_t hedge_after;        //  Usecs until we hedge, 0 = don't yet
+} estimate_t;
 
 //  Structure of our class
 //  We access these properties only via class methods
@@ -14,9 +33,14 @@ struct _mdcli_t {
     int verbose;                //  Print activity to stdout
     int timeout;                //  Request timeout
     int retries;                //  Request retries
+    double hedge;               //  Hedging percentile, 0 = don't hedge
+    zhash_t *estimates;         //  Latency estimates, by service
+    uint64_t sequence;          //  Last correlation ID we used
 };
 
-//  Connect or reconnect to broker
+//  Connect or reconnect to broker. We use a DEALER socket, and make the
+//  envelope a REQ socket would make ourselves, so that we can have a
+//  second copy of a request out while the first is unanswered.
 
 void s_mdcli_connect_to_broker (mdcli_t *self)
 {
@@ -24,7 +48,7 @@ void s_mdcli_connect_to_broker (mdcli_t *self)
         zsock_destroy (&self->client);
         self->raw_client = NULL;
     }
-    self->client = zsock_new_req (self->broker);
+    self->client = zsock_new_dealer (self->broker);
     assert ( self->client );
     self->raw_client = zsock_resolve(self->client);
     if (self->verbose)
@@ -47,6 +71,7 @@ mdcli_new (char *broker, int verbose)
     self->verbose = verbose;
     self->timeout = 2500;           //  msecs
     self->retries = 3;              //  Before we abandon
+    self->estimates = zhash_new ();
 
     s_mdcli_connect_to_broker (self);
     return self;
@@ -60,6 +85,7 @@ mdcli_destroy (mdcli_t **self_p)
     assert (self_p);
     if (*self_p) {
         mdcli_t *self = *self_p;
+        zhash_destroy (&self->estimates);
         zsock_destroy (&self->client);
         self->raw_client = NULL;
         zmq_ctx_destroy (&self->ctx);
@@ -91,69 +117,251 @@ mdcli_set_retries (mdcli_t *self, int retries)
     self->retries = retries;
 }
 
-//  .split send request and wait for reply
-//  Here is the {{send}} method. It sends a request to the broker and gets
-//  a reply even if it has to retry several times. It takes ownership of 
-//  the request message, and destroys it when sent. It returns the reply
-//  message, or NULL if there was no reply after multiple attempts:
 
-zmsg_t *
-mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p)
+//  Set hedging. Once a reply is later than this percentile of recent
+//  round trips to the same service, say 95.0, we send a second copy of
+//  the request, and take whichever reply comes first. At the 95th
+//  percentile, that puts about 5% more requests on a service in return
+//  for cutting its tail. Zero turns hedging off, which is the default.
+
+void
+mdcli_set_hedge (mdcli_t *self, double percentile)
 {
     assert (self);
-    assert (request_p);
-    zmsg_t *request = *request_p;
+    assert (percentile >= 0 && percentile < 100);
+    self->hedge = percentile;
+}
+
+//  .split latency estimates
+//  We keep a histogram of recent round trips for each service we hedge
+//  requests to, and take the hedge delay from it:
+
+static void
+s_estimate_destroy (void *argument)
+{
+    estimate_t *self = (estimate_t *) argument;
+    mdhist_destroy (&self->latencies);
+    free (self);
+}
 
+static estimate_t *
+s_mdcli_estimate (mdcli_t *self, char *service)
+{
+    estimate_t *estimate =
+        (estimate_t *) zhash_lookup (self->estimates, service);
+    if (!estimate) {
+        estimate = (estimate_t *) zmalloc (sizeof (estimate_t));
+        estimate->latencies = mdhist_new ();
+        zhash_insert (self->estimates, service, estimate);
+        zhash_freefn (self->estimates, service, s_estimate_destroy);
+    }
+    return estimate;
+}
+
+static void
+s_estimate_record (estimate_t *self, double percentile, int64_t latency)
+{
+    mdhist_record (self->latencies, latency);
+    uint64_t count = mdhist_count (self->latencies);
+    if (count % HEDGE_SAMPLES == 0)
+        self->hedge_after = mdhist_percentile (self->latencies, percentile);
+    if (count >= HEDGE_WINDOW)
+        mdhist_reset (self->latencies);
+}
+
+//  .split send copy method
+//  Send one copy of a request, with a correlation ID of its own, and
+//  return the ID. Each copy tells the broker when we will stop waiting
+//  for it, so the broker can drop the request rather than have a worker
+//  answer nobody. The deadline is on the wall clock, so clocks need to be
+//  roughly in sync:
+
+static uint64_t
+s_mdcli_send_copy (mdcli_t *self, char *service, mdshared_t *request,
+                   int64_t deadline)
+{
     //  Prefix request with protocol frames
-    //  Frame 1: "MDPCxy" (six bytes, MDP/Client x.y)
+    //  Frame 0: empty (REQ emulation)
+    //  Frame 1: "MDPC0X" (six bytes, MDP/Client with options)
     //  Frame 2: Service name (printable string)
-    zmsg_pushstr (request, service);
-    zmsg_pushstr (request, MDPC_CLIENT);
-    if (self->verbose) {
-        zclock_log ("I: send request to '%s' service:", service);
-        zmsg_dump (request);
-    }
-    int retries_left = self->retries;
-    while (retries_left && !zctx_interrupted) {
-        zmsg_t *msg = zmsg_dup (request);
-        zmsg_send (&msg, self->client);
+    //  Frame 3: Request options, with deadline and correlation ID
+    mdopts_t options;
+    mdopts_init (&options);
+    options.deadline = deadline;
+    options.correlation = ++self->sequence;
+    zframe_t *options_frame = mdopts_encode (&options);
+    zstr_sendm (self->client, "");
+    zstr_sendm (self->client, MDPC_CLIENT_OPTS);
+    zstr_sendm (self->client, service);
+    zframe_send (&options_frame, self->client, ZFRAME_MORE);
+    mdshared_send (request, self->raw_client);
+    return options.correlation;
+}
+
+//  Ask the broker to drop a copy we no longer want, if no worker has it
+//  yet. The cancel has the same frames as a request, without a body:
+
+static void
+s_mdcli_cancel (mdcli_t *self, char *service, uint64_t correlation)
+{
+    mdopts_t options;
+    mdopts_init (&options);
+    options.correlation = correlation;
+    options.cancel = 1;
+    zframe_t *options_frame = mdopts_encode (&options);
+    zstr_sendm (self->client, "");
+    zstr_sendm (self->client, MDPC_CLIENT_OPTS);
+    zstr_sendm (self->client, service);
+    zframe_send (&options_frame, self->client, 0);
+}
+
+//  .split attempt method
+//  Make one attempt at a request: send it, send a second copy if we're
+//  hedging and the reply is late, and wait up to the timeout for a reply
+//  to either copy. We take the first, record its round trip, and cancel
+//  the other copy. Replies to other copies, from this attempt or from
+//  earlier requests, we drop. A broker that doesn't know correlation IDs
+//  sends none; we then take its reply as is. Returns 0 and the reply, 1
+//  if we timed out, or -1 if we were interrupted:
+
+static int
+s_mdcli_attempt (mdcli_t *self, char *service, mdshared_t *request,
+                 estimate_t *estimate, zmsg_t **reply_p)
+{
+    int64_t started = zclock_usecs ();
+    int64_t expires = started + self->timeout * 1000;
+    uint64_t copies [2];
+    int64_t sent [2];
+    copies [0] = s_mdcli_send_copy (self, service, request,
+                                    zclock_time () + self->timeout);
+    sent [0] = started;
+    int nbr_copies = 1;
+    int64_t hedge_at = 0;
+    if (estimate && estimate->hedge_after
+    &&  estimate->hedge_after < expires - started)
+        hedge_at = started + estimate->hedge_after;
 
+    while (true) {
+        int64_t now = zclock_usecs ();
+        if (now >= expires)
+            return 1;
+        if (hedge_at && now >= hedge_at) {
+            if (self->verbose)
+                zclock_log ("I: no reply after %" PRId64 " usecs, hedging"
+                            " request to '%s' service", now - started,
+                            service);
+            copies [1] = s_mdcli_send_copy (self, service, request,
+                zclock_time () + (expires - now) / 1000);
+            sent [1] = now;
+            nbr_copies = 2;
+            hedge_at = 0;
+        }
+        int64_t wake = hedge_at? hedge_at: expires;
         zmq_pollitem_t items [] = {
             { self->raw_client, 0, ZMQ_POLLIN, 0 }
         };
-        //  .split body of send 
+        //  .split body of attempt
         //  On any blocking call, {{libzmq}} will return -1 if there was
         //  an error; we could in theory check for different error codes,
         //  but in practice it's OK to assume it was {{EINTR}} (Ctrl-C):
-        
-        int rc = zmq_poll (items, 1, self->timeout * ZMQ_POLL_MSEC);
+
+        int rc = zmq_poll (items, 1,
+                           (wake - now + 999) / 1000 * ZMQ_POLL_MSEC);
         if (rc == -1) {
             if (self->verbose)
                 zclock_log ("I: polling error ( rc == -1)");
-            break;          //  Interrupted
+            return -1;          //  Interrupted
         }
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
 
-        //  If we got a reply, process it
-        if (items [0].revents & ZMQ_POLLIN) {
-            zmsg_t *msg = zmsg_recv (self->client);
-            if (self->verbose) {
-                zclock_log ("I: received reply:");
-                zmsg_dump (msg);
-            }
-            //  We would handle malformed replies better in real code
-            assert (zmsg_size (msg) >= 3);
-
-            zframe_t *header = zmsg_pop (msg);
-            assert (zframe_streq (header, MDPC_CLIENT));
-            zframe_destroy (&header);
-
-            zframe_t *reply_service = zmsg_pop (msg);
-            assert (zframe_streq (reply_service, service));
-            zframe_destroy (&reply_service);
-
-            zmsg_destroy (&request);
-            return msg;     //  Success
+        zmsg_t *msg = zmsg_recv (self->client);
+        if (!msg)
+            return -1;          //  Interrupted
+        if (self->verbose) {
+            zclock_log ("I: received reply:");
+            zmsg_dump (msg);
         }
+        //  We would handle malformed replies better in real code
+        assert (zmsg_size (msg) >= 4);
+
+        zframe_t *empty = zmsg_pop (msg);
+        assert (zframe_streq (empty, ""));
+        zframe_destroy (&empty);
+
+        zframe_t *header = zmsg_pop (msg);
+        int has_options = zframe_streq (header, MDPC_CLIENT_OPTS);
+        assert (has_options || zframe_streq (header, MDPC_CLIENT));
+        zframe_destroy (&header);
+
+        //  A late reply to an earlier call may come from any service, so
+        //  we check the reply's correlation ID and service together, and
+        //  drop anything that isn't ours
+        zframe_t *reply_service = zmsg_pop (msg);
+        mdopts_t options;
+        mdopts_init (&options);
+        if (has_options) {
+            zframe_t *options_frame = zmsg_pop (msg);
+            if (mdopts_decode (&options, options_frame))
+                zclock_log ("E: invalid reply options");
+            zframe_destroy (&options_frame);
+        }
+        int copy = 0;
+        if (options.correlation)
+            while (copy < nbr_copies && copies [copy] != options.correlation)
+                copy++;
+        if (!zframe_streq (reply_service, service))
+            copy = nbr_copies;
+        zframe_destroy (&reply_service);
+        if (copy == nbr_copies) {
+            if (self->verbose)
+                zclock_log ("I: dropping late reply");
+            zmsg_destroy (&msg);
+            continue;
+        }
+        if (estimate)
+            s_estimate_record (estimate, self->hedge,
+                               zclock_usecs () - sent [copy]);
+        if (nbr_copies == 2)
+            s_mdcli_cancel (self, service, copies [1 - copy]);
+        *reply_p = msg;
+        return 0;
+    }
+}
+
+//  .split send request and wait for reply
+//  Here is the {{send}} method. It sends a request to the broker and gets
+//  a reply even if it has to retry several times. It takes ownership of 
+//  the request message, and destroys it when sent. It returns the reply
+//  message, or NULL if there was no reply after multiple attempts. Since
+//  we may have to resend the request, we share its frames with libzmq
+//  rather than copying the request for each attempt:
+
+zmsg_t *
+mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p)
+{
+    assert (self);
+    assert (request_p);
+    zmsg_t *request = *request_p;
+
+    if (self->verbose) {
+        zclock_log ("I: send request to '%s' service:", service);
+        zmsg_dump (request);
+    }
+    mdshared_t *shared = mdshared_new (request_p);
+    estimate_t *estimate = self->hedge?
+                           s_mdcli_estimate (self, service): NULL;
+    int retries_left = self->retries;
+    while (retries_left && !zctx_interrupted) {
+        zmsg_t *reply = NULL;
+        int rc = s_mdcli_attempt (self, service, shared, estimate, &reply);
+        if (rc == 0) {
+            mdshared_destroy (&shared);
+            return reply;       //  Success
+        }
+        else
+        if (rc == -1)
+            break;              //  Interrupted
         else
         if (--retries_left) {
             if (self->verbose)
@@ -168,6 +376,6 @@ mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p)
     }
     if (zctx_interrupted)
         printf ("W: interrupt received, killing client...\n");
-    zmsg_destroy (&request);
+    mdshared_destroy (&shared);
     return NULL;
 }
@@ -24,6 +24,8 @@ void
     mdcli_set_timeout (mdcli_t *self, int timeout);
 void
     mdcli_set_retries (mdcli_t *self, int retries);
+void
+    mdcli_set_hedge (mdcli_t *self, double percentile);
 zmsg_t *
     mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p);
 
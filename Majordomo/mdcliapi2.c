@@ -2,6 +2,33 @@
 //  Implements the MDP/Worker spec at http://rfc.zeromq.org/spec:7.
 
 #include "mdcliapi2.h"
+#include "mdopts.h"
+
+//  Lets us build this source without creating a library; the broker API
+//  brings its own copy, if we're built together with it
+#ifndef __MDSHARED_H_INCLUDED__
+#include "mdshared.c"
+#endif
+
+//  Each request has a ticket, from when we send it until the caller takes
+//  its reply. The request ID is the ticket's slot in the low 32 bits and
+//  the slot's generation in the high 32 bits, so a reply finds its ticket
+//  at once, and a late reply to an earlier use of the slot, such as the
+//  answer to a request we sent twice, finds nothing.
+
+#define TICKET_FREE     0       //  Slot not in use
+#define TICKET_PENDING  1       //  Request sent, waiting for reply
+#define TICKET_DONE     2       //  Reply waiting for the caller
+#define TICKET_NONE     UINT32_MAX
+
+typedef struct {
+    uint32_t generation;        //  Bumped each time the slot is freed
+    int state;                  //  TICKET_FREE, PENDING or DONE
+    mdshared_t *request;        //  Whole request, kept for retransmits
+    zmsg_t *reply;              //  Reply, once done
+    uint32_t prev;              //  Previous ticket in done list
+    uint32_t next;              //  Next ticket in free or done list
+} ticket_t;
 
 //  Structure of our class
 //  We access these properties only via class methods
@@ -13,6 +40,16 @@ struct _mdcli_t {
     void *raw_client;           //  Raw Socket to broker
     int verbose;                //  Print activity to stdout
     int timeout;                //  Request timeout
+    int retries;                //  Request retries
+    int retries_left;           //  Retries left until we give up
+    size_t window;              //  Most requests in flight, 0 = no limit
+    int block;                  //  Send waits for window, else fails
+    ticket_t *tickets;          //  All tickets, by slot
+    uint32_t capacity;          //  How many slots we have
+    uint32_t free;              //  First free ticket
+    uint32_t done_head;         //  Oldest ticket with a reply
+    uint32_t done_tail;         //  Newest ticket with a reply
+    size_t inflight;            //  Tickets waiting for replies
 };
 
 //  Connect or reconnect to broker. In this asynchronous class we use a
@@ -33,7 +70,7 @@ void s_mdcli_connect_to_broker (mdcli_t *self)
 }
 
 //  The constructor and destructor are the same as in mdcliapi, except
-//  we don't do retries, so there's no retries property.
+//  that we also keep the tickets of requests in flight.
 //  .skip
 //  ---------------------------------------------------------------------
 //  Constructor
@@ -48,6 +85,13 @@ mdcli_new (char *broker, int verbose)
     self->broker = strdup (broker);
     self->verbose = verbose;
     self->timeout = 2500;           //  msecs
+    self->retries = 3;              //  Before we abandon
+    self->retries_left = self->retries;
+    self->window = 1000;            //  Requests in flight
+    self->block = 1;
+    self->free = TICKET_NONE;
+    self->done_head = TICKET_NONE;
+    self->done_tail = TICKET_NONE;
 
     s_mdcli_connect_to_broker (self);
     return self;
@@ -61,6 +105,12 @@ mdcli_destroy (mdcli_t **self_p)
     assert (self_p);
     if (*self_p) {
         mdcli_t *self = *self_p;
+        uint32_t slot;
+        for (slot = 0; slot < self->capacity; slot++) {
+            mdshared_destroy (&self->tickets [slot].request);
+            zmsg_destroy (&self->tickets [slot].reply);
+        }
+        free (self->tickets);
         zsock_destroy (&self->client);
         self->raw_client = NULL;
         zmq_ctx_destroy (&self->ctx);
@@ -79,82 +129,360 @@ mdcli_set_timeout (mdcli_t *self, int timeout)
     self->timeout = timeout;
 }
 
+//  Set request retries
+
+void
+mdcli_set_retries (mdcli_t *self, int retries)
+{
+    assert (self);
+    self->retries = retries;
+    self->retries_left = retries;
+}
+
 //  .until
-//  .skip
-//  The send method now just sends one message, without waiting for a
-//  reply. Since we're using a DEALER socket we have to send an empty
-//  frame at the start, to create the same envelope that the REQ socket
-//  would normally make for us:
+//  Set the most requests we have in flight at once, or 0 for no limit.
+//  Past the limit, a send either waits for a reply to make room, if block
+//  is set, or fails at once. Replies we take in while waiting are kept
+//  for mdcli_recv. The default is 1000 requests, and to wait.
 
-int
-mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p)
+void
+mdcli_set_window (mdcli_t *self, size_t window, int block)
 {
     assert (self);
-    assert (request_p);
-    zmsg_t *request = *request_p;
+    self->window = window;
+    self->block = block;
+}
+
+//  .split ticket methods
+//  Tickets live in one array, which we double when we run out; we refer
+//  to tickets by slot, never by address, so they can move:
+
+static uint32_t
+s_ticket_new (mdcli_t *self)
+{
+    if (self->free == TICKET_NONE) {
+        uint32_t capacity = self->capacity? self->capacity * 2: 64;
+        self->tickets = (ticket_t *) realloc (self->tickets,
+            capacity * sizeof (ticket_t));
+        assert (self->tickets);
+        memset (self->tickets + self->capacity, 0,
+                (capacity - self->capacity) * sizeof (ticket_t));
+        uint32_t slot;
+        for (slot = capacity; slot > self->capacity; slot--) {
+            self->tickets [slot - 1].generation = 1;
+            self->tickets [slot - 1].next = self->free;
+            self->free = slot - 1;
+        }
+        self->capacity = capacity;
+    }
+    uint32_t slot = self->free;
+    self->free = self->tickets [slot].next;
+    return slot;
+}
+
+static void
+s_ticket_free (mdcli_t *self, uint32_t slot)
+{
+    ticket_t *ticket = &self->tickets [slot];
+    mdshared_destroy (&ticket->request);
+    zmsg_destroy (&ticket->reply);
+    ticket->state = TICKET_FREE;
+    if (++ticket->generation == 0)
+        ticket->generation = 1;     //  So no request ID is ever zero
+    ticket->next = self->free;
+    self->free = slot;
+}
+
+//  Return the slot of the ticket a request ID refers to, or TICKET_NONE
+//  if the ID is not one of ours, or is from an earlier use of the slot
+
+static uint32_t
+s_ticket_lookup (mdcli_t *self, uint64_t id)
+{
+    uint32_t slot = (uint32_t) id;
+    if (slot >= self->capacity
+    ||  self->tickets [slot].generation != (uint32_t) (id >> 32)
+    ||  self->tickets [slot].state == TICKET_FREE)
+        return TICKET_NONE;
+    return slot;
+}
+
+//  Take a ticket off the done list
+
+static void
+s_ticket_unlink (mdcli_t *self, uint32_t slot)
+{
+    ticket_t *ticket = &self->tickets [slot];
+    if (ticket->prev == TICKET_NONE)
+        self->done_head = ticket->next;
+    else
+        self->tickets [ticket->prev].next = ticket->next;
+    if (ticket->next == TICKET_NONE)
+        self->done_tail = ticket->prev;
+    else
+        self->tickets [ticket->next].prev = ticket->prev;
+}
+
+//  .split accept method
+//  Process one reply from the broker. A reply that carries the request ID
+//  of a ticket waiting for it completes that ticket, in whatever order
+//  replies come. We drop anything else: replies to requests we have
+//  already had an answer for, and replies without an ID.
+
+static void
+s_mdcli_accept (mdcli_t *self, zmsg_t *msg)
+{
+    if (self->verbose) {
+        zclock_log ("I: received reply:");
+        zmsg_dump (msg);
+    }
+    //  Don't try to handle errors, just assert noisily
+    assert (zmsg_size (msg) >= 4);
+
+    zframe_t *empty = zmsg_pop (msg);
+    assert (zframe_streq (empty, ""));
+    zframe_destroy (&empty);
+
+    zframe_t *header = zmsg_pop (msg);
+    int has_options = zframe_streq (header, MDPC_CLIENT_OPTS);
+    assert (has_options || zframe_streq (header, MDPC_CLIENT));
+    zframe_destroy (&header);
+
+    zframe_t *service = zmsg_pop (msg);
+    zframe_destroy (&service);
+
+    mdopts_t options;
+    mdopts_init (&options);
+    if (has_options) {
+        zframe_t *options_frame = zmsg_pop (msg);
+        if (mdopts_decode (&options, options_frame))
+            zclock_log ("E: invalid reply options");
+        zframe_destroy (&options_frame);
+    }
+    uint32_t slot = s_ticket_lookup (self, options.correlation);
+    if (slot == TICKET_NONE
+    ||  self->tickets [slot].state != TICKET_PENDING) {
+        if (self->verbose)
+            zclock_log ("I: dropping reply to unknown request");
+        zmsg_destroy (&msg);
+        return;
+    }
+    ticket_t *ticket = &self->tickets [slot];
+    mdshared_destroy (&ticket->request);
+    ticket->reply = msg;
+    ticket->state = TICKET_DONE;
+    ticket->prev = self->done_tail;
+    ticket->next = TICKET_NONE;
+    if (self->done_tail == TICKET_NONE)
+        self->done_head = slot;
+    else
+        self->tickets [self->done_tail].next = slot;
+    self->done_tail = slot;
+    self->inflight--;
+    self->retries_left = self->retries;
+}
+
+//  .split receive method
+//  Wait for one reply from the broker, and process it. If no reply comes
+//  within the timeout, we assume the broker is gone, so we reconnect and
+//  send every request still in flight again, as the new connection has
+//  lost them. The broker may answer some of them twice, and we drop the
+//  second answer. When we run out of retries, we abandon every request
+//  in flight. Returns 0 if we got a reply, -1 if we were interrupted or
+//  gave up:
+
+static int
+s_mdcli_receive (mdcli_t *self)
+{
+    while (self->inflight) {
+        zmq_pollitem_t items [] = { { self->raw_client, 0, ZMQ_POLLIN, 0 } };
+        int rc = zmq_poll (items, 1, self->timeout * ZMQ_POLL_MSEC);
+        if (rc == -1)
+            return -1;          //  Interrupted
+
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (self->client);
+            if (!msg)
+                return -1;      //  Interrupted
+            s_mdcli_accept (self, msg);
+            return 0;
+        }
+        uint32_t slot;
+        if (--self->retries_left > 0) {
+            if (self->verbose)
+                zclock_log ("W: no reply, reconnecting and resending %zu"
+                            " requests...", self->inflight);
+            s_mdcli_connect_to_broker (self);
+            for (slot = 0; slot < self->capacity; slot++)
+                if (self->tickets [slot].state == TICKET_PENDING)
+                    mdshared_send (self->tickets [slot].request,
+                                   self->raw_client);
+        }
+        else {
+            if (self->verbose)
+                zclock_log ("W: permanent error, abandoning %zu requests",
+                            self->inflight);
+            for (slot = 0; slot < self->capacity; slot++)
+                if (self->tickets [slot].state == TICKET_PENDING)
+                    s_ticket_free (self, slot);
+            self->inflight = 0;
+            self->retries_left = self->retries;
+        }
+    }
+    return -1;
+}
+
+//  .split send methods
+//  The send methods now just send one message, without waiting for a
+//  reply, and return the request ID, which the caller can pass to
+//  mdcli_wait, and which mdcli_recv gives back with the reply. Since we're
+//  using a DEALER socket we have to send an empty frame at the start, to
+//  create the same envelope that the REQ socket would normally make for
+//  us. Every request carries its ID as a correlation ID in an options
+//  frame, and the broker returns that with the reply. We keep each
+//  request until its reply comes, sharing its frames with libzmq so we
+//  don't copy it, in case we have to send it again. Returns 0 if the
+//  window is full and we don't block, or if we were interrupted while
+//  waiting for room:
+
+static uint64_t
+s_mdcli_send (mdcli_t *self, char *service, mdopts_t *options,
+              zmsg_t **request_p)
+{
+    assert (self);
+    assert (request_p && *request_p);
+    assert (zmsg_size (*request_p) > 0);
+    while (self->window && self->inflight >= self->window) {
+        if (!self->block || s_mdcli_receive (self)) {
+            zmsg_destroy (request_p);
+            return 0;
+        }
+    }
+    uint32_t slot = s_ticket_new (self);
+    ticket_t *ticket = &self->tickets [slot];
+    uint64_t id = ((uint64_t) ticket->generation << 32) | slot;
 
     //  Prefix request with protocol frames
     //  Frame 0: empty (REQ emulation)
-    //  Frame 1: "MDPCxy" (six bytes, MDP/Client x.y)
+    //  Frame 1: "MDPC0X" (six bytes, MDP/Client with options)
     //  Frame 2: Service name (printable string)
+    //  Frame 3: Request options
+    options->correlation = id;
+    zmsg_t *request = *request_p;
+    zframe_t *options_frame = mdopts_encode (options);
+    zmsg_prepend (request, &options_frame);
     zmsg_pushstr (request, service);
-    zmsg_pushstr (request, MDPC_CLIENT);
+    zmsg_pushstr (request, MDPC_CLIENT_OPTS);
     zmsg_pushstr (request, "");
     if (self->verbose) {
         zclock_log ("I: send request to '%s' service:", service);
         zmsg_dump (request);
     }
-    zmsg_send (&request, self->client);
-    return 0;
+    ticket->request = mdshared_new (request_p);
+    ticket->state = TICKET_PENDING;
+    self->inflight++;
+    mdshared_send (ticket->request, self->raw_client);
+    return id;
 }
 
-//  .skip
-//  The recv method waits for a reply message and returns that to the 
-//  caller.
-//  ---------------------------------------------------------------------
-//  Returns the reply message or NULL if there was no reply. Does not
-//  attempt to recover from a broker failure, this is not possible
-//  without storing all unanswered requests and resending them all...
+uint64_t
+mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p)
+{
+    mdopts_t options;
+    mdopts_init (&options);
+    return s_mdcli_send (self, service, &options, request_p);
+}
 
-zmsg_t *
-mdcli_recv (mdcli_t *self)
+//  Send a request in a given priority class, one of the MDPC_PRIORITY_*
+//  values. The broker serves more urgent classes first:
+
+uint64_t
+mdcli_send_priority (mdcli_t *self, char *service, int priority,
+                     zmsg_t **request_p)
 {
-    assert (self);
+    assert (priority >= 0 && priority < MDPC_PRIORITIES);
+    mdopts_t options;
+    mdopts_init (&options);
+    options.priority = priority;
+    return s_mdcli_send (self, service, &options, request_p);
+}
 
-    //  Poll socket for a reply, with timeout
-    zmq_pollitem_t items [] = { { self->raw_client, 0, ZMQ_POLLIN, 0 } };
-    int rc = zmq_poll (items, 1, self->timeout * ZMQ_POLL_MSEC);
-    if (rc == -1)
-        return NULL;            //  Interrupted
-
-    //  If we got a reply, process it
-    if (items [0].revents & ZMQ_POLLIN) {
-        zmsg_t *msg = zmsg_recv (self->client);
-        if (self->verbose) {
-            zclock_log ("I: received reply:");
-            zmsg_dump (msg);
-        }
-        //  Don't try to handle errors, just assert noisily
-        assert (zmsg_size (msg) >= 4);
+//  Send a request with a routing key. A service whose workers are sticky
+//  sends requests with the same key to the same worker, as far as load
+//  allows; other services ignore the key. Keys are 1 to 255 bytes:
 
-        zframe_t *empty = zmsg_pop (msg);
-        assert (zframe_streq (empty, ""));
-        zframe_destroy (&empty);
+uint64_t
+mdcli_send_routed (mdcli_t *self, char *service, const byte *key,
+                   size_t key_size, zmsg_t **request_p)
+{
+    assert (key && key_size > 0 && key_size <= 255);
+    mdopts_t options;
+    mdopts_init (&options);
+    options.route = key;
+    options.route_size = key_size;
+    return s_mdcli_send (self, service, &options, request_p);
+}
 
-        zframe_t *header = zmsg_pop (msg);
-        assert (zframe_streq (header, MDPC_CLIENT));
-        zframe_destroy (&header);
+//  .split recv method
+//  The recv method returns the oldest reply the caller hasn't taken yet,
+//  waiting for one if need be, and gives the ID of its request in *id_p,
+//  if id_p isn't NULL. Replies come in the order workers answer, which
+//  need not be the order of the requests.
+//  ---------------------------------------------------------------------
+//  Returns the reply message or NULL if there was no reply: if nothing
+//  is in flight, or if we were interrupted, or gave up after retrying.
 
-        zframe_t *service = zmsg_pop (msg);
-        zframe_destroy (&service);
+zmsg_t *
+mdcli_recv (mdcli_t *self, uint64_t *id_p)
+{
+    assert (self);
+    while (self->done_head == TICKET_NONE)
+        if (s_mdcli_receive (self))
+            break;
 
-        return msg;     //  Success
+    uint32_t slot = self->done_head;
+    if (slot == TICKET_NONE) {
+        if (zctx_interrupted)
+            printf ("W: interrupt received, killing client...\n");
+        return NULL;
     }
-    if (zctx_interrupted)
-        printf ("W: interrupt received, killing client...\n");
-    else
-    if (self->verbose)
-        zclock_log ("W: permanent error, abandoning request");
+    ticket_t *ticket = &self->tickets [slot];
+    if (id_p)
+        *id_p = ((uint64_t) ticket->generation << 32) | slot;
+    zmsg_t *reply = ticket->reply;
+    ticket->reply = NULL;
+    s_ticket_unlink (self, slot);
+    s_ticket_free (self, slot);
+    return reply;     //  Success
+}
+
+//  .split wait method
+//  Wait for the reply to one request, and return it. Replies to other
+//  requests that come meanwhile stay for mdcli_recv or mdcli_wait. Returns
+//  NULL if the request is not in flight, or has already been answered and
+//  taken, or if we were interrupted, or gave up after retrying:
 
-    return NULL;
+zmsg_t *
+mdcli_wait (mdcli_t *self, uint64_t id)
+{
+    assert (self);
+    uint32_t slot = s_ticket_lookup (self, id);
+    while (slot != TICKET_NONE
+    &&     self->tickets [slot].state == TICKET_PENDING) {
+        if (s_mdcli_receive (self))
+            break;
+        slot = s_ticket_lookup (self, id);
+    }
+    if (slot == TICKET_NONE
+    ||  self->tickets [slot].state != TICKET_DONE) {
+        if (zctx_interrupted)
+            printf ("W: interrupt received, killing client...\n");
+        return NULL;
+    }
+    ticket_t *ticket = &self->tickets [slot];
+    zmsg_t *reply = ticket->reply;
+    ticket->reply = NULL;
+    s_ticket_unlink (self, slot);
+    s_ticket_free (self, slot);
+    return reply;
 }
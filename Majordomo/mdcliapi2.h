@@ -22,10 +22,22 @@ void
     mdcli_destroy (mdcli_t **self_p);
 void
     mdcli_set_timeout (mdcli_t *self, int timeout);
-int
+void
+    mdcli_set_retries (mdcli_t *self, int retries);
+void
+    mdcli_set_window (mdcli_t *self, size_t window, int block);
+uint64_t
     mdcli_send (mdcli_t *self, char *service, zmsg_t **request_p);
+uint64_t
+    mdcli_send_priority (mdcli_t *self, char *service, int priority,
+                         zmsg_t **request_p);
+uint64_t
+    mdcli_send_routed (mdcli_t *self, char *service, const byte *key,
+                       size_t key_size, zmsg_t **request_p);
+zmsg_t *
+    mdcli_recv (mdcli_t *self, uint64_t *id_p);
 zmsg_t *
-    mdcli_recv (mdcli_t *self);
+    mdcli_wait (mdcli_t *self, uint64_t id);
 
 #ifdef __cplusplus
 }
@@ -1,13 +1,28 @@
 //  Majordomo Protocol client example
-//  Uses the mdcli API to hide all MDP aspects
+//  Uses the mdcli API to hide all MDP aspects. With -h, hedges requests
+//  that are later than that percentile of recent replies.
 
 //  Lets us build this source without creating a library
 #include "mdcliapi.c"
 
 int main (int argc, char *argv [])
 {
-    int verbose = (argc > 1 && streq (argv [1], "-v"));
+    int verbose = 0;
+    double hedge = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-v"))
+            verbose = 1;
+        else
+        if (streq (argv [argn], "-h") && argn + 1 < argc)
+            hedge = atof (argv [++argn]);
+        else {
+            printf ("syntax: mdclient [-v] [-h percentile]\n");
+            return 1;
+        }
+    }
     mdcli_t *session = mdcli_new ("tcp://localhost:5555", verbose);
+    mdcli_set_hedge (session, hedge);
 
     int count;
     for (count = 0; count < 100000; count++) {
@@ -1,28 +1,50 @@
 //  Majordomo Protocol client example - asynchronous
-//  Uses the mdcli API to hide all MDP aspects
+//  Uses the mdcli API to hide all MDP aspects. Keeps at most a window of
+//  requests in flight, and checks each reply against its request.
 
 //  Lets us build this source without creating a library
 #include "mdcliapi2.c"
 
+#define REQUESTS    100000
+#define WINDOW      100
+
 int main (int argc, char *argv [])
 {
     int verbose = (argc > 1 && streq (argv [1], "-v"));
     mdcli_t *session = mdcli_new ("tcp://localhost:5555", verbose);
+    mdcli_set_window (session, WINDOW, 0);
 
-    int count;
-    for (count = 0; count < 100000; count++) {
-        zmsg_t *request = zmsg_new ();
-        zmsg_pushstr (request, "Hello world");
-        mdcli_send (session, "echo", &request);
-    }
-    for (count = 0; count < 100000; count++) {
-        zmsg_t *reply = mdcli_recv (session);
-        if (reply)
-            zmsg_destroy (&reply);
-        else
+    //  Each request carries its own number, which the echo service sends
+    //  back, so we can see that each reply has the right request ID
+    uint64_t *ids = (uint64_t *) zmalloc (REQUESTS * sizeof (uint64_t));
+    int sent = 0, count = 0, mismatched = 0;
+    while (count < REQUESTS) {
+        while (sent < REQUESTS) {
+            zmsg_t *request = zmsg_new ();
+            zmsg_addmem (request, &sent, sizeof (sent));
+            uint64_t id = mdcli_send (session, "echo", &request);
+            if (!id)
+                break;          //  Window is full
+            ids [sent++] = id;
+        }
+        uint64_t id;
+        zmsg_t *reply = mdcli_recv (session, &id);
+        if (!reply)
             break;              //  Interrupted by Ctrl-C
+        zframe_t *body = zmsg_first (reply);
+        int number;
+        if (!body || zframe_size (body) != sizeof (number))
+            mismatched++;
+        else {
+            memcpy (&number, zframe_data (body), sizeof (number));
+            if (number < 0 || number >= sent || ids [number] != id)
+                mismatched++;
+        }
+        zmsg_destroy (&reply);
+        count++;
     }
-    printf ("%d replies received\n", count);
+    printf ("%d replies received, %d mismatched\n", count, mismatched);
+    free (ids);
     mdcli_destroy (&session);
     return 0;
 }
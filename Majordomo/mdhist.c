@@ -0,0 +1,170 @@
+//  mdhist class - Log-bucketed latency histogram
+//  Values below 16 get a bucket each. Above that, a value whose highest
+//  set bit is b falls in one of 16 buckets spanning [2^b, 2^(b+1)),
+//  chosen by the next four bits. Values beyond the top are clamped.
+
+#include "mdhist.h"
+
+#define MDHIST_SUB_BITS     4
+#define MDHIST_SUB_COUNT    (1 << MDHIST_SUB_BITS)
+#define MDHIST_TOP_BIT      39      //  2^40 usecs is about 12 days
+#define MDHIST_BUCKETS      ((MDHIST_TOP_BIT - MDHIST_SUB_BITS + 2) \
+                             * MDHIST_SUB_COUNT)
+
+//  Structure of our class
+
+struct _mdhist_t {
+    uint64_t count;             //  Values recorded
+    int64_t max;                //  Largest value recorded
+    uint64_t buckets [MDHIST_BUCKETS];
+};
+
+//  Return bucket for value
+
+static inline size_t
+s_bucket_of (uint64_t value)
+{
+    if (value < MDHIST_SUB_COUNT)
+        return (size_t) value;
+    int top = 63 - __builtin_clzll (value);
+    if (top > MDHIST_TOP_BIT) {
+        top = MDHIST_TOP_BIT;
+        value = ((uint64_t) 2 << MDHIST_TOP_BIT) - 1;
+    }
+    size_t major = top - MDHIST_SUB_BITS + 1;
+    size_t minor = (value >> (top - MDHIST_SUB_BITS)) & (MDHIST_SUB_COUNT - 1);
+    return major * MDHIST_SUB_COUNT + minor;
+}
+
+//  Return highest value that falls in bucket
+
+static inline int64_t
+s_bucket_top (size_t bucket)
+{
+    size_t major = bucket / MDHIST_SUB_COUNT;
+    size_t minor = bucket % MDHIST_SUB_COUNT;
+    if (major == 0)
+        return (int64_t) minor;
+    int64_t width = (int64_t) 1 << (major - 1);
+    return ((MDHIST_SUB_COUNT + minor) * width) + width - 1;
+}
+
+//  .split constructor and destructor
+
+mdhist_t *
+mdhist_new (void)
+{
+    mdhist_t *self = (mdhist_t *) zmalloc (sizeof (mdhist_t));
+    return self;
+}
+
+void
+mdhist_destroy (mdhist_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+//  .split record and query methods
+//  Record one value; negative values, from clock steps, count as zero:
+
+void
+mdhist_record (mdhist_t *self, int64_t value)
+{
+    assert (self);
+    if (value < 0)
+        value = 0;
+    self->buckets [s_bucket_of ((uint64_t) value)]++;
+    self->count++;
+    if (value > self->max)
+        self->max = value;
+}
+
+//  Return number of values recorded
+
+uint64_t
+mdhist_count (mdhist_t *self)
+{
+    assert (self);
+    return self->count;
+}
+
+//  Return the value below which the given percentage of recorded values
+//  fall, to the precision of our buckets; zero if nothing was recorded
+
+int64_t
+mdhist_percentile (mdhist_t *self, double percentile)
+{
+    assert (self);
+    if (self->count == 0)
+        return 0;
+    uint64_t target = (uint64_t) (percentile / 100.0 * self->count + 0.5);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    size_t bucket;
+    for (bucket = 0; bucket < MDHIST_BUCKETS; bucket++) {
+        seen += self->buckets [bucket];
+        if (seen >= target) {
+            int64_t top = s_bucket_top (bucket);
+            return top < self->max? top: self->max;
+        }
+    }
+    return self->max;
+}
+
+//  Return largest value recorded
+
+int64_t
+mdhist_max (mdhist_t *self)
+{
+    assert (self);
+    return self->max;
+}
+
+//  Forget all recorded values
+
+void
+mdhist_reset (mdhist_t *self)
+{
+    assert (self);
+    memset (self, 0, sizeof (mdhist_t));
+}
+
+//  Add all values recorded in another histogram to this one, so threads
+//  can each record into their own and be summarized together
+
+void
+mdhist_merge (mdhist_t *self, mdhist_t *other)
+{
+    assert (self);
+    assert (other);
+    size_t bucket;
+    for (bucket = 0; bucket < MDHIST_BUCKETS; bucket++)
+        self->buckets [bucket] += other->buckets [bucket];
+    self->count += other->count;
+    if (other->max > self->max)
+        self->max = other->max;
+}
+
+//  Return a one-line summary for logs and MMI replies; the caller must
+//  free it
+
+char *
+mdhist_summary (mdhist_t *self, const char *name)
+{
+    assert (self);
+    char *summary = (char *) malloc (160);
+    assert (summary);
+    snprintf (summary, 160,
+        "%s count=%" PRIu64 " p50=%" PRId64 " p90=%" PRId64
+        " p99=%" PRId64 " p99.9=%" PRId64 " max=%" PRId64 " usec",
+        name, self->count,
+        mdhist_percentile (self, 50.0), mdhist_percentile (self, 90.0),
+        mdhist_percentile (self, 99.0), mdhist_percentile (self, 99.9),
+        self->max);
+    return summary;
+}
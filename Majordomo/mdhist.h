@@ -0,0 +1,43 @@
+/*  =====================================================================
+ *  mdhist.h - Log-bucketed latency histogram
+ *  HDR-style histogram of microsecond values: each power of two is split
+ *  into 16 linear buckets, giving about 6% precision from 1 usec up to
+ *  several days in a fixed 5 KB table. Recording never allocates.
+ *  ===================================================================== */
+
+#ifndef __MDHIST_H_INCLUDED__
+#define __MDHIST_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdhist_t mdhist_t;
+
+mdhist_t *
+    mdhist_new (void);
+void
+    mdhist_destroy (mdhist_t **self_p);
+void
+    mdhist_record (mdhist_t *self, int64_t value);
+uint64_t
+    mdhist_count (mdhist_t *self);
+int64_t
+    mdhist_percentile (mdhist_t *self, double percentile);
+int64_t
+    mdhist_max (mdhist_t *self);
+void
+    mdhist_reset (mdhist_t *self);
+void
+    mdhist_merge (mdhist_t *self, mdhist_t *other);
+char *
+    mdhist_summary (mdhist_t *self, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,250 @@
+//  mdindex class - Worker index keyed on raw routing identities
+//  Linear-probing hash table. Every slot holds its precomputed hash and,
+//  for short keys, the key bytes themselves, so looking up a typical
+//  5-byte libzmq routing identity touches one slot and never allocates.
+
+#include "mdindex.h"
+
+#define MDINDEX_INLINE      16      //  Longest key stored inside a slot
+#define MDINDEX_MIN_LIMIT   64      //  Initial number of slots, power of 2
+
+//  .split slot structure
+//  Each slot is 32 bytes on 64-bit systems. A slot is free when its item
+//  is NULL; we never store NULL items, so we don't need tombstones:
+
+typedef struct {
+    void *item;                 //  Item for this key, NULL if free
+    uint32_t hash;              //  Precomputed hash of key
+    uint8_t size;               //  Key size, identities are <= 255 bytes
+    union {
+        byte bytes [MDINDEX_INLINE];    //  Key, when it fits in slot
+        byte *heap;             //  Key, when it does not
+    } key;
+} slot_t;
+
+//  Structure of our class
+
+struct _mdindex_t {
+    slot_t *slots;              //  Table of slots
+    size_t limit;               //  Number of slots, power of 2
+    size_t size;                //  Number of items stored
+    size_t cursor;              //  Slot index for first/next
+};
+
+static inline byte *
+s_slot_key (slot_t *slot)
+{
+    return slot->size > MDINDEX_INLINE? slot->key.heap: slot->key.bytes;
+}
+
+//  Hash a key: FNV-1a, then a murmur3 finalizer because libzmq generates
+//  identities from a counter and FNV-1a alone mixes the low bits poorly
+
+uint32_t
+mdindex_hash (const byte *key, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t index;
+    for (index = 0; index < size; index++) {
+        hash ^= key [index];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+//  Return slot holding key, or NULL if there is none
+
+static slot_t *
+s_slot_find (mdindex_t *self, uint32_t hash, const byte *key, size_t size)
+{
+    size_t mask = self->limit - 1;
+    size_t index = hash & mask;
+    while (self->slots [index].item) {
+        slot_t *slot = &self->slots [index];
+        if (slot->hash == hash
+        &&  slot->size == size
+        &&  memcmp (s_slot_key (slot), key, size) == 0)
+            return slot;
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+//  Double the table; we reuse the stored hashes and key storage as-is
+
+static void
+s_index_grow (mdindex_t *self)
+{
+    slot_t *old_slots = self->slots;
+    size_t old_limit = self->limit;
+
+    self->limit = old_limit * 2;
+    self->slots = (slot_t *) zmalloc (self->limit * sizeof (slot_t));
+    assert (self->slots);
+
+    size_t mask = self->limit - 1;
+    size_t index;
+    for (index = 0; index < old_limit; index++) {
+        if (old_slots [index].item) {
+            size_t target = old_slots [index].hash & mask;
+            while (self->slots [target].item)
+                target = (target + 1) & mask;
+            self->slots [target] = old_slots [index];
+        }
+    }
+    free (old_slots);
+}
+
+//  .split constructor and destructor
+//  The index does not own its items; the caller must destroy them before
+//  or after destroying the index:
+
+mdindex_t *
+mdindex_new (void)
+{
+    mdindex_t *self = (mdindex_t *) zmalloc (sizeof (mdindex_t));
+    self->limit = MDINDEX_MIN_LIMIT;
+    self->slots = (slot_t *) zmalloc (self->limit * sizeof (slot_t));
+    assert (self->slots);
+    return self;
+}
+
+void
+mdindex_destroy (mdindex_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdindex_t *self = *self_p;
+        size_t index;
+        for (index = 0; index < self->limit; index++)
+            if (self->slots [index].item
+            &&  self->slots [index].size > MDINDEX_INLINE)
+                free (self->slots [index].key.heap);
+        free (self->slots);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split lookup, insert and delete methods
+//  Look up item by key, returns NULL if not found
+
+void *
+mdindex_lookup (mdindex_t *self, const byte *key, size_t size)
+{
+    assert (self);
+    slot_t *slot = s_slot_find (self, mdindex_hash (key, size), key, size);
+    return slot? slot->item: NULL;
+}
+
+//  Insert item under key. Returns 0 on success, -1 if the key was already
+//  present, in which case the index is not changed.
+
+int
+mdindex_insert (mdindex_t *self, const byte *key, size_t size, void *item)
+{
+    assert (self);
+    assert (item);
+    assert (size <= MDINDEX_MAX_KEY);
+
+    uint32_t hash = mdindex_hash (key, size);
+    if (s_slot_find (self, hash, key, size))
+        return -1;
+
+    //  Keep load factor at or below 3/4 so probe sequences stay short
+    if ((self->size + 1) * 4 > self->limit * 3)
+        s_index_grow (self);
+
+    size_t mask = self->limit - 1;
+    size_t index = hash & mask;
+    while (self->slots [index].item)
+        index = (index + 1) & mask;
+
+    slot_t *slot = &self->slots [index];
+    slot->item = item;
+    slot->hash = hash;
+    slot->size = (uint8_t) size;
+    if (size > MDINDEX_INLINE) {
+        slot->key.heap = (byte *) malloc (size);
+        assert (slot->key.heap);
+        memcpy (slot->key.heap, key, size);
+    }
+    else
+        memcpy (slot->key.bytes, key, size);
+    self->size++;
+    return 0;
+}
+
+//  Remove key from index and return its item, or NULL if not found. We
+//  shift following entries back into the hole instead of leaving a
+//  tombstone, so lookups never slow down as workers come and go.
+
+void *
+mdindex_delete (mdindex_t *self, const byte *key, size_t size)
+{
+    assert (self);
+    slot_t *slot = s_slot_find (self, mdindex_hash (key, size), key, size);
+    if (!slot)
+        return NULL;
+
+    void *item = slot->item;
+    if (slot->size > MDINDEX_INLINE)
+        free (slot->key.heap);
+
+    size_t mask = self->limit - 1;
+    size_t hole = slot - self->slots;
+    size_t index = hole;
+    while (true) {
+        index = (index + 1) & mask;
+        if (!self->slots [index].item)
+            break;
+        //  Move entry back if its home slot is not between hole and here
+        size_t home = self->slots [index].hash & mask;
+        if ((index > hole && (home <= hole || home > index))
+        ||  (index < hole && (home <= hole && home > index))) {
+            self->slots [hole] = self->slots [index];
+            hole = index;
+        }
+    }
+    self->slots [hole].item = NULL;
+    self->size--;
+    return item;
+}
+
+//  Return number of items in index
+
+size_t
+mdindex_size (mdindex_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+//  .split iteration
+//  Walk all items in table order. The index must not be modified while
+//  iterating, as deletion may move entries behind the cursor:
+
+void *
+mdindex_first (mdindex_t *self)
+{
+    assert (self);
+    self->cursor = 0;
+    return mdindex_next (self);
+}
+
+void *
+mdindex_next (mdindex_t *self)
+{
+    assert (self);
+    while (self->cursor < self->limit) {
+        void *item = self->slots [self->cursor++].item;
+        if (item)
+            return item;
+    }
+    return NULL;
+}
@@ -0,0 +1,47 @@
+/*  =====================================================================
+ *  mdindex.h - Worker index keyed on raw routing identities
+ *  Open-addressing hash table used by the Majordomo broker to find
+ *  workers from the identity frame of a ROUTER socket, without having
+ *  to hex-encode or copy the identity first.
+ *  ===================================================================== */
+
+#ifndef __MDINDEX_H_INCLUDED__
+#define __MDINDEX_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Longest key we index
+#define MDINDEX_MAX_KEY     255
+
+//  Opaque class structure
+typedef struct _mdindex_t mdindex_t;
+
+mdindex_t *
+    mdindex_new (void);
+void
+    mdindex_destroy (mdindex_t **self_p);
+void *
+    mdindex_lookup (mdindex_t *self, const byte *key, size_t size);
+int
+    mdindex_insert (mdindex_t *self, const byte *key, size_t size,
+                    void *item);
+void *
+    mdindex_delete (mdindex_t *self, const byte *key, size_t size);
+size_t
+    mdindex_size (mdindex_t *self);
+void *
+    mdindex_first (mdindex_t *self);
+void *
+    mdindex_next (mdindex_t *self);
+uint32_t
+    mdindex_hash (const byte *key, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,645 @@
+//  mdjournal class - Durable append-only request journal
+//  The journal is a directory of segment files, each mapped into memory.
+//  We only ever append, to the newest segment. A record is a 24-byte
+//  header and its payload. The header's type byte is stored last, so a
+//  record cut short when the broker dies reads as the end of the segment,
+//  and a checksum catches pages that only partly reached the disk when
+//  the machine dies. Making records durable is up to the caller, who
+//  calls mdjournal_sync as often as it wants to pay for.
+
+#include "mdjournal.h"
+#include "mdindex.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define MDJOURNAL_REQUEST   1       //  Payload holds a request
+#define MDJOURNAL_TOMBSTONE 2       //  Request was answered, no payload
+#define MDJOURNAL_SEGMENTS  4       //  Compact when we have more than this
+#define MDJOURNAL_SUFFIX    ".mdj"
+
+//  .split record and segment structures
+//  Records start on 8-byte boundaries. A request payload holds the
+//  priority (1 byte), the client's correlation ID and deadline (8 bytes
+//  each), the service name size (1 byte) and name, the number of frames
+//  (4 bytes), and each frame as size (4 bytes) and data:
+
+typedef struct {
+    uint64_t sequence;          //  Request sequence number
+    uint32_t size;              //  Payload size in bytes
+    uint32_t checksum;          //  Of sequence, type and payload
+    byte type;                  //  Record type, 0 if no record
+    byte padding [7];
+} record_t;
+
+typedef struct {
+    char *path;                 //  Segment file name
+    int fd;                     //  Open segment file
+    byte *data;                 //  File mapped into memory
+    size_t limit;               //  Size of file and mapping
+    size_t used;                //  Bytes filled with records
+    size_t synced;              //  Bytes known to be on disk
+    size_t live;                //  Requests here that are not answered
+} segment_t;
+
+//  Structure of our class
+
+struct _mdjournal_t {
+    char *directory;            //  Where the segments live
+    size_t segment_size;        //  Size of each new segment
+    size_t page_size;           //  For aligning msync calls
+    zlist_t *segments;          //  Oldest first, we append to the last
+    mdindex_t *live;            //  Segment of each live request
+    uint64_t sequence;          //  Last sequence number handed out
+    uint64_t next_number;       //  Number of next segment file
+    size_t pending;             //  Bytes written since last sync
+    bool compacting;            //  Copying live records out of a segment
+};
+
+static record_t *
+    s_journal_reserve (mdjournal_t *self, size_t size);
+static void
+    s_journal_commit (mdjournal_t *self, record_t *record, byte type,
+                      uint64_t sequence, size_t size);
+
+static inline size_t
+s_record_length (size_t size)
+{
+    return (sizeof (record_t) + size + 7) & ~(size_t) 7;
+}
+
+static inline byte *
+s_record_payload (record_t *record)
+{
+    return (byte *) (record + 1);
+}
+
+static inline byte *
+s_journal_put32 (byte *buffer, uint32_t value)
+{
+    buffer [0] = (byte) (value >> 24);
+    buffer [1] = (byte) (value >> 16);
+    buffer [2] = (byte) (value >> 8);
+    buffer [3] = (byte) value;
+    return buffer + 4;
+}
+
+static inline uint32_t
+s_journal_get32 (byte *buffer)
+{
+    return ((uint32_t) buffer [0] << 24) | ((uint32_t) buffer [1] << 16)
+         | ((uint32_t) buffer [2] << 8)  |  (uint32_t) buffer [3];
+}
+
+static inline byte *
+s_journal_put64 (byte *buffer, uint64_t value)
+{
+    buffer = s_journal_put32 (buffer, (uint32_t) (value >> 32));
+    return s_journal_put32 (buffer, (uint32_t) value);
+}
+
+static inline uint64_t
+s_journal_get64 (byte *buffer)
+{
+    return ((uint64_t) s_journal_get32 (buffer) << 32)
+         | s_journal_get32 (buffer + 4);
+}
+
+//  FNV-1a over the sequence number, type and payload
+
+static uint32_t
+s_checksum (uint64_t sequence, byte type, const byte *payload, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t index;
+    for (index = 0; index < 8; index++) {
+        hash ^= (byte) (sequence >> (index * 8));
+        hash *= 16777619u;
+    }
+    hash ^= type;
+    hash *= 16777619u;
+    for (index = 0; index < size; index++) {
+        hash ^= payload [index];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//  .split segment methods
+//  Return the record at offset in segment, or NULL if there is no
+//  complete, valid record there:
+
+static record_t *
+s_segment_record (segment_t *self, size_t offset)
+{
+    if (offset + sizeof (record_t) > self->limit)
+        return NULL;
+    record_t *record = (record_t *) (self->data + offset);
+    if (record->type == 0
+    ||  offset + s_record_length (record->size) > self->limit
+    ||  record->checksum != s_checksum (record->sequence, record->type,
+                                        s_record_payload (record),
+                                        record->size))
+        return NULL;
+    return record;
+}
+
+//  Map an open segment file; takes ownership of path and file
+
+static segment_t *
+s_segment_map (char *path, int fd, size_t limit)
+{
+    byte *data = (byte *) mmap (NULL, limit, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        zclock_log ("E: cannot map journal segment %s: %s",
+                    path, strerror (errno));
+        close (fd);
+        free (path);
+        return NULL;
+    }
+    segment_t *self = (segment_t *) zmalloc (sizeof (segment_t));
+    self->path = path;
+    self->fd = fd;
+    self->data = data;
+    self->limit = limit;
+    return self;
+}
+
+//  Create a new, zero-filled segment file
+
+static segment_t *
+s_segment_new (mdjournal_t *journal, size_t limit)
+{
+    char *path = zsys_sprintf ("%s/%016" PRIx64 MDJOURNAL_SUFFIX,
+                               journal->directory, journal->next_number);
+    int fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 || ftruncate (fd, (off_t) limit) == -1) {
+        zclock_log ("E: cannot create journal segment %s: %s",
+                    path, strerror (errno));
+        if (fd != -1) {
+            close (fd);
+            unlink (path);
+        }
+        free (path);
+        return NULL;
+    }
+    journal->next_number++;
+
+    //  Make sure the new file itself survives a crash
+    int dir_fd = open (journal->directory, O_RDONLY);
+    if (dir_fd != -1) {
+        fsync (dir_fd);
+        close (dir_fd);
+    }
+    return s_segment_map (path, fd, limit);
+}
+
+//  Open an existing segment file and find the end of its valid records
+
+static segment_t *
+s_segment_open (char *path)
+{
+    int fd = open (path, O_RDWR);
+    struct stat info;
+    if (fd == -1 || fstat (fd, &info) == -1 || info.st_size == 0) {
+        zclock_log ("E: cannot open journal segment %s", path);
+        if (fd != -1)
+            close (fd);
+        free (path);
+        return NULL;
+    }
+    segment_t *self = s_segment_map (path, fd, (size_t) info.st_size);
+    if (self) {
+        record_t *record;
+        while ((record = s_segment_record (self, self->used)))
+            self->used += s_record_length (record->size);
+        self->synced = self->used;
+    }
+    return self;
+}
+
+static void
+s_segment_destroy (segment_t **self_p, bool remove)
+{
+    assert (self_p);
+    if (*self_p) {
+        segment_t *self = *self_p;
+        munmap (self->data, self->limit);
+        close (self->fd);
+        if (remove)
+            unlink (self->path);
+        free (self->path);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split journal loading
+//  Work out which requests are still live: first collect every request
+//  that has a tombstone, then index the rest. Compaction may have left
+//  a request in two segments; the later copy wins:
+
+static int
+s_name_compare (const void *first, const void *second)
+{
+    return strcmp (*(char **) first, *(char **) second);
+}
+
+static void
+s_journal_load (mdjournal_t *self)
+{
+    mdindex_t *answered = mdindex_new ();
+    segment_t *segment = (segment_t *) zlist_first (self->segments);
+    while (segment) {
+        size_t offset;
+        for (offset = 0; offset < segment->used;) {
+            record_t *record = (record_t *) (segment->data + offset);
+            if (record->type == MDJOURNAL_TOMBSTONE)
+                mdindex_insert (answered, (byte *) &record->sequence,
+                                sizeof (record->sequence), (void *) 1);
+            if (record->sequence > self->sequence)
+                self->sequence = record->sequence;
+            offset += s_record_length (record->size);
+        }
+        segment = (segment_t *) zlist_next (self->segments);
+    }
+    segment = (segment_t *) zlist_first (self->segments);
+    while (segment) {
+        size_t offset;
+        for (offset = 0; offset < segment->used;) {
+            record_t *record = (record_t *) (segment->data + offset);
+            byte *key = (byte *) &record->sequence;
+            if (record->type == MDJOURNAL_REQUEST
+            &&  !mdindex_lookup (answered, key, sizeof (uint64_t))) {
+                segment_t *previous = (segment_t *)
+                    mdindex_delete (self->live, key, sizeof (uint64_t));
+                if (previous)
+                    previous->live--;
+                mdindex_insert (self->live, key, sizeof (uint64_t), segment);
+                segment->live++;
+            }
+            offset += s_record_length (record->size);
+        }
+        segment = (segment_t *) zlist_next (self->segments);
+    }
+    mdindex_destroy (&answered);
+}
+
+//  Delete the oldest segments once all their requests are answered
+
+static void
+s_journal_trim (mdjournal_t *self)
+{
+    segment_t *oldest = (segment_t *) zlist_head (self->segments);
+    while (oldest != zlist_tail (self->segments) && oldest->live == 0) {
+        zlist_pop (self->segments);
+        s_segment_destroy (&oldest, true);
+        oldest = (segment_t *) zlist_head (self->segments);
+    }
+}
+
+//  .split constructor and destructor
+//  Open the journal in directory, creating it if needed, and load any
+//  segments it holds. We always start a fresh segment rather than append
+//  after whatever a crash left at the end of the last one. Returns NULL
+//  if the directory or first segment can't be created:
+
+mdjournal_t *
+mdjournal_new (const char *directory, size_t segment_size)
+{
+    if (mkdir (directory, 0755) == -1 && errno != EEXIST) {
+        zclock_log ("E: cannot create journal %s: %s",
+                    directory, strerror (errno));
+        return NULL;
+    }
+    DIR *handle = opendir (directory);
+    if (!handle) {
+        zclock_log ("E: cannot open journal %s: %s",
+                    directory, strerror (errno));
+        return NULL;
+    }
+    mdjournal_t *self = (mdjournal_t *) zmalloc (sizeof (mdjournal_t));
+    self->directory = strdup (directory);
+    self->page_size = (size_t) sysconf (_SC_PAGESIZE);
+    self->segment_size = (segment_size + self->page_size - 1)
+                       & ~(self->page_size - 1);
+    self->segments = zlist_new ();
+    self->live = mdindex_new ();
+
+    //  Segment names are fixed-width hex numbers, so they sort by name
+    char **names = NULL;
+    size_t nbr_names = 0;
+    struct dirent *entry;
+    while ((entry = readdir (handle))) {
+        size_t length = strlen (entry->d_name);
+        if (length == 16 + strlen (MDJOURNAL_SUFFIX)
+        &&  streq (entry->d_name + 16, MDJOURNAL_SUFFIX)) {
+            names = (char **) realloc (names, (nbr_names + 1) * sizeof (char *));
+            assert (names);
+            names [nbr_names++] = strdup (entry->d_name);
+        }
+    }
+    closedir (handle);
+    if (nbr_names)
+        qsort (names, nbr_names, sizeof (char *), s_name_compare);
+
+    size_t index;
+    for (index = 0; index < nbr_names; index++) {
+        segment_t *segment = s_segment_open (
+            zsys_sprintf ("%s/%s", directory, names [index]));
+        if (segment)
+            zlist_append (self->segments, segment);
+        self->next_number = strtoull (names [index], NULL, 16) + 1;
+        free (names [index]);
+    }
+    free (names);
+    s_journal_load (self);
+
+    segment_t *segment = s_segment_new (self, self->segment_size);
+    if (!segment) {
+        mdjournal_destroy (&self);
+        return NULL;
+    }
+    zlist_append (self->segments, segment);
+    s_journal_trim (self);
+    return self;
+}
+
+void
+mdjournal_destroy (mdjournal_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdjournal_t *self = *self_p;
+        mdjournal_sync (self);
+        segment_t *segment;
+        while ((segment = (segment_t *) zlist_pop (self->segments)))
+            s_segment_destroy (&segment, false);
+        zlist_destroy (&self->segments);
+        mdindex_destroy (&self->live);
+        free (self->directory);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split replay method
+//  Pass every live request to the handler, oldest segment first, and
+//  return how many there were:
+
+size_t
+mdjournal_replay (mdjournal_t *self, mdjournal_fn *handler, void *argument)
+{
+    assert (self);
+    size_t count = 0;
+    segment_t *segment = (segment_t *) zlist_first (self->segments);
+    while (segment) {
+        size_t offset;
+        for (offset = 0; offset < segment->used;) {
+            record_t *record = (record_t *) (segment->data + offset);
+            offset += s_record_length (record->size);
+            if (record->type != MDJOURNAL_REQUEST
+            ||  mdindex_lookup (self->live, (byte *) &record->sequence,
+                                sizeof (uint64_t)) != segment)
+                continue;
+
+            byte *payload = s_record_payload (record);
+            int priority = *payload++;
+            uint64_t correlation = s_journal_get64 (payload);
+            int64_t deadline = (int64_t) s_journal_get64 (payload + 8);
+            payload += 16;
+            char service [256];
+            memcpy (service, payload + 1, payload [0]);
+            service [payload [0]] = 0;
+            payload += 1 + payload [0];
+            uint32_t frames = s_journal_get32 (payload);
+            payload += 4;
+
+            zmsg_t *msg = zmsg_new ();
+            while (frames--) {
+                uint32_t size = s_journal_get32 (payload);
+                zmsg_addmem (msg, payload + 4, size);
+                payload += 4 + size;
+            }
+            handler (argument, record->sequence, service, priority,
+                     correlation, deadline, msg);
+            count++;
+        }
+        segment = (segment_t *) zlist_next (self->segments);
+    }
+    return count;
+}
+
+//  .split append and remove methods
+//  Append a request to the journal and return its sequence number, or 0
+//  if the journal could not take it. The request is safe from a broker
+//  crash at once, and from a machine crash after the next sync. The
+//  deadline is on the wall clock, so it still holds after a restart:
+
+uint64_t
+mdjournal_append (mdjournal_t *self, const char *service, int priority,
+                  uint64_t correlation, int64_t deadline, zmsg_t *msg)
+{
+    assert (self);
+    size_t name_size = strlen (service);
+    assert (name_size <= 255);
+    size_t size = 1 + 16 + 1 + name_size + 4;
+    zframe_t *frame = zmsg_first (msg);
+    while (frame) {
+        size += 4 + zframe_size (frame);
+        frame = zmsg_next (msg);
+    }
+    if (size > UINT32_MAX)
+        return 0;
+    record_t *record = s_journal_reserve (self, size);
+    if (!record)
+        return 0;
+
+    byte *payload = s_record_payload (record);
+    *payload++ = (byte) priority;
+    payload = s_journal_put64 (payload, correlation);
+    payload = s_journal_put64 (payload, (uint64_t) deadline);
+    *payload++ = (byte) name_size;
+    memcpy (payload, service, name_size);
+    payload += name_size;
+    payload = s_journal_put32 (payload, (uint32_t) zmsg_size (msg));
+    frame = zmsg_first (msg);
+    while (frame) {
+        payload = s_journal_put32 (payload, (uint32_t) zframe_size (frame));
+        memcpy (payload, zframe_data (frame), zframe_size (frame));
+        payload += zframe_size (frame);
+        frame = zmsg_next (msg);
+    }
+    uint64_t sequence = ++self->sequence;
+    s_journal_commit (self, record, MDJOURNAL_REQUEST, sequence, size);
+
+    segment_t *segment = (segment_t *) zlist_tail (self->segments);
+    mdindex_insert (self->live, (byte *) &sequence, sizeof (sequence),
+                    segment);
+    segment->live++;
+    return sequence;
+}
+
+//  Record that a request was answered or abandoned, so we won't replay
+//  it. Unknown sequence numbers, including 0, are ignored:
+
+void
+mdjournal_remove (mdjournal_t *self, uint64_t sequence)
+{
+    assert (self);
+    segment_t *segment = (segment_t *) mdindex_delete (self->live,
+        (byte *) &sequence, sizeof (sequence));
+    if (!segment)
+        return;
+    segment->live--;
+    record_t *record = s_journal_reserve (self, 0);
+    if (record)
+        s_journal_commit (self, record, MDJOURNAL_TOMBSTONE, sequence, 0);
+    s_journal_trim (self);
+}
+
+//  .split sync methods
+//  Return how many bytes were written since the last sync:
+
+size_t
+mdjournal_pending (mdjournal_t *self)
+{
+    assert (self);
+    return self->pending;
+}
+
+//  Flush everything written so far to disk. Returns 0 if OK, -1 if the
+//  disk refused some of it:
+
+int
+mdjournal_sync (mdjournal_t *self)
+{
+    assert (self);
+    int rc = 0;
+    segment_t *segment = (segment_t *) zlist_first (self->segments);
+    while (segment) {
+        if (segment->synced < segment->used) {
+            size_t start = segment->synced & ~(self->page_size - 1);
+            if (msync (segment->data + start, segment->used - start,
+                       MS_SYNC) == 0)
+                segment->synced = segment->used;
+            else {
+                zclock_log ("E: cannot sync journal segment %s: %s",
+                            segment->path, strerror (errno));
+                rc = -1;
+            }
+        }
+        segment = (segment_t *) zlist_next (self->segments);
+    }
+    self->pending = 0;
+    return rc;
+}
+
+//  Return number of requests not yet answered
+
+size_t
+mdjournal_live (mdjournal_t *self)
+{
+    assert (self);
+    return mdindex_size (self->live);
+}
+
+//  .split record writing
+//  Reserve room for a record at the end of the newest segment, starting a
+//  new segment if it is full. The new segment is big enough for the
+//  record, even if that makes it larger than usual:
+
+static int
+s_journal_roll (mdjournal_t *self, size_t length)
+{
+    //  Make the full segment durable before we move on
+    mdjournal_sync (self);
+    size_t limit = self->segment_size;
+    if (length > limit)
+        limit = (length + self->page_size - 1) & ~(self->page_size - 1);
+    segment_t *segment = s_segment_new (self, limit);
+    if (!segment)
+        return -1;
+    zlist_append (self->segments, segment);
+    return 0;
+}
+
+static void
+    s_journal_compact (mdjournal_t *self);
+
+static record_t *
+s_journal_reserve (mdjournal_t *self, size_t size)
+{
+    size_t length = s_record_length (size);
+    segment_t *segment = (segment_t *) zlist_tail (self->segments);
+    while (segment->used + length > segment->limit) {
+        if (s_journal_roll (self, length))
+            return NULL;
+        if (!self->compacting)
+            s_journal_compact (self);
+        segment = (segment_t *) zlist_tail (self->segments);
+    }
+    return (record_t *) (segment->data + segment->used);
+}
+
+//  Fill in the header of a reserved record whose payload is in place, and
+//  add it to the segment
+
+static void
+s_journal_commit (mdjournal_t *self, record_t *record, byte type,
+                  uint64_t sequence, size_t size)
+{
+    segment_t *segment = (segment_t *) zlist_tail (self->segments);
+    record->sequence = sequence;
+    record->size = (uint32_t) size;
+    record->checksum = s_checksum (sequence, type,
+                                   s_record_payload (record), size);
+    //  Store type last, so a crash before this leaves no record at all
+    __atomic_store_n (&record->type, type, __ATOMIC_RELEASE);
+    segment->used += s_record_length (size);
+    self->pending += s_record_length (size);
+}
+
+//  .split compaction
+//  A long-lived request keeps its segment, and every segment after it,
+//  from being deleted. When we have too many segments, we copy the live
+//  requests in the oldest one to the newest one, and delete the oldest.
+//  Its copies are synced before the original goes:
+
+static void
+s_journal_compact (mdjournal_t *self)
+{
+    if (zlist_size (self->segments) <= MDJOURNAL_SEGMENTS)
+        return;
+    segment_t *oldest = (segment_t *) zlist_head (self->segments);
+    self->compacting = true;
+    size_t offset;
+    for (offset = 0; offset < oldest->used && oldest->live;) {
+        record_t *record = (record_t *) (oldest->data + offset);
+        offset += s_record_length (record->size);
+        byte *key = (byte *) &record->sequence;
+        if (record->type != MDJOURNAL_REQUEST
+        ||  mdindex_lookup (self->live, key, sizeof (uint64_t)) != oldest)
+            continue;
+
+        record_t *copy = s_journal_reserve (self, record->size);
+        if (!copy)
+            break;
+        memcpy (s_record_payload (copy), s_record_payload (record),
+                record->size);
+        s_journal_commit (self, copy, MDJOURNAL_REQUEST, record->sequence,
+                          record->size);
+        segment_t *newest = (segment_t *) zlist_tail (self->segments);
+        mdindex_delete (self->live, key, sizeof (uint64_t));
+        mdindex_insert (self->live, key, sizeof (uint64_t), newest);
+        oldest->live--;
+        newest->live++;
+    }
+    self->compacting = false;
+    if (oldest->live == 0) {
+        mdjournal_sync (self);
+        s_journal_trim (self);
+    }
+}
@@ -0,0 +1,50 @@
+/*  =====================================================================
+ *  mdjournal.h - Durable append-only request journal
+ *  Memory-mapped segment log of the requests a Majordomo broker has
+ *  queued, with a tombstone for each request once it is answered, so a
+ *  restarted broker can queue again every request it had not delivered.
+ *  ===================================================================== */
+
+#ifndef __MDJOURNAL_H_INCLUDED__
+#define __MDJOURNAL_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdjournal_t mdjournal_t;
+
+//  Called by mdjournal_replay for each live request; takes ownership of
+//  the message. The deadline is in msecs since the epoch, 0 = never.
+typedef void (mdjournal_fn) (void *argument, uint64_t sequence,
+                             const char *service, int priority,
+                             uint64_t correlation, int64_t deadline,
+                             zmsg_t *msg);
+
+mdjournal_t *
+    mdjournal_new (const char *directory, size_t segment_size);
+void
+    mdjournal_destroy (mdjournal_t **self_p);
+size_t
+    mdjournal_replay (mdjournal_t *self, mdjournal_fn *handler,
+                      void *argument);
+uint64_t
+    mdjournal_append (mdjournal_t *self, const char *service, int priority,
+                      uint64_t correlation, int64_t deadline, zmsg_t *msg);
+void
+    mdjournal_remove (mdjournal_t *self, uint64_t sequence);
+size_t
+    mdjournal_pending (mdjournal_t *self);
+int
+    mdjournal_sync (mdjournal_t *self);
+size_t
+    mdjournal_live (mdjournal_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
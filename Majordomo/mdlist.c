@@ -0,0 +1,106 @@
+//  mdlist class - Intrusive doubly-linked list
+//  The list is circular through its head sentinel, so insertion and
+//  removal have no special cases for the first and last items.
+
+#include "mdlist.h"
+
+//  Initialize an empty list
+
+void
+mdlist_init (mdlist_t *self)
+{
+    assert (self);
+    self->head.prev = &self->head;
+    self->head.next = &self->head;
+    self->size = 0;
+}
+
+//  Append link at end of list; link must not be on any list
+
+void
+mdlist_append (mdlist_t *self, mdlink_t *link)
+{
+    assert (self);
+    assert (link && !link->next);
+    link->prev = self->head.prev;
+    link->next = &self->head;
+    self->head.prev->next = link;
+    self->head.prev = link;
+    self->size++;
+}
+
+//  Remove link from list, if it is linked. The link must belong to this
+//  list, or to none.
+
+void
+mdlist_remove (mdlist_t *self, mdlink_t *link)
+{
+    assert (self);
+    assert (link);
+    if (!link->next)
+        return;
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = NULL;
+    link->next = NULL;
+    self->size--;
+}
+
+//  Remove and return first link, or NULL if list is empty
+
+mdlink_t *
+mdlist_pop (mdlist_t *self)
+{
+    mdlink_t *link = mdlist_first (self);
+    if (link)
+        mdlist_remove (self, link);
+    return link;
+}
+
+//  Return first link, or NULL if list is empty
+
+mdlink_t *
+mdlist_first (mdlist_t *self)
+{
+    assert (self);
+    return self->head.next == &self->head? NULL: self->head.next;
+}
+
+//  Return link after the given one, or NULL at end of list. Unlike zlist
+//  there is no cursor, so the caller can remove the current link after
+//  fetching its successor.
+
+mdlink_t *
+mdlist_next (mdlist_t *self, mdlink_t *link)
+{
+    assert (self);
+    assert (link);
+    return link->next == &self->head? NULL: link->next;
+}
+
+//  Return number of links in list
+
+size_t
+mdlist_size (mdlist_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+//  Return true if link is on a list
+
+int
+mdlist_linked (mdlink_t *link)
+{
+    assert (link);
+    return link->next != NULL;
+}
+
+//  Return the item a link is embedded in, given the link's offset within
+//  the item; use the mdlist_item macro rather than calling this directly
+
+void *
+mdlist_container (mdlink_t *link, size_t offset)
+{
+    return link? (char *) link - offset: NULL;
+}
@@ -0,0 +1,57 @@
+/*  =====================================================================
+ *  mdlist.h - Intrusive doubly-linked list
+ *  Items embed one mdlink_t per list they can belong to, so adding and
+ *  removing an item never allocates and removal is O(1).
+ *  ===================================================================== */
+
+#ifndef __MDLIST_H_INCLUDED__
+#define __MDLIST_H_INCLUDED__
+
+#include "czmq.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Link embedded in each item; both pointers are NULL when unlinked
+typedef struct _mdlink_t mdlink_t;
+struct _mdlink_t {
+    mdlink_t *prev;
+    mdlink_t *next;
+};
+
+//  List head, embedded in the owning structure
+typedef struct {
+    mdlink_t head;              //  Sentinel, head.next is first item
+    size_t size;                //  Number of linked items
+} mdlist_t;
+
+//  Return item containing link, or NULL if link is NULL
+#define mdlist_item(link, type, member) \
+    ((type *) mdlist_container ((link), offsetof (type, member)))
+
+void
+    mdlist_init (mdlist_t *self);
+void
+    mdlist_append (mdlist_t *self, mdlink_t *link);
+void
+    mdlist_remove (mdlist_t *self, mdlink_t *link);
+mdlink_t *
+    mdlist_pop (mdlist_t *self);
+mdlink_t *
+    mdlist_first (mdlist_t *self);
+mdlink_t *
+    mdlist_next (mdlist_t *self, mdlink_t *link);
+size_t
+    mdlist_size (mdlist_t *self);
+int
+    mdlist_linked (mdlink_t *link);
+void *
+    mdlist_container (mdlink_t *link, size_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
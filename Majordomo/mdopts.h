@@ -0,0 +1,300 @@
+/*  =====================================================================
+ *  mdopts.h - Majordomo request options
+ *  Encodes and decodes the optional frame that MDPC_CLIENT_OPTS requests
+ *  carry after the service name, and that workers may add after the
+ *  service name in READY, and that the broker adds before the client
+ *  envelope of REQUEST for workers that asked for request budgets or tags
+ *  in READY, and that such workers return before the envelope of REPLY.
+ *  Each item of a BATCH also starts with an options frame, and so do
+ *  replies to requests that carried a correlation ID. The frame is a
+ *  sequence of options, each a one-byte tag, a one-byte length and that
+ *  many bytes of value. Unknown tags are skipped, so peers can add
+ *  options independently.
+ *  ===================================================================== */
+
+#ifndef __MDOPTS_H_INCLUDED__
+#define __MDOPTS_H_INCLUDED__
+
+#include "czmq.h"
+#include "mdp.h"
+
+//  Option tags
+#define MDPO_PRIORITY       1       //  1 byte, priority class
+#define MDPO_CREDIT         2       //  4 bytes, worker credit window
+#define MDPO_CACHE          3       //  4 bytes, msecs replies may be cached
+#define MDPO_COALESCE       4       //  0 bytes, identical requests coalesce
+#define MDPO_ROUTE          5       //  1-255 bytes, request routing key
+#define MDPO_STICKY         6       //  0 bytes, route requests by key
+#define MDPO_DEADLINE       7       //  8 bytes, msecs since epoch
+#define MDPO_BUDGET         8       //  4 bytes, msecs left to answer; or
+                                    //  0 bytes in READY, send budgets
+#define MDPO_BATCH          9       //  4 bytes, most requests per BATCH
+#define MDPO_FRAMES         10      //  4 bytes, frames in a BATCH item
+#define MDPO_CORRELATE      11      //  8 bytes, client's request ID
+#define MDPO_CANCEL         12      //  0 bytes, cancel the request with
+                                    //  this correlation ID
+#define MDPO_TAG            13      //  8 bytes, broker's tag for a request;
+                                    //  or 0 bytes in READY, send tags
+
+//  Longest options frame we encode
+#define MDOPTS_MAX          512
+
+typedef struct {
+    int priority;               //  Priority class
+    uint32_t credit;            //  Requests a worker accepts at once
+    uint32_t cache_ttl;         //  Msecs broker may cache replies, 0 = no
+    int coalesce;               //  Broker may answer identical requests
+                                //  in flight with a single reply
+    const byte *route;          //  Routing key, points into the frame
+    size_t route_size;          //  Routing key size, 0 = no key
+    int sticky;                 //  Broker routes requests with the same
+                                //  key to the same worker
+    int64_t deadline;           //  When the client gives up, msecs since
+                                //  epoch, 0 = never
+    int64_t budget;             //  Msecs left to answer, -1 = no limit
+    int budgets;                //  Worker wants budgets with requests
+    uint32_t batch;             //  Requests a worker takes per BATCH
+    uint32_t frames;            //  Frames in a BATCH item, 0 = none
+    uint64_t correlation;       //  Request ID the client wants back with
+                                //  the reply, 0 = none
+    int cancel;                 //  Client no longer wants the request
+                                //  with this correlation ID
+    uint64_t tag;               //  Broker's tag for a request, which the
+                                //  worker returns with its reply, 0 = none
+    int tags;                   //  Worker wants requests tagged
+} mdopts_t;
+
+//  Set all options to their defaults
+
+static inline void
+mdopts_init (mdopts_t *self)
+{
+    memset (self, 0, sizeof (mdopts_t));
+    self->priority = MDPC_PRIORITY_NORMAL;
+    self->credit = 1;
+    self->budget = -1;
+    self->batch = 1;
+}
+
+//  Write every option that is not at its default value into a buffer of
+//  MDOPTS_MAX bytes, and return the encoded size
+
+static inline size_t
+mdopts_pack (mdopts_t *self, byte *buffer)
+{
+    size_t size = 0;
+    if (self->priority != MDPC_PRIORITY_NORMAL) {
+        buffer [size++] = MDPO_PRIORITY;
+        buffer [size++] = 1;
+        buffer [size++] = (byte) self->priority;
+    }
+    if (self->credit != 1) {
+        buffer [size++] = MDPO_CREDIT;
+        buffer [size++] = 4;
+        buffer [size++] = (byte) (self->credit >> 24);
+        buffer [size++] = (byte) (self->credit >> 16);
+        buffer [size++] = (byte) (self->credit >> 8);
+        buffer [size++] = (byte) self->credit;
+    }
+    if (self->cache_ttl) {
+        buffer [size++] = MDPO_CACHE;
+        buffer [size++] = 4;
+        buffer [size++] = (byte) (self->cache_ttl >> 24);
+        buffer [size++] = (byte) (self->cache_ttl >> 16);
+        buffer [size++] = (byte) (self->cache_ttl >> 8);
+        buffer [size++] = (byte) self->cache_ttl;
+    }
+    if (self->coalesce) {
+        buffer [size++] = MDPO_COALESCE;
+        buffer [size++] = 0;
+    }
+    if (self->route_size) {
+        assert (self->route_size <= 255);
+        buffer [size++] = MDPO_ROUTE;
+        buffer [size++] = (byte) self->route_size;
+        memcpy (buffer + size, self->route, self->route_size);
+        size += self->route_size;
+    }
+    if (self->sticky) {
+        buffer [size++] = MDPO_STICKY;
+        buffer [size++] = 0;
+    }
+    if (self->deadline) {
+        buffer [size++] = MDPO_DEADLINE;
+        buffer [size++] = 8;
+        int shift;
+        for (shift = 56; shift >= 0; shift -= 8)
+            buffer [size++] = (byte) ((uint64_t) self->deadline >> shift);
+    }
+    if (self->budget >= 0) {
+        uint32_t budget = self->budget < UINT32_MAX?
+                          (uint32_t) self->budget: UINT32_MAX;
+        buffer [size++] = MDPO_BUDGET;
+        buffer [size++] = 4;
+        buffer [size++] = (byte) (budget >> 24);
+        buffer [size++] = (byte) (budget >> 16);
+        buffer [size++] = (byte) (budget >> 8);
+        buffer [size++] = (byte) budget;
+    }
+    else
+    if (self->budgets) {
+        buffer [size++] = MDPO_BUDGET;
+        buffer [size++] = 0;
+    }
+    if (self->batch != 1) {
+        buffer [size++] = MDPO_BATCH;
+        buffer [size++] = 4;
+        buffer [size++] = (byte) (self->batch >> 24);
+        buffer [size++] = (byte) (self->batch >> 16);
+        buffer [size++] = (byte) (self->batch >> 8);
+        buffer [size++] = (byte) self->batch;
+    }
+    if (self->frames) {
+        buffer [size++] = MDPO_FRAMES;
+        buffer [size++] = 4;
+        buffer [size++] = (byte) (self->frames >> 24);
+        buffer [size++] = (byte) (self->frames >> 16);
+        buffer [size++] = (byte) (self->frames >> 8);
+        buffer [size++] = (byte) self->frames;
+    }
+    if (self->correlation) {
+        buffer [size++] = MDPO_CORRELATE;
+        buffer [size++] = 8;
+        int shift;
+        for (shift = 56; shift >= 0; shift -= 8)
+            buffer [size++] = (byte) (self->correlation >> shift);
+    }
+    if (self->cancel) {
+        buffer [size++] = MDPO_CANCEL;
+        buffer [size++] = 0;
+    }
+    if (self->tag) {
+        buffer [size++] = MDPO_TAG;
+        buffer [size++] = 8;
+        int shift;
+        for (shift = 56; shift >= 0; shift -= 8)
+            buffer [size++] = (byte) (self->tag >> shift);
+    }
+    else
+    if (self->tags) {
+        buffer [size++] = MDPO_TAG;
+        buffer [size++] = 0;
+    }
+    return size;
+}
+
+//  Return a new options frame holding every option that is not at its
+//  default value
+
+static inline zframe_t *
+mdopts_encode (mdopts_t *self)
+{
+    byte buffer [MDOPTS_MAX];
+    size_t size = mdopts_pack (self, buffer);
+    return zframe_new (buffer, size);
+}
+
+//  Decode an options frame. Options not in the frame keep their defaults.
+//  The routing key points into the frame, so is only valid while the frame
+//  is. Returns 0 if OK, -1 if the frame is malformed.
+
+static inline int
+mdopts_decode (mdopts_t *self, zframe_t *frame)
+{
+    mdopts_init (self);
+    byte *data = zframe_data (frame);
+    size_t size = zframe_size (frame);
+    size_t offset = 0;
+    while (offset + 2 <= size) {
+        byte tag = data [offset];
+        size_t length = data [offset + 1];
+        byte *value = data + offset + 2;
+        offset += 2 + length;
+        if (offset > size)
+            return -1;
+        if (tag == MDPO_PRIORITY && length == 1) {
+            if (*value >= MDPC_PRIORITIES)
+                return -1;
+            self->priority = *value;
+        }
+        else
+        if (tag == MDPO_CREDIT && length == 4) {
+            self->credit = ((uint32_t) value [0] << 24)
+                         | ((uint32_t) value [1] << 16)
+                         | ((uint32_t) value [2] << 8)
+                         |  (uint32_t) value [3];
+            if (self->credit == 0)
+                return -1;
+        }
+        else
+        if (tag == MDPO_CACHE && length == 4)
+            self->cache_ttl = ((uint32_t) value [0] << 24)
+                            | ((uint32_t) value [1] << 16)
+                            | ((uint32_t) value [2] << 8)
+                            |  (uint32_t) value [3];
+        else
+        if (tag == MDPO_COALESCE && length == 0)
+            self->coalesce = 1;
+        else
+        if (tag == MDPO_ROUTE && length > 0) {
+            self->route = value;
+            self->route_size = length;
+        }
+        else
+        if (tag == MDPO_STICKY && length == 0)
+            self->sticky = 1;
+        else
+        if (tag == MDPO_DEADLINE && length == 8) {
+            uint64_t deadline = 0;
+            size_t index;
+            for (index = 0; index < 8; index++)
+                deadline = (deadline << 8) | value [index];
+            self->deadline = (int64_t) deadline;
+        }
+        else
+        if (tag == MDPO_BUDGET && length == 4)
+            self->budget = ((uint32_t) value [0] << 24)
+                         | ((uint32_t) value [1] << 16)
+                         | ((uint32_t) value [2] << 8)
+                         |  (uint32_t) value [3];
+        else
+        if (tag == MDPO_BUDGET && length == 0)
+            self->budgets = 1;
+        else
+        if (tag == MDPO_BATCH && length == 4) {
+            self->batch = ((uint32_t) value [0] << 24)
+                        | ((uint32_t) value [1] << 16)
+                        | ((uint32_t) value [2] << 8)
+                        |  (uint32_t) value [3];
+            if (self->batch == 0)
+                return -1;
+        }
+        else
+        if (tag == MDPO_FRAMES && length == 4)
+            self->frames = ((uint32_t) value [0] << 24)
+                         | ((uint32_t) value [1] << 16)
+                         | ((uint32_t) value [2] << 8)
+                         |  (uint32_t) value [3];
+        else
+        if (tag == MDPO_CORRELATE && length == 8) {
+            size_t index;
+            for (index = 0; index < 8; index++)
+                self->correlation = (self->correlation << 8) | value [index];
+        }
+        else
+        if (tag == MDPO_CANCEL && length == 0)
+            self->cancel = 1;
+        else
+        if (tag == MDPO_TAG && length == 8) {
+            size_t index;
+            for (index = 0; index < 8; index++)
+                self->tag = (self->tag << 8) | value [index];
+        }
+        else
+        if (tag == MDPO_TAG && length == 0)
+            self->tags = 1;
+    }
+    return offset == size? 0: -1;
+}
+
+#endif
@@ -8,18 +8,80 @@
 //  This is the version of MDP/Client we implement
 #define MDPC_CLIENT         "MDPC01"
 
+//  Clients that attach request options send this header instead; the
+//  frame after the service name then holds the options (see mdopts.h).
+//  The broker replies with this header too, when the request carried a
+//  correlation ID, and the options frame gives that ID back. A message
+//  whose options ask to cancel a correlation ID has no body, and takes
+//  back that request from the service queue, if it's still there.
+#define MDPC_CLIENT_OPTS    "MDPC0X"
+
+//  Request priority classes, most urgent first. Requests without a
+//  priority option are in MDPC_PRIORITY_NORMAL.
+#define MDPC_PRIORITY_HIGH      0
+#define MDPC_PRIORITY_NORMAL    1
+#define MDPC_PRIORITY_LOW       2
+#define MDPC_PRIORITY_BULK      3
+#define MDPC_PRIORITIES         4
+
 //  This is the version of MDP/Worker we implement
 #define MDPW_WORKER         "MDPW01"
 
-//  MDP/Server commands, as strings
+//  MDP/Server commands, as strings. Workers that ask for tags in READY
+//  get an options frame with a tag before the client envelope of each
+//  REQUEST, and answer with the same options frame before the envelope
+//  of the REPLY, so they may answer requests in any order.
 #define MDPW_READY          "\001"
 #define MDPW_REQUEST        "\002"
 #define MDPW_REPLY          "\003"
 #define MDPW_HEARTBEAT      "\004"
 #define MDPW_DISCONNECT     "\005"
 
+//  Workers that ask for batches in READY may get several requests in one
+//  BATCH, and may answer with several replies in one BATCH, in the order
+//  of their requests unless they take tags. Each item is an options frame
+//  giving the number of frames that follow for the item, and its tag (see
+//  mdopts.h), then the client envelope and the body, as in REQUEST and
+//  REPLY.
+#define MDPW_BATCH          "\006"
+
+//  Longest service name the broker accepts
+#define MDP_MAX_SERVICE     255
+
+//  Status codes the broker returns to clients in place of a reply body,
+//  for MMI requests and for requests it cannot accept
+#define MDPC_OK             "200"
+#define MDPC_NOT_FOUND      "404"
+#define MDPC_NOT_IMPLEMENTED "501"
+#define MDPC_UNAVAILABLE    "503"
+
+//  mmi.stats replies with one frame per service after the status code:
+//  queued requests, waiting workers, total workers, and dispatches per
+//  second (4 bytes each), requests dispatched, rejected and dropped past
+//  their deadline (8 bytes each), requests queued in each priority class,
+//  MDPC_PRIORITY_HIGH first (4 bytes each, MDPC_PRIORITIES of them), then
+//  the service name. mmi.workers
+//  replies with one frame of worker records: identity size (1 byte),
+//  identity, state (1 byte), requests outstanding and credit (4 bytes
+//  each), then msecs until the worker expires unless it pings us (4
+//  bytes, signed). Integers are big-endian.
+//  An mmi.workers request may follow the service name with a frame
+//  giving the offset of the first worker to list and how many to list
+//  (4 bytes each). A reply lists at most MDPC_WORKERS_PAGE workers, and
+//  if more follow, ends with a frame giving the offset to ask for next
+//  (4 bytes).
+#define MDPC_STATS_HEADER   56
+#define MDPC_WORKERS_PAGE   1000
+#define MDPC_WORKER_IDLE    0       //  Nothing outstanding
+#define MDPC_WORKER_BUSY    1       //  Some requests, has credit left
+#define MDPC_WORKER_FULL    2       //  As many requests as its credit
+
+//  mmi.cache replies with one frame after the status code: reply cache
+//  hits, misses, evictions, expirations, entries and bytes, 8 bytes each
+#define MDPC_CACHE_RECORD   48
+
 static char *mdps_commands [] = {
-    NULL, "READY", "REQUEST", "REPLY", "HEARTBEAT", "DISCONNECT"
+    NULL, "READY", "REQUEST", "REPLY", "HEARTBEAT", "DISCONNECT", "BATCH"
 };
 
 #endif
@@ -0,0 +1,152 @@
+//  mdpool class - Pool allocator
+//  Block sizes are powers of two from 16 bytes to 32KB, and each size
+//  class keeps a free list threaded through its free blocks. We carve
+//  new blocks from 64KB slabs, which we keep on a list so we can free them
+//  all at once. Callers pass the size of a block when freeing it, so
+//  blocks need no header. Larger blocks come from the system allocator.
+
+#include "mdpool.h"
+
+#define POOL_CLASSES    12          //  16 bytes << 0..11
+#define POOL_MIN_BLOCK  16          //  Smallest block, keeps alignment
+#define POOL_MAX_BLOCK  (POOL_MIN_BLOCK << (POOL_CLASSES - 1))
+#define POOL_SLAB       (64 << 10)  //  Bytes per slab
+
+typedef struct _block_t {
+    struct _block_t *next;          //  Next free block in class
+} block_t;
+
+typedef union _slab_t {
+    union _slab_t *next;            //  Next slab in pool
+    max_align_t align;              //  Keeps blocks aligned after us
+} slab_t;
+
+//  Structure of our class
+
+struct _mdpool_t {
+    block_t *free [POOL_CLASSES];   //  Free blocks, by size class
+    byte *carve;                    //  Uncarved space in newest slab
+    size_t carve_size;              //  Bytes of it left
+    slab_t *slabs;                  //  All our slabs
+    size_t bytes;                   //  Bytes held in slabs
+};
+
+//  Return the size class of a block of at most POOL_MAX_BLOCK bytes
+
+static inline size_t
+s_pool_class (size_t size)
+{
+    size_t size_class = 0;
+    size_t block = POOL_MIN_BLOCK;
+    while (block < size) {
+        block <<= 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+//  .split constructor and destructor
+//  Destroying the pool frees every block it handed out, whether or not
+//  it was given back:
+
+mdpool_t *
+mdpool_new (void)
+{
+    mdpool_t *self = (mdpool_t *) zmalloc (sizeof (mdpool_t));
+    return self;
+}
+
+void
+mdpool_destroy (mdpool_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdpool_t *self = *self_p;
+        while (self->slabs) {
+            slab_t *next = self->slabs->next;
+            free (self->slabs);
+            self->slabs = next;
+        }
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split alloc and free methods
+//  A block comes off its class free list if it can, else from what is
+//  left of the newest slab, else from a new slab. Whatever is left of a
+//  slab too small for the block we want goes onto the free lists in the
+//  largest blocks that fit, so slabs are never wasted:
+
+void *
+mdpool_alloc (mdpool_t *self, size_t size)
+{
+    assert (self);
+#ifdef MDPOOL_MALLOC
+    return zmalloc (size);
+#else
+    if (size > POOL_MAX_BLOCK)
+        return zmalloc (size);
+
+    size_t size_class = s_pool_class (size);
+    size_t block_size = POOL_MIN_BLOCK << size_class;
+    block_t *block = self->free [size_class];
+    if (block)
+        self->free [size_class] = block->next;
+    else {
+        if (self->carve_size < block_size) {
+            while (self->carve_size >= POOL_MIN_BLOCK) {
+                size_t rest = s_pool_class (self->carve_size + 1) - 1;
+                block_t *spare = (block_t *) self->carve;
+                spare->next = self->free [rest];
+                self->free [rest] = spare;
+                self->carve += POOL_MIN_BLOCK << rest;
+                self->carve_size -= POOL_MIN_BLOCK << rest;
+            }
+            slab_t *slab = (slab_t *) malloc (sizeof (slab_t) + POOL_SLAB);
+            assert (slab);
+            slab->next = self->slabs;
+            self->slabs = slab;
+            self->bytes += POOL_SLAB;
+            self->carve = (byte *) (slab + 1);
+            self->carve_size = POOL_SLAB;
+        }
+        block = (block_t *) self->carve;
+        self->carve += block_size;
+        self->carve_size -= block_size;
+    }
+    memset (block, 0, size);
+    return block;
+#endif
+}
+
+//  Give a block back to the pool; size must be what it was allocated
+//  with. Does nothing if block is NULL.
+
+void
+mdpool_free (mdpool_t *self, void *block, size_t size)
+{
+    assert (self);
+#ifdef MDPOOL_MALLOC
+    free (block);
+#else
+    if (!block)
+        return;
+    if (size > POOL_MAX_BLOCK) {
+        free (block);
+        return;
+    }
+    size_t size_class = s_pool_class (size);
+    ((block_t *) block)->next = self->free [size_class];
+    self->free [size_class] = (block_t *) block;
+#endif
+}
+
+//  Return bytes the pool holds in slabs, in use or free
+
+size_t
+mdpool_bytes (mdpool_t *self)
+{
+    assert (self);
+    return self->bytes;
+}
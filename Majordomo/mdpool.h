@@ -0,0 +1,39 @@
+/*  =====================================================================
+ *  mdpool.h - Pool allocator
+ *  Hands out zeroed blocks from size-classed free lists, carved out of
+ *  large slabs. Freed blocks go back on their free list, and slabs are
+ *  only returned to the system when the pool is destroyed, so a steady
+ *  workload stops calling malloc altogether. A pool is not thread safe;
+ *  each broker thread owns its own. Build with MDPOOL_MALLOC to send
+ *  every allocation to the system allocator instead, for leak checkers
+ *  and for comparison.
+ *  ===================================================================== */
+
+#ifndef __MDPOOL_H_INCLUDED__
+#define __MDPOOL_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdpool_t mdpool_t;
+
+mdpool_t *
+    mdpool_new (void);
+void
+    mdpool_destroy (mdpool_t **self_p);
+void *
+    mdpool_alloc (mdpool_t *self, size_t size);
+void
+    mdpool_free (mdpool_t *self, void *block, size_t size);
+size_t
+    mdpool_bytes (mdpool_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+//  mdring class - Consistent hash ring
+//  The ring is a sorted array of points, each a 64-bit position and the
+//  item that owns it. Lookups are a binary search. Items join and leave
+//  rarely compared to lookups, so we pay for inserts with a memmove and
+//  for deletes with one pass over the array.
+
+#include "mdring.h"
+
+typedef struct {
+    uint64_t position;          //  Where the point sits on the ring
+    void *item;                 //  Item owning the point
+} point_t;
+
+//  Structure of our class
+
+struct _mdring_t {
+    point_t *points;            //  Points in order of position
+    size_t nbr_points;          //  Points in use
+    size_t max_points;          //  Points allocated
+    size_t replicas;            //  Points per item
+    size_t size;                //  Items on the ring
+};
+
+//  .split hash functions
+//  FNV-1a on 64 bits, with a murmur3 finalizer so that points for the
+//  same item, which differ only in their low bits, spread over the whole
+//  ring:
+
+static inline uint64_t
+s_ring_mix (uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+//  Hash a routing key; zero is never returned, so callers can use it to
+//  mean "no key"
+
+uint64_t
+mdring_hash (const byte *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t index;
+    for (index = 0; index < size; index++) {
+        hash ^= data [index];
+        hash *= 1099511628211ull;
+    }
+    hash = s_ring_mix (hash);
+    return hash? hash: 1;
+}
+
+//  Return index of the first point at or after position, which is
+//  nbr_points if there is none
+
+static size_t
+s_ring_search (mdring_t *self, uint64_t position)
+{
+    size_t low = 0;
+    size_t high = self->nbr_points;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (self->points [middle].position < position)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+//  .split constructor and destructor
+//  More replicas spread keys more evenly, at the cost of memory and of
+//  slower joins; around 100 points per item keep the busiest item within
+//  about 10% of the average:
+
+mdring_t *
+mdring_new (size_t replicas)
+{
+    assert (replicas > 0);
+    mdring_t *self = (mdring_t *) zmalloc (sizeof (mdring_t));
+    self->replicas = replicas;
+    return self;
+}
+
+void
+mdring_destroy (mdring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mdring_t *self = *self_p;
+        free (self->points);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split insert and delete methods
+//  An item's points depend only on its identity, so an item that leaves
+//  and joins again gets back the same keys:
+
+void
+mdring_insert (mdring_t *self, const byte *id, size_t size, void *item)
+{
+    assert (self);
+    assert (item);
+    if (self->nbr_points + self->replicas > self->max_points) {
+        self->max_points = (self->nbr_points + self->replicas) * 2;
+        self->points = (point_t *) realloc (self->points,
+            self->max_points * sizeof (point_t));
+        assert (self->points);
+    }
+    uint64_t base = mdring_hash (id, size);
+    size_t replica;
+    for (replica = 0; replica < self->replicas; replica++) {
+        uint64_t position = s_ring_mix (base + replica);
+        size_t index = s_ring_search (self, position);
+        memmove (self->points + index + 1, self->points + index,
+                 (self->nbr_points - index) * sizeof (point_t));
+        self->points [index].position = position;
+        self->points [index].item = item;
+        self->nbr_points++;
+    }
+    self->size++;
+}
+
+//  Remove all points owned by item, if any
+
+void
+mdring_delete (mdring_t *self, void *item)
+{
+    assert (self);
+    size_t kept = 0;
+    size_t index;
+    for (index = 0; index < self->nbr_points; index++)
+        if (self->points [index].item != item)
+            self->points [kept++] = self->points [index];
+    if (kept < self->nbr_points)
+        self->size--;
+    self->nbr_points = kept;
+}
+
+//  .split lookup method
+//  Return the item owning key, or NULL if the ring is empty. Keys past
+//  the last point wrap around to the first:
+
+void *
+mdring_lookup (mdring_t *self, uint64_t key)
+{
+    assert (self);
+    if (self->nbr_points == 0)
+        return NULL;
+    size_t index = s_ring_search (self, key);
+    if (index == self->nbr_points)
+        index = 0;
+    return self->points [index].item;
+}
+
+//  Return number of items on the ring
+
+size_t
+mdring_size (mdring_t *self)
+{
+    assert (self);
+    return self->size;
+}
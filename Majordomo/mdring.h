@@ -0,0 +1,40 @@
+/*  =====================================================================
+ *  mdring.h - Consistent hash ring
+ *  Maps 64-bit keys onto a changing set of items, such as the workers of
+ *  a service. Each item owns a number of points on the ring, and a key
+ *  goes to the item owning the first point at or after it, so adding or
+ *  removing one of N items only moves about 1/N of the keys.
+ *  ===================================================================== */
+
+#ifndef __MDRING_H_INCLUDED__
+#define __MDRING_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdring_t mdring_t;
+
+mdring_t *
+    mdring_new (size_t replicas);
+void
+    mdring_destroy (mdring_t **self_p);
+void
+    mdring_insert (mdring_t *self, const byte *id, size_t size, void *item);
+void
+    mdring_delete (mdring_t *self, void *item);
+void *
+    mdring_lookup (mdring_t *self, uint64_t key);
+size_t
+    mdring_size (mdring_t *self);
+uint64_t
+    mdring_hash (const byte *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
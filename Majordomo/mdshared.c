@@ -0,0 +1,96 @@
+//  mdshared class - Shared message for repeated zero-copy sends
+//  libzmq may still hold parts of a sent message after zmq_msg_send
+//  returns, and releases them from its I/O thread, so the reference
+//  count is atomic.
+
+#include "mdshared.h"
+#include <stdatomic.h>
+
+//  Frames smaller than this are copied; libzmq stores them inline in the
+//  zmq_msg_t anyway, so sharing them would gain nothing
+#define MDSHARED_MIN_SIZE   64
+
+//  Structure of our class
+
+struct _mdshared_t {
+    zmsg_t *msg;                //  Message we share
+    atomic_int refs;            //  Our reference, plus one per part
+};
+
+//  Drop one reference, freeing message on last one
+
+static void
+s_mdshared_release (void *data, void *hint)
+{
+    mdshared_t *self = (mdshared_t *) hint;
+    if (atomic_fetch_sub (&self->refs, 1) == 1) {
+        zmsg_destroy (&self->msg);
+        free (self);
+    }
+}
+
+//  .split constructor and destructor
+//  The constructor takes ownership of the message. The destructor drops
+//  the caller's reference; parts still queued in libzmq keep the message
+//  alive until they are sent or discarded:
+
+mdshared_t *
+mdshared_new (zmsg_t **msg_p)
+{
+    assert (msg_p && *msg_p);
+    mdshared_t *self = (mdshared_t *) zmalloc (sizeof (mdshared_t));
+    self->msg = *msg_p;
+    atomic_init (&self->refs, 1);
+    *msg_p = NULL;
+    return self;
+}
+
+void
+mdshared_destroy (mdshared_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_mdshared_release (NULL, *self_p);
+        *self_p = NULL;
+    }
+}
+
+//  .split send method
+//  Send the shared message to a socket, which may be a zsock_t or a raw
+//  libzmq socket. Returns 0 if OK, -1 if the send failed:
+
+int
+mdshared_send (mdshared_t *self, void *socket)
+{
+    assert (self);
+    void *handle = zsock_resolve (socket);
+    zframe_t *frame = zmsg_first (self->msg);
+    while (frame) {
+        zmq_msg_t part;
+        size_t size = zframe_size (frame);
+        if (size < MDSHARED_MIN_SIZE) {
+            zmq_msg_init_size (&part, size);
+            memcpy (zmq_msg_data (&part), zframe_data (frame), size);
+        }
+        else {
+            atomic_fetch_add (&self->refs, 1);
+            zmq_msg_init_data (&part, zframe_data (frame), size,
+                               s_mdshared_release, self);
+        }
+        frame = zmsg_next (self->msg);
+        if (zmq_msg_send (&part, handle, frame? ZMQ_SNDMORE: 0) == -1) {
+            zmq_msg_close (&part);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//  Return the shared message; the caller must not modify it
+
+zmsg_t *
+mdshared_msg (mdshared_t *self)
+{
+    assert (self);
+    return self->msg;
+}
@@ -0,0 +1,34 @@
+/*  =====================================================================
+ *  mdshared.h - Shared message for repeated zero-copy sends
+ *  Wraps a message so that it can be sent any number of times without
+ *  copying its frames: each send passes libzmq refcounted zmq_msg_t parts
+ *  that point into the wrapped frames, which are freed when the last
+ *  part is released.
+ *  ===================================================================== */
+
+#ifndef __MDSHARED_H_INCLUDED__
+#define __MDSHARED_H_INCLUDED__
+
+#include "czmq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdshared_t mdshared_t;
+
+mdshared_t *
+    mdshared_new (zmsg_t **msg_p);
+void
+    mdshared_destroy (mdshared_t **self_p);
+int
+    mdshared_send (mdshared_t *self, void *socket);
+zmsg_t *
+    mdshared_msg (mdshared_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+//  mdwheel class - Hierarchical timer wheel
+//  Four levels of 64 slots. Level 0 holds timers due within the next 64
+//  ticks, one slot per tick; each higher level covers 64 times the span
+//  of the one below, and its slots are cascaded down as the wheel turns.
+//  With a 10 msec tick this reaches about 46 hours ahead; later timers
+//  are parked in the last slot and cascaded again.
+
+#include "mdwheel.h"
+
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_SPAN      ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+//  Structure of our class
+
+struct _mdwheel_t {
+    mdlist_t slots [WHEEL_LEVELS][WHEEL_SLOTS];
+    mdlist_t due;               //  Timers that are due, in firing order
+    int64_t origin;             //  Clock time of tick zero, msecs
+    int resolution;             //  Msecs per tick
+    uint64_t tick;              //  Last tick we have processed
+    size_t pending;             //  Timers held in slots
+};
+
+//  .split timer methods
+//  Initialize a timer before first use:
+
+void
+mdtimer_init (mdtimer_t *timer, mdtimer_fn *handler, void *arg)
+{
+    assert (timer);
+    memset (timer, 0, sizeof (mdtimer_t));
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+//  Return true if timer is scheduled and has not yet fired
+
+int
+mdtimer_scheduled (mdtimer_t *timer)
+{
+    assert (timer);
+    return timer->list != NULL;
+}
+
+//  .split constructor and destructor
+//  The wheel does not own its timers; destroying the wheel leaves them
+//  in an undefined state, so do it only when their owners are gone:
+
+mdwheel_t *
+mdwheel_new (int64_t now, int resolution)
+{
+    assert (resolution > 0);
+    mdwheel_t *self = (mdwheel_t *) zmalloc (sizeof (mdwheel_t));
+    int level, slot;
+    for (level = 0; level < WHEEL_LEVELS; level++)
+        for (slot = 0; slot < WHEEL_SLOTS; slot++)
+            mdlist_init (&self->slots [level][slot]);
+    mdlist_init (&self->due);
+    self->origin = now;
+    self->resolution = resolution;
+    return self;
+}
+
+void
+mdwheel_destroy (mdwheel_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+//  .split placing timers
+//  Put timer in the slot matching its expiry tick. A timer that is due
+//  already goes straight onto the due list:
+
+static void
+s_wheel_place (mdwheel_t *self, mdtimer_t *timer)
+{
+    if (timer->expires <= self->tick) {
+        timer->list = &self->due;
+        mdlist_append (&self->due, &timer->link);
+        return;
+    }
+    uint64_t delta = timer->expires - self->tick;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        timer->expires = self->tick + delta;
+    }
+    int level = 0;
+    while (delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+        level++;
+    size_t slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer->list = &self->slots [level][slot];
+    mdlist_append (timer->list, &timer->link);
+    self->pending++;
+}
+
+//  Schedule timer to fire at or after deadline; if timer was already
+//  scheduled, it is moved. We round up to whole ticks so a timer never
+//  fires early.
+
+void
+mdwheel_schedule (mdwheel_t *self, mdtimer_t *timer, int64_t deadline)
+{
+    assert (self);
+    assert (timer);
+    mdwheel_cancel (self, timer);
+
+    timer->deadline = deadline;
+    if (deadline <= self->origin)
+        timer->expires = 0;
+    else
+        timer->expires = (deadline - self->origin + self->resolution - 1)
+                       / self->resolution;
+    s_wheel_place (self, timer);
+}
+
+//  Cancel timer, if it is scheduled
+
+void
+mdwheel_cancel (mdwheel_t *self, mdtimer_t *timer)
+{
+    assert (self);
+    assert (timer);
+    if (timer->list) {
+        if (timer->list != &self->due)
+            self->pending--;
+        mdlist_remove (timer->list, &timer->link);
+        timer->list = NULL;
+    }
+}
+
+//  .split turning the wheel
+//  Advance one tick. When level 0 wraps we cascade the current slot of
+//  level 1 back down, and so on up the levels; then the level 0 slot for
+//  this tick holds exactly the timers due now:
+
+static void
+s_wheel_cascade (mdwheel_t *self, int level, size_t slot)
+{
+    mdlist_t *list = &self->slots [level][slot];
+    mdlink_t *link;
+    while ((link = mdlist_pop (list))) {
+        self->pending--;
+        s_wheel_place (self, mdlist_item (link, mdtimer_t, link));
+    }
+}
+
+static void
+s_wheel_tick (mdwheel_t *self)
+{
+    self->tick++;
+    size_t slot = self->tick & WHEEL_MASK;
+    if (slot == 0) {
+        int level;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            size_t upper = (self->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            s_wheel_cascade (self, level, upper);
+            if (upper != 0)
+                break;
+        }
+    }
+    mdlist_t *list = &self->slots [0][slot];
+    mdlink_t *link;
+    while ((link = mdlist_pop (list))) {
+        mdtimer_t *timer = mdlist_item (link, mdtimer_t, link);
+        self->pending--;
+        timer->list = &self->due;
+        mdlist_append (&self->due, link);
+    }
+}
+
+//  Turn the wheel up to now and fire every timer that is due. Returns
+//  the number of timers fired.
+
+size_t
+mdwheel_execute (mdwheel_t *self, int64_t now)
+{
+    assert (self);
+    uint64_t target = now > self->origin?
+        (uint64_t) (now - self->origin) / self->resolution: 0;
+    if (self->pending == 0 && target > self->tick)
+        self->tick = target;        //  Nothing to cascade, just jump
+    while (self->tick < target)
+        s_wheel_tick (self);
+
+    size_t fired = 0;
+    mdlink_t *link;
+    while ((link = mdlist_pop (&self->due))) {
+        mdtimer_t *timer = mdlist_item (link, mdtimer_t, link);
+        timer->list = NULL;
+        fired++;
+        if (timer->handler)
+            (timer->handler) (timer, timer->arg);
+    }
+    return fired;
+}
+
+//  .split poll timeout
+//  Return msecs until the wheel next needs to be executed, or -1 if no
+//  timers are scheduled. Level 0 gives an exact answer; for higher levels
+//  we take when the first non-empty slot will be cascaded, which is never
+//  later than the timers it holds, and return the earliest of these:
+
+int64_t
+mdwheel_timeout (mdwheel_t *self, int64_t now)
+{
+    assert (self);
+    if (mdlist_size (&self->due))
+        return 0;
+    if (self->pending == 0)
+        return -1;
+
+    uint64_t next = 0;
+    uint64_t tick;
+    for (tick = self->tick + 1; tick < self->tick + WHEEL_SLOTS; tick++)
+        if (mdlist_size (&self->slots [0][tick & WHEEL_MASK])) {
+            next = tick;
+            break;
+        }
+    int level;
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        uint64_t period = (uint64_t) 1 << (WHEEL_BITS * level);
+        uint64_t base = self->tick / period + 1;
+        size_t offset;
+        for (offset = 0; offset < WHEEL_SLOTS; offset++) {
+            size_t slot = (base + offset) & WHEEL_MASK;
+            if (mdlist_size (&self->slots [level][slot])) {
+                uint64_t cascade_at = (base + offset) * period;
+                if (!next || cascade_at < next)
+                    next = cascade_at;
+                break;
+            }
+        }
+    }
+    int64_t timeout = self->origin + (int64_t) (next * self->resolution) - now;
+    return timeout > 0? timeout: 0;
+}
+
+//  Return number of scheduled timers
+
+size_t
+mdwheel_size (mdwheel_t *self)
+{
+    assert (self);
+    return self->pending + mdlist_size (&self->due);
+}
@@ -0,0 +1,58 @@
+/*  =====================================================================
+ *  mdwheel.h - Hierarchical timer wheel
+ *  Schedules intrusive timers with O(1) insert and cancel, and fires
+ *  only the timers that are due, so periodic per-worker work costs time
+ *  proportional to the number of workers actually due.
+ *  ===================================================================== */
+
+#ifndef __MDWHEEL_H_INCLUDED__
+#define __MDWHEEL_H_INCLUDED__
+
+#include "czmq.h"
+#include "mdlist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdwheel_t mdwheel_t;
+
+//  Timer embedded in the object it belongs to; handler is called once
+//  when the timer fires, and may schedule or cancel any timer
+typedef struct _mdtimer_t mdtimer_t;
+typedef void (mdtimer_fn) (mdtimer_t *timer, void *arg);
+struct _mdtimer_t {
+    mdlink_t link;              //  Link in wheel slot or due list
+    mdlist_t *list;             //  List we're on, NULL if not scheduled
+    uint64_t expires;           //  Tick at which timer fires
+    int64_t deadline;           //  Requested deadline, msecs
+    mdtimer_fn *handler;        //  Called when timer fires
+    void *arg;                  //  Argument for handler
+};
+
+void
+    mdtimer_init (mdtimer_t *timer, mdtimer_fn *handler, void *arg);
+int
+    mdtimer_scheduled (mdtimer_t *timer);
+
+mdwheel_t *
+    mdwheel_new (int64_t now, int resolution);
+void
+    mdwheel_destroy (mdwheel_t **self_p);
+void
+    mdwheel_schedule (mdwheel_t *self, mdtimer_t *timer, int64_t deadline);
+void
+    mdwheel_cancel (mdwheel_t *self, mdtimer_t *timer);
+size_t
+    mdwheel_execute (mdwheel_t *self, int64_t now);
+int64_t
+    mdwheel_timeout (mdwheel_t *self, int64_t now);
+size_t
+    mdwheel_size (mdwheel_t *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
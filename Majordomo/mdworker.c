@@ -1,20 +1,62 @@
 //  Majordomo Protocol worker example
-//  Uses the mdwrk API to hide all MDP aspects
+//  Uses the mdwrk API to hide all MDP aspects. With -t, serves requests
+//  from a pool of that many handler threads over one broker connection.
+//  With -b, takes requests in batches of up to that many.
 
 //  Lets us build this source without creating a library
 #include "mdwrkapi.c"
 
+//  Echo handler for the thread pool
+
+static zmsg_t *
+s_echo (zmsg_t *request, int64_t budget, void *args)
+{
+    return request;             //  Echo is complex... :-)
+}
+
 int main (int argc, char *argv [])
 {
-    int verbose = (argc > 1 && streq (argv [1], "-v"));
+    int verbose = 0;
+    int threads = 0;
+    int batch = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-v"))
+            verbose = 1;
+        else
+        if (streq (argv [argn], "-t") && argn + 1 < argc)
+            threads = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-b") && argn + 1 < argc)
+            batch = atoi (argv [++argn]);
+        else {
+            printf ("syntax: mdworker [-v] [-t threads | -b batch]\n");
+            return 1;
+        }
+    }
     mdwrk_t *session = mdwrk_new ("tcp://localhost:5555", "echo", verbose);
-
-    zmsg_t *reply = NULL;
-    while (true) {
-        zmsg_t *request = mdwrk_recv (session, &reply);
-        if (request == NULL)
-            break;              //  Worker was interrupted
-        reply = request;        //  Echo is complex... :-)
+    if (threads > 0)
+        mdwrk_serve (session, threads, s_echo, NULL);
+    else
+    if (batch > 0) {
+        mdwrk_set_batch (session, batch);
+        zmsg_t **replies = NULL;
+        size_t size = 0;
+        while (true) {
+            zmsg_t **requests = mdwrk_recv_batch (session, replies, &size);
+            if (requests == NULL)
+                break;          //  Worker was interrupted
+            replies = requests; //  Echo each request in place
+        }
+    }
+    else {
+        zmsg_t *reply = NULL;
+        while (true) {
+            zmsg_t *request = mdwrk_recv (session, &reply);
+            if (request == NULL)
+                break;          //  Worker was interrupted
+            reply = request;    //  Echo is complex... :-)
+        }
     }
     mdwrk_destroy (&session);
     return 0;
@@ -2,13 +2,19 @@
 //  Implements the MDP/Worker spec at http://rfc.zeromq.org/spec:7.
 
 #include "mdwrkapi.h"
+#include "mdopts.h"
 
 //  Reliability parameters
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
+#define RECONNECT_MAX       60000   //  Longest reconnect delay, msecs,
+                                    //  unless the first one is longer
 
 //  .split worker class structure
 //  This is the structure of a worker API instance. We use a pseudo-OO
-//  approach in a lot of the C examples, as well as the CZMQ binding:
+//  approach in a lot of the C examples, as well as the CZMQ binding. The
+//  broker connection belongs to an agent running in its own thread, so
+//  the application can take as long as it likes over a request without
+//  the broker losing sight of us:
 
 //  Structure of our class
 //  We access these properties only via class methods
@@ -17,32 +23,141 @@ struct _mdwrk_t {
     void *ctx;                  //  Our context
     char *broker;
     char *service;
-    zsock_t *worker;            //  Socket to broker
-    void *raw_worker;           //  Raw socket to broker
+    zactor_t *agent;            //  Agent that talks to the broker
     int verbose;                //  Print activity to stdout
 
-    //  Heartbeat management
-    uint64_t heartbeat_at;      //  When to send HEARTBEAT
-    size_t liveness;            //  How many attempts left
+    //  Heartbeat management, used by our agent
     int heartbeat;              //  Heartbeat delay, msecs
     int reconnect;              //  Reconnect delay, msecs
+    mdopts_t options;           //  Options we register with
 
     int expect_reply;           //  Zero only at start
     zframe_t *reply_to;         //  Return identity, if any
+    uint32_t generation;        //  Connection current request came on
+    uint64_t tag;               //  Broker's tag for current request
+    int64_t deadline;           //  When current request's budget runs
+                                //  out, usecs, or -1 if it has none
+
+    //  Handler pool, when serving requests with mdwrk_serve
+    mdwrk_handler_fn *handler;  //  Called for each request
+    void *handler_args;         //  Passed to handler
+
+    //  Last batch, when receiving requests with mdwrk_recv_batch
+    zmsg_t **batch;             //  Requests of the batch
+    zframe_t **batch_reply_to;  //  Their return identities
+    uint64_t *batch_tags;       //  Their tags
+    uint32_t batch_generation;  //  Connection the batch came on
+    size_t batch_size;          //  How many requests in the batch
 };
 
-//  .split utility functions
-//  We have two utility functions; to send a message to the broker and
-//  to (re)connect to the broker:
+//  .split handler pool structure
+//  In multi-request mode we keep a ring of the requests waiting for a
+//  handler, one slot per request the broker may send us before we reply,
+//  and the request each handler works on. The broker tags each request,
+//  so we send each reply as soon as its handler is done, whatever the
+//  state of older requests. The broker only sends a request when we have
+//  credit left, so requests waiting from the current connection always
+//  fit in the ring. We drop those left from an older connection, whose
+//  replies the agent would drop anyway, before we take any newer one:
+
+typedef struct {
+    zframe_t *reply_to;         //  Return identity of request, or NULL
+    uint32_t generation;        //  Connection request came on
+    uint64_t tag;               //  Broker's tag for request
+    int64_t deadline;           //  When its budget runs out, or -1
+    zmsg_t *request;            //  Request, until a handler takes it
+} held_t;
+
+typedef struct {
+    zactor_t **handlers;        //  Handler threads
+    held_t *working;            //  Request each handler works on
+    size_t nbr_handlers;        //  How many handlers we have
+    held_t *slots;              //  Ring of requests waiting for handlers
+    size_t nbr_slots;           //  Ring size, our credit
+    size_t oldest;              //  Slot of oldest waiting request
+    size_t held;                //  Requests in the ring
+} pool_t;
+
+//  .split agent class structure
+//  The agent owns the socket to the broker. It passes each request up
+//  its pipe, after the request command and frames with the connection's
+//  generation and the request's deadline and tag, and each batch after
+//  the batch command, the generation and the time it came. It sends each
+//  reply or batch of replies that comes down the pipe, after its command
+//  and generation, and for a reply its tag, to the broker. The broker
+//  forgets what we owe it when we reconnect, so we drop replies owed on
+//  an earlier connection, which would otherwise take the place of new
+//  requests there.
+//  It heartbeats the broker on its own schedule, and reconnects when the
+//  broker goes quiet, waiting longer after each failed attempt:
+
+typedef struct {
+    zsock_t *pipe;              //  Pipe to application thread
+    char *broker;               //  Broker endpoint
+    char *service;              //  Service we register for
+    int verbose;                //  Print activity to stdout
+    zsock_t *worker;            //  Socket to broker, if connected
+    void *raw_worker;           //  Raw socket to broker
+
+    //  Heartbeat management
+    int64_t heartbeat_at;       //  When to send HEARTBEAT
+    size_t liveness;            //  How many attempts left
+    int heartbeat;              //  Heartbeat delay, msecs
+    int reconnect;              //  First reconnect delay, msecs
+    int backoff;                //  Next reconnect delay, msecs
+    int64_t reconnect_at;       //  When to reconnect, if disconnected
+    mdopts_t options;           //  Options we register with
+    uint32_t generation;        //  Bumped on each connection
+} agent_t;
+
+//  .split agent constructor and destructor
+//  The agent copies the settings it needs, so the application may change
+//  nothing that matters to it once it runs:
+
+static agent_t *
+s_agent_new (zsock_t *pipe, mdwrk_t *worker)
+{
+    agent_t *self = (agent_t *) zmalloc (sizeof (agent_t));
+    self->pipe = pipe;
+    self->broker = strdup (worker->broker);
+    self->service = strdup (worker->service);
+    self->verbose = worker->verbose;
+    self->heartbeat = worker->heartbeat;
+    self->reconnect = worker->reconnect;
+    self->backoff = worker->reconnect;
+    self->options = worker->options;
+    return self;
+}
+
+static void
+s_agent_destroy (agent_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        agent_t *self = *self_p;
+        zsock_destroy (&self->worker);
+        free (self->broker);
+        free (self->service);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  .split agent utility functions
+//  We have three utility functions; to send a message to the broker, to
+//  (re)connect to the broker, and to drop the connection until it's time
+//  to try again:
 
 //  Send message to broker
-//  If no msg is provided, creates one internally
+//  If no msg is provided, creates one internally. Takes ownership of the
+//  message, so replies are sent without copying their body.
 
 static void
-s_mdwrk_send_to_broker (mdwrk_t *self, char *command, char *option,
-                        zmsg_t *msg)
+s_agent_send (agent_t *self, char *command, char *option, zmsg_t **msg_p)
 {
-    msg = msg? zmsg_dup (msg): zmsg_new ();
+    zmsg_t *msg = msg_p && *msg_p? *msg_p: zmsg_new ();
+    if (msg_p)
+        *msg_p = NULL;
 
     //  Stack protocol envelope to start of message
     if (option)
@@ -61,28 +176,232 @@ s_mdwrk_send_to_broker (mdwrk_t *self, char *command, char *option,
 
 //  Connect or reconnect to broker
 
-void s_mdwrk_connect_to_broker (mdwrk_t *self)
+static void
+s_agent_connect (agent_t *self)
 {
-    if (self->worker) {
-        zsock_destroy (&self->worker);
-        self->raw_worker = NULL;
-    }
+    zsock_destroy (&self->worker);
     self->worker = zsock_new_dealer (self->broker);
     assert ( self->worker );
-    self->raw_worker = zsock_resolve(self->worker);
+    self->raw_worker = zsock_resolve (self->worker);
+    self->generation++;
     if (self->verbose)
         zclock_log ("I: connecting to broker at %s...", self->broker);
 
-    //  Register service with broker
-    s_mdwrk_send_to_broker (self, MDPW_READY, self->service, NULL);
+    //  Register service with broker, adding our options if any of them
+    //  are not at their defaults
+    zmsg_t *options = NULL;
+    zframe_t *options_frame = mdopts_encode (&self->options);
+    if (zframe_size (options_frame)) {
+        options = zmsg_new ();
+        zmsg_append (options, &options_frame);
+    }
+    else
+        zframe_destroy (&options_frame);
+    s_agent_send (self, MDPW_READY, self->service, &options);
 
     //  If liveness hits zero, queue is considered disconnected
     self->liveness = HEARTBEAT_LIVENESS;
     self->heartbeat_at = zclock_time () + self->heartbeat;
 }
 
+//  Drop the connection and pick when to try again. Each failed attempt
+//  doubles the delay, up to RECONNECT_MAX, and we wait a random time
+//  between half the delay and all of it, so workers that lost the same
+//  broker don't all come back at the same moment:
+
+static void
+s_agent_disconnect (agent_t *self)
+{
+    zsock_destroy (&self->worker);
+    self->raw_worker = NULL;
+    int delay = self->backoff / 2 + randof (self->backoff / 2 + 1);
+    self->reconnect_at = zclock_time () + delay;
+    if (self->verbose)
+        zclock_log ("W: disconnected from broker - retrying in %d msecs...",
+                    delay);
+    int most = self->reconnect > RECONNECT_MAX? self->reconnect:
+                                                RECONNECT_MAX;
+    self->backoff = self->backoff < most / 2? self->backoff * 2: most;
+}
+
+//  .split agent accept method
+//  This method processes one message from the broker. Any message tells
+//  us the broker is alive, and that the connection works. We pass each
+//  request up to the application, with its deadline and tag in place of
+//  the options frame the broker put before the client envelope. Anything
+//  else we handle here:
+
+static void
+s_agent_accept (agent_t *self, zmsg_t *msg)
+{
+    if (self->verbose) {
+        zclock_log ("I: received message from broker:");
+        zmsg_dump (msg);
+    }
+    self->liveness = HEARTBEAT_LIVENESS;
+    self->backoff = self->reconnect;
+
+    //  Don't try to handle errors, just assert noisily
+    assert (zmsg_size (msg) >= 3);
+
+    zframe_t *empty = zmsg_pop (msg);
+    assert (zframe_streq (empty, ""));
+    zframe_destroy (&empty);
+
+    zframe_t *header = zmsg_pop (msg);
+    assert (zframe_streq (header, MDPW_WORKER));
+    zframe_destroy (&header);
+
+    zframe_t *command = zmsg_pop (msg);
+    if (zframe_streq (command, MDPW_REQUEST)) {
+        zframe_t *options_frame = zmsg_pop (msg);
+        mdopts_t options;
+        if (mdopts_decode (&options, options_frame))
+            zclock_log ("E: invalid request options");
+        int64_t deadline = options.budget >= 0?
+            zclock_usecs () + options.budget * 1000: -1;
+        zframe_destroy (&options_frame);
+        zmsg_pushmem (msg, &options.tag, sizeof (options.tag));
+        zmsg_pushmem (msg, &deadline, sizeof (deadline));
+        zmsg_pushmem (msg, &self->generation, sizeof (self->generation));
+        zmsg_prepend (msg, &command);
+        zmsg_send (&msg, self->pipe);
+        return;
+    }
+    else
+    if (zframe_streq (command, MDPW_BATCH)) {
+        //  Items have their budgets in their own options frames, so we
+        //  add the time we got the batch, for the budgets to start from
+        int64_t received = zclock_usecs ();
+        zmsg_pushmem (msg, &received, sizeof (received));
+        zmsg_pushmem (msg, &self->generation, sizeof (self->generation));
+        zmsg_prepend (msg, &command);
+        zmsg_send (&msg, self->pipe);
+        return;
+    }
+    else
+    if (zframe_streq (command, MDPW_HEARTBEAT))
+        ;                       //  Do nothing for heartbeats
+    else
+    if (zframe_streq (command, MDPW_DISCONNECT))
+        s_agent_connect (self);
+    else {
+        zclock_log ("E: invalid input message");
+        zmsg_dump (msg);
+    }
+    zframe_destroy (&command);
+    zmsg_destroy (&msg);
+}
+
+//  .split agent thread
+//  This is the agent's main loop. We wake up for the application, for the
+//  broker, and when a heartbeat or reconnect is due. The broker heartbeats
+//  us whether or not the application holds requests, so we count missed
+//  heartbeats all the time, and a dead broker can't hide behind a slow
+//  request. A reply that comes down
+//  the pipe while we're disconnected has nowhere to go, and we drop it;
+//  the client will retry. The agent stops when the mdwrk instance is
+//  destroyed, or on an interrupt:
+
+static void
+s_mdwrk_agent (zsock_t *pipe, void *args)
+{
+    agent_t *self = s_agent_new (pipe, (mdwrk_t *) args);
+    zsock_signal (pipe, 0);
+    s_agent_connect (self);
+
+    while (true) {
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { self->raw_worker,     0, ZMQ_POLLIN, 0 } };
+        int64_t timeout = (self->worker? self->heartbeat_at:
+                                         self->reconnect_at) - zclock_time ();
+        if (timeout < 0)
+            timeout = 0;
+        int rc = zmq_poll (items, self->worker? 2: 1,
+                           timeout * ZMQ_POLL_MSEC);
+        if (rc == -1) {
+            if (self->verbose)
+                zclock_log ("I: polling error ( rc == -1).");
+            break;              //  Interrupted
+        }
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (pipe);
+            if (!msg)
+                break;          //  Interrupted
+            if (zmsg_size (msg) == 1
+            &&  zframe_streq (zmsg_first (msg), "$TERM")) {
+                zmsg_destroy (&msg);
+                break;          //  mdwrk instance destroyed
+            }
+            zframe_t *command = zmsg_pop (msg);
+            zframe_t *generation_frame = zmsg_pop (msg);
+            uint32_t generation;
+            assert (zframe_size (generation_frame) == sizeof (generation));
+            memcpy (&generation, zframe_data (generation_frame),
+                    sizeof (generation));
+            zframe_destroy (&generation_frame);
+            if (zframe_streq (command, MDPW_REPLY)) {
+                //  Put the request's tag, if any, back in an options
+                //  frame for the broker
+                zframe_t *tag_frame = zmsg_pop (msg);
+                mdopts_t options;
+                mdopts_init (&options);
+                assert (zframe_size (tag_frame) == sizeof (options.tag));
+                memcpy (&options.tag, zframe_data (tag_frame),
+                        sizeof (options.tag));
+                zframe_destroy (&tag_frame);
+                if (options.tag) {
+                    zframe_t *options_frame = mdopts_encode (&options);
+                    zmsg_prepend (msg, &options_frame);
+                }
+            }
+            if (generation != self->generation) {
+                if (self->verbose)
+                    zclock_log ("W: reply owed on old connection, dropped");
+                zmsg_destroy (&msg);
+            }
+            else
+            if (self->worker)
+                s_agent_send (self, zframe_streq (command, MDPW_BATCH)?
+                              MDPW_BATCH: MDPW_REPLY, NULL, &msg);
+            else {
+                if (self->verbose)
+                    zclock_log ("W: not connected, dropped reply");
+                zmsg_destroy (&msg);
+            }
+            zframe_destroy (&command);
+        }
+        if (self->worker && (items [1].revents & ZMQ_POLLIN)) {
+            zmsg_t *msg = zmsg_recv (self->worker);
+            if (!msg) {
+                if (self->verbose)
+                    zclock_log ("I: read empty message.");
+                break;          //  Interrupted
+            }
+            s_agent_accept (self, msg);
+        }
+        int64_t now = zclock_time ();
+        if (self->worker && now >= self->heartbeat_at) {
+            if (--self->liveness == 0)
+                s_agent_disconnect (self);
+            else {
+                s_agent_send (self, MDPW_HEARTBEAT, NULL, NULL);
+                self->heartbeat_at = now + self->heartbeat;
+            }
+        }
+        else
+        if (!self->worker && now >= self->reconnect_at)
+            s_agent_connect (self);
+    }
+    s_agent_destroy (&self);
+}
+
 //  .split constructor and destructor
-//  Here we have the constructor and destructor for our mdwrk class:
+//  Here we have the constructor and destructor for our mdwrk class. We
+//  start our agent, and so connect to the broker, on the first call to
+//  mdwrk_recv or mdwrk_serve, so settings made after construction are in
+//  place when we register:
 
 //  Constructor
 
@@ -99,8 +418,11 @@ mdwrk_new (char *broker,char *service, int verbose)
     self->verbose = verbose;
     self->heartbeat = 2500;     //  msecs
     self->reconnect = 2500;     //  msecs
-
-    s_mdwrk_connect_to_broker (self);
+    mdopts_init (&self->options);
+    self->options.budgets = 1;  //  Broker tells us request deadlines
+    self->options.tags = 1;     //  And tags requests, so we can answer
+                                //  them in any order
+    self->deadline = -1;
     return self;
 }
 
@@ -112,8 +434,14 @@ mdwrk_destroy (mdwrk_t **self_p)
     assert (self_p);
     if (*self_p) {
         mdwrk_t *self = *self_p;
-        zsock_destroy (&self->worker);
-        self->raw_worker = NULL;
+        zactor_destroy (&self->agent);
+        zframe_destroy (&self->reply_to);
+        size_t index;
+        for (index = 0; index < self->batch_size; index++)
+            zframe_destroy (&self->batch_reply_to [index]);
+        free (self->batch);
+        free (self->batch_reply_to);
+        free (self->batch_tags);
         zmq_ctx_destroy (&self->ctx);
         free (self->broker);
         free (self->service);
@@ -123,25 +451,134 @@ mdwrk_destroy (mdwrk_t **self_p)
 }
 
 //  .split configure worker
-//  We provide two methods to configure the worker API. You can set the
-//  heartbeat interval and retries to match the expected network performance.
+//  We provide these methods to configure the worker API. You can set the
+//  heartbeat interval and retries to match the expected network
+//  performance, the credit window for pipelining requests, whether the
+//  broker may cache or share our replies, and whether it routes requests
+//  to us by key.
 
-//  Set heartbeat delay
+//  Set heartbeat delay, must be done before the first mdwrk_recv
 
 void
 mdwrk_set_heartbeat (mdwrk_t *self, int heartbeat)
 {
+    assert (heartbeat > 0);
+    assert (!self->agent);
     self->heartbeat = heartbeat;
 }
 
-//  Set reconnect delay
+//  Set delay before the first reconnect attempt, must be done before the
+//  first mdwrk_recv. Each further attempt waits about twice as long.
 
 void
 mdwrk_set_reconnect (mdwrk_t *self, int reconnect)
 {
+    assert (reconnect > 0);
+    assert (!self->agent);
     self->reconnect = reconnect;
 }
 
+//  Set credit window, must be done before the first mdwrk_recv. With a
+//  credit of N, the broker sends us up to N requests without waiting for
+//  replies, so the next request is already here when we send a reply.
+
+void
+mdwrk_set_credit (mdwrk_t *self, int credit)
+{
+    assert (credit >= 1);
+    assert (!self->agent);
+    self->options.credit = credit;
+}
+
+//  Let the broker answer repeated requests from a cache of our replies
+//  for up to ttl msecs, must be done before the first mdwrk_recv. Only
+//  do this if identical requests always deserve identical replies.
+
+void
+mdwrk_set_cache (mdwrk_t *self, int ttl)
+{
+    assert (ttl >= 0);
+    assert (!self->agent);
+    self->options.cache_ttl = ttl;
+}
+
+//  Let the broker send us only one of several identical requests that
+//  arrive while the first is in flight, and send our reply to all their
+//  clients, must be done before the first mdwrk_recv.
+
+void
+mdwrk_set_coalesce (mdwrk_t *self, int coalesce)
+{
+    assert (!self->agent);
+    self->options.coalesce = coalesce;
+}
+
+//  Ask the broker to send requests with the same routing key to the same
+//  worker of our service, as far as load allows, so each worker sees a
+//  stable share of the keys and its local caches stay warm. Must be done
+//  before the first mdwrk_recv.
+
+void
+mdwrk_set_sticky (mdwrk_t *self, int sticky)
+{
+    assert (!self->agent);
+    self->options.sticky = sticky;
+}
+
+//  Ask the broker to send us up to size requests at once, so we can work
+//  on them together. Such a worker gets its requests with
+//  mdwrk_recv_batch, and not mdwrk_recv or mdwrk_serve. Our credit is at
+//  least the batch size. Must be done before the first mdwrk_recv_batch.
+
+void
+mdwrk_set_batch (mdwrk_t *self, int size)
+{
+    assert (size >= 1);
+    assert (!self->agent);
+    self->options.batch = size;
+    if (self->options.credit < (uint32_t) size)
+        self->options.credit = size;
+}
+
+//  .split request method
+//  This method takes one request from our agent. We save its return
+//  envelope, connection, deadline and tag, and return the request body.
+//  We return NULL if the agent has stopped, or if we were interrupted. A
+//  worker that takes batches gets them with mdwrk_recv_batch instead:
+
+static zmsg_t *
+s_mdwrk_request (mdwrk_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->agent);
+    if (!msg)
+        return NULL;            //  Interrupted
+    zframe_t *command = zmsg_first (msg);
+    if (zmsg_size (msg) < 5 || !zframe_streq (command, MDPW_REQUEST)) {
+        zmsg_destroy (&msg);
+        return NULL;            //  Agent has stopped
+    }
+    command = zmsg_pop (msg);
+    zframe_destroy (&command);
+    zframe_t *generation = zmsg_pop (msg);
+    assert (zframe_size (generation) == sizeof (self->generation));
+    memcpy (&self->generation, zframe_data (generation),
+            sizeof (self->generation));
+    zframe_destroy (&generation);
+    zframe_t *deadline = zmsg_pop (msg);
+    assert (zframe_size (deadline) == sizeof (self->deadline));
+    memcpy (&self->deadline, zframe_data (deadline), sizeof (self->deadline));
+    zframe_destroy (&deadline);
+    zframe_t *tag = zmsg_pop (msg);
+    assert (zframe_size (tag) == sizeof (self->tag));
+    memcpy (&self->tag, zframe_data (tag), sizeof (self->tag));
+    zframe_destroy (&tag);
+
+    //  We should pop and save as many addresses as there are up to a
+    //  null part, but for now, just save one...
+    self->reply_to = zmsg_unwrap (msg);
+    return msg;
+}
+
 //  .split recv method
 //  This is the {{recv}} method; it's a little misnamed because it first sends
 //  any reply and then waits for a new request. If you have a better name
@@ -156,87 +593,361 @@ mdwrk_recv (mdwrk_t *self, zmsg_t **reply_p)
     assert (reply_p);
     zmsg_t *reply = *reply_p;
     assert (reply || !self->expect_reply);
+    assert (self->options.batch == 1);
+    if (!self->agent)
+        self->agent = zactor_new (s_mdwrk_agent, self);
     if (reply) {
         assert (self->reply_to);
         zmsg_wrap (reply, self->reply_to);
-        s_mdwrk_send_to_broker (self, MDPW_REPLY, NULL, reply);
-        zmsg_destroy (reply_p);
+        self->reply_to = NULL;
+        zmsg_pushmem (reply, &self->tag, sizeof (self->tag));
+        zmsg_pushmem (reply, &self->generation, sizeof (self->generation));
+        zmsg_pushstr (reply, MDPW_REPLY);
+        zmsg_send (reply_p, self->agent);
     }
     self->expect_reply = 1;
 
+    //  .split process message
+    //  Here is where we actually have a message to process; we return it
+    //  to the caller application. With a credit window, our agent reads
+    //  further requests while the caller works, so this doesn't block:
+    zmsg_t *request = s_mdwrk_request (self);
+    if (!request && zctx_interrupted)
+        printf ("W: interrupt received, killing worker...\n");
+    return request;
+}
+
+//  .split recv batch method
+//  This is the {{recv}} method for workers that take batches. The caller
+//  passes the replies to the last batch we returned, one for each request
+//  and in the same order, and we send them all to the broker in one
+//  BATCH. We then wait for the next batch, and return its requests, and
+//  their number in *size_p. The array is ours, and valid until the next
+//  call; the requests are the caller's. On the first call, there are no
+//  replies, and *size_p is zero. The broker may also send one request on
+//  its own, which we return as a batch of one. mdwrk_budget returns the
+//  budget of the most urgent request in the batch.
+
+zmsg_t **
+mdwrk_recv_batch (mdwrk_t *self, zmsg_t **replies, size_t *size_p)
+{
+    assert (size_p);
+    assert (*size_p == self->batch_size);
+    if (!self->agent) {
+        self->batch = (zmsg_t **)
+            zmalloc (self->options.batch * sizeof (zmsg_t *));
+        self->batch_reply_to = (zframe_t **)
+            zmalloc (self->options.batch * sizeof (zframe_t *));
+        self->batch_tags = (uint64_t *)
+            zmalloc (self->options.batch * sizeof (uint64_t));
+        self->agent = zactor_new (s_mdwrk_agent, self);
+    }
+    if (self->batch_size) {
+        assert (replies);
+        zmsg_t *msg = zmsg_new ();
+        size_t index;
+        for (index = 0; index < self->batch_size; index++) {
+            zmsg_t *reply = replies [index];
+            assert (reply);
+            replies [index] = NULL;
+            zmsg_wrap (reply, self->batch_reply_to [index]);
+            self->batch_reply_to [index] = NULL;
+            mdopts_t options;
+            mdopts_init (&options);
+            options.frames = (uint32_t) zmsg_size (reply);
+            options.tag = self->batch_tags [index];
+            zframe_t *header = mdopts_encode (&options);
+            zmsg_append (msg, &header);
+            zframe_t *frame;
+            while ((frame = zmsg_pop (reply)))
+                zmsg_append (msg, &frame);
+            zmsg_destroy (&reply);
+        }
+        zmsg_pushmem (msg, &self->batch_generation,
+                      sizeof (self->batch_generation));
+        zmsg_pushstr (msg, MDPW_BATCH);
+        zmsg_send (&msg, self->agent);
+        self->batch_size = 0;
+    }
+    *size_p = 0;
+
+    zmsg_t *msg = zmsg_recv (self->agent);
+    zframe_t *command = msg? zmsg_pop (msg): NULL;
+    if (command && (zframe_streq (command, MDPW_REQUEST)
+                ||  zframe_streq (command, MDPW_BATCH))
+    &&  zmsg_size (msg) >= 1) {
+        zframe_t *generation = zmsg_pop (msg);
+        memcpy (&self->batch_generation, zframe_data (generation),
+                sizeof (self->batch_generation));
+        zframe_destroy (&generation);
+    }
+    if (command && zframe_streq (command, MDPW_REQUEST)
+    &&  zmsg_size (msg) >= 4) {
+        zframe_t *deadline = zmsg_pop (msg);
+        memcpy (&self->deadline, zframe_data (deadline),
+                sizeof (self->deadline));
+        zframe_destroy (&deadline);
+        zframe_t *tag = zmsg_pop (msg);
+        memcpy (&self->batch_tags [0], zframe_data (tag), sizeof (uint64_t));
+        zframe_destroy (&tag);
+        self->batch_reply_to [0] = zmsg_unwrap (msg);
+        self->batch [0] = msg;
+        self->batch_size = 1;
+        msg = NULL;
+    }
+    else
+    if (command && zframe_streq (command, MDPW_BATCH)
+    &&  zmsg_size (msg) >= 1) {
+        zframe_t *received_frame = zmsg_pop (msg);
+        int64_t received;
+        memcpy (&received, zframe_data (received_frame), sizeof (received));
+        zframe_destroy (&received_frame);
+        self->deadline = -1;
+        zframe_t *header;
+        while (self->batch_size < self->options.batch
+        &&    (header = zmsg_pop (msg))) {
+            mdopts_t options;
+            int rc = mdopts_decode (&options, header);
+            zframe_destroy (&header);
+            if (rc == -1 || options.frames < 2
+            ||  options.frames > zmsg_size (msg)) {
+                zclock_log ("E: invalid batch item");
+                break;
+            }
+            zmsg_t *request = zmsg_new ();
+            uint32_t frame_nbr;
+            for (frame_nbr = 0; frame_nbr < options.frames; frame_nbr++) {
+                zframe_t *frame = zmsg_pop (msg);
+                zmsg_append (request, &frame);
+            }
+            if (options.budget >= 0) {
+                int64_t deadline = received + options.budget * 1000;
+                if (self->deadline < 0 || deadline < self->deadline)
+                    self->deadline = deadline;
+            }
+            self->batch_tags [self->batch_size] = options.tag;
+            self->batch_reply_to [self->batch_size] = zmsg_unwrap (request);
+            self->batch [self->batch_size++] = request;
+        }
+    }
+    zframe_destroy (&command);
+    zmsg_destroy (&msg);
+    if (self->batch_size == 0) {
+        if (zctx_interrupted)
+            printf ("W: interrupt received, killing worker...\n");
+        return NULL;
+    }
+    *size_p = self->batch_size;
+    return self->batch;
+}
+
+//  .split handler thread
+//  In multi-request mode, each handler runs in its own thread, and gets
+//  requests from the I/O thread over its actor pipe, after a frame with
+//  the request's deadline. It sends back the reply the handler returns.
+//  Handlers only share the mdwrk instance's handler settings, which don't
+//  change while we serve:
+
+static void
+s_mdwrk_handler (zsock_t *pipe, void *args)
+{
+    mdwrk_t *self = (mdwrk_t *) args;
+    zsock_signal (pipe, 0);
     while (true) {
-        zmq_pollitem_t items [] = {
-            { self->raw_worker,  0, ZMQ_POLLIN, 0 } };
-        int rc = zmq_poll (items, 1, self->heartbeat * ZMQ_POLL_MSEC);
-        if (rc == -1) {
-            if (self->verbose)
-                zclock_log ("I: polling error ( rc == -1).");
+        zmsg_t *request = zmsg_recv (pipe);
+        if (!request)
             break;              //  Interrupted
+        if (zmsg_size (request) == 1
+        &&  zframe_streq (zmsg_first (request), "$TERM")) {
+            zmsg_destroy (&request);
+            break;              //  Pool is shutting down
+        }
+        zframe_t *deadline_frame = zmsg_pop (request);
+        int64_t deadline;
+        assert (zframe_size (deadline_frame) == sizeof (deadline));
+        memcpy (&deadline, zframe_data (deadline_frame), sizeof (deadline));
+        zframe_destroy (&deadline_frame);
+        int64_t budget = -1;
+        if (deadline >= 0) {
+            budget = (deadline - zclock_usecs ()) / 1000;
+            if (budget < 0)
+                budget = 0;
         }
+        zmsg_t *reply = self->handler (request, budget, self->handler_args);
+        assert (reply);
+        zmsg_send (&reply, pipe);
+    }
+}
 
-        if (items [0].revents & ZMQ_POLLIN) {
-            zmsg_t *msg = zmsg_recv (self->worker);
-            if (!msg) {
-                if (self->verbose)
-                    zclock_log ("I: read empty message.");
-                break;          //  Interrupted
-            }
-            if (self->verbose) {
-                zclock_log ("I: received message from broker:");
-                zmsg_dump (msg);
-            }
-            self->liveness = HEARTBEAT_LIVENESS;
+//  .split pool methods
+//  Give waiting requests to idle handlers, oldest first. A handler is
+//  idle when it holds no return identity:
 
-            //  Don't try to handle errors, just assert noisily
-            assert (zmsg_size (msg) >= 3);
+static void
+s_pool_assign (pool_t *self)
+{
+    size_t handler;
+    for (handler = 0; handler < self->nbr_handlers; handler++) {
+        if (self->held == 0)
+            break;              //  Nothing left to give out
+        held_t *working = &self->working [handler];
+        if (working->reply_to)
+            continue;
+        *working = self->slots [self->oldest];
+        memset (&self->slots [self->oldest], 0, sizeof (held_t));
+        self->oldest = (self->oldest + 1) % self->nbr_slots;
+        self->held--;
+        zmsg_pushmem (working->request, &working->deadline,
+                      sizeof (working->deadline));
+        zmsg_send (&working->request, self->handlers [handler]);
+    }
+}
 
-            zframe_t *empty = zmsg_pop (msg);
-            assert (zframe_streq (empty, ""));
-            zframe_destroy (&empty);
+//  Drop waiting requests that came on an older connection than this
+//  one. They are always the oldest, as the connection only changes
+//  forward.
 
-            zframe_t *header = zmsg_pop (msg);
-            assert (zframe_streq (header, MDPW_WORKER));
-            zframe_destroy (&header);
+static void
+s_pool_purge (pool_t *self, uint32_t generation)
+{
+    while (self->held
+    &&     self->slots [self->oldest].generation != generation) {
+        held_t *slot = &self->slots [self->oldest];
+        zframe_destroy (&slot->reply_to);
+        zmsg_destroy (&slot->request);
+        self->oldest = (self->oldest + 1) % self->nbr_slots;
+        self->held--;
+    }
+}
 
-            zframe_t *command = zmsg_pop (msg);
-            if (zframe_streq (command, MDPW_REQUEST)) {
-                //  We should pop and save as many addresses as there are
-                //  up to a null part, but for now, just save one...
-                self->reply_to = zmsg_unwrap (msg);
-                zframe_destroy (&command);
-                //  .split process message
-                //  Here is where we actually have a message to process; we
-                //  return it to the caller application:
-                
-                return msg;     //  We have a request to process
-            }
-            else
-            if (zframe_streq (command, MDPW_HEARTBEAT))
-                ;               //  Do nothing for heartbeats
-            else
-            if (zframe_streq (command, MDPW_DISCONNECT))
-                s_mdwrk_connect_to_broker (self);
-            else {
-                zclock_log ("E: invalid input message");
-                zmsg_dump (msg);
-            }
-            zframe_destroy (&command);
-            zmsg_destroy (&msg);
-        }
-        else
-        if (--self->liveness == 0) {
+//  Send a handler's reply to the broker, through our agent, and mark the
+//  handler idle
+
+static void
+s_pool_flush (pool_t *self, mdwrk_t *worker, size_t handler,
+              zmsg_t **reply_p)
+{
+    held_t *working = &self->working [handler];
+    zmsg_wrap (*reply_p, working->reply_to);
+    working->reply_to = NULL;
+    zmsg_pushmem (*reply_p, &working->tag, sizeof (working->tag));
+    zmsg_pushmem (*reply_p, &working->generation,
+                  sizeof (working->generation));
+    zmsg_pushstr (*reply_p, MDPW_REPLY);
+    zmsg_send (reply_p, worker->agent);
+}
+
+//  .split serve method
+//  This method runs the worker in multi-request mode, until interrupted.
+//  We start a pool of handler threads and advertise at least as much
+//  credit as we have handlers, so the broker keeps them all busy. This
+//  thread passes requests from our agent to the handlers, and sends
+//  their replies back to it, while the agent heartbeats the broker. The
+//  handler gets each request with its budget in msecs, or -1, and must
+//  return a reply; it may return the request. Don't call mdwrk_recv on
+//  the same instance:
+
+void
+mdwrk_serve (mdwrk_t *self, size_t threads, mdwrk_handler_fn *handler,
+             void *args)
+{
+    assert (self);
+    assert (threads >= 1);
+    assert (handler);
+    assert (!self->agent);
+    assert (self->options.batch == 1);
+    self->handler = handler;
+    self->handler_args = args;
+    if (self->options.credit < threads)
+        self->options.credit = (uint32_t) threads;
+
+    pool_t pool = { 0 };
+    pool.nbr_handlers = threads;
+    pool.handlers = (zactor_t **) zmalloc (threads * sizeof (zactor_t *));
+    pool.working = (held_t *) zmalloc (threads * sizeof (held_t));
+    pool.nbr_slots = self->options.credit;
+    pool.slots = (held_t *) zmalloc (pool.nbr_slots * sizeof (held_t));
+    zmq_pollitem_t *items = (zmq_pollitem_t *)
+        zmalloc ((threads + 1) * sizeof (zmq_pollitem_t));
+    size_t handler_nbr;
+    for (handler_nbr = 0; handler_nbr < threads; handler_nbr++) {
+        pool.handlers [handler_nbr] = zactor_new (s_mdwrk_handler, self);
+        items [handler_nbr + 1].socket =
+            zsock_resolve (pool.handlers [handler_nbr]);
+        items [handler_nbr + 1].events = ZMQ_POLLIN;
+    }
+    self->agent = zactor_new (s_mdwrk_agent, self);
+    items [0].socket = zsock_resolve (self->agent);
+    items [0].events = ZMQ_POLLIN;
+
+    while (true) {
+        int rc = zmq_poll (items, threads + 1, -1);
+        if (rc == -1) {
             if (self->verbose)
-                zclock_log ("W: disconnected from broker - retrying...");
-            zclock_sleep (self->reconnect);
-            s_mdwrk_connect_to_broker (self);
+                zclock_log ("I: polling error ( rc == -1).");
+            break;              //  Interrupted
+        }
+        //  Send replies first, as they free handlers for requests
+        for (handler_nbr = 0; handler_nbr < threads; handler_nbr++) {
+            if (!(items [handler_nbr + 1].revents & ZMQ_POLLIN))
+                continue;
+            zmsg_t *reply = zmsg_recv (pool.handlers [handler_nbr]);
+            if (!reply)
+                continue;       //  Interrupted, poll will tell us
+            s_pool_flush (&pool, self, handler_nbr, &reply);
         }
-        //  Send HEARTBEAT if it's time
-        if (zclock_time () > self->heartbeat_at) {
-            s_mdwrk_send_to_broker (self, MDPW_HEARTBEAT, NULL, NULL);
-            self->heartbeat_at = zclock_time () + self->heartbeat;
+
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmsg_t *request = s_mdwrk_request (self);
+            if (!request)
+                break;          //  Interrupted
+            s_pool_purge (&pool, self->generation);
+            assert (pool.held < pool.nbr_slots);
+            held_t *slot = &pool.slots [
+                (pool.oldest + pool.held) % pool.nbr_slots];
+            slot->reply_to = self->reply_to;
+            slot->generation = self->generation;
+            slot->tag = self->tag;
+            slot->deadline = self->deadline;
+            slot->request = request;
+            self->reply_to = NULL;
+            pool.held++;
         }
+        s_pool_assign (&pool);
     }
     if (zctx_interrupted)
         printf ("W: interrupt received, killing worker...\n");
-    return NULL;
+
+    //  Stop the handlers before we free the requests they may hold
+    for (handler_nbr = 0; handler_nbr < threads; handler_nbr++)
+        zactor_destroy (&pool.handlers [handler_nbr]);
+    for (handler_nbr = 0; handler_nbr < threads; handler_nbr++)
+        zframe_destroy (&pool.working [handler_nbr].reply_to);
+    size_t index;
+    for (index = 0; index < pool.nbr_slots; index++) {
+        zframe_destroy (&pool.slots [index].reply_to);
+        zmsg_destroy (&pool.slots [index].request);
+    }
+    free (items);
+    free (pool.slots);
+    free (pool.working);
+    free (pool.handlers);
+}
+
+//  .split budget method
+//  Return the msecs left until the client of the request mdwrk_recv last
+//  returned gives up on it, or -1 if it will wait as long as it takes.
+//  Zero means the reply is already too late, and the worker may as well
+//  skip the work. For a batch, this is the budget of its most urgent
+//  request. The budget starts when our agent reads the request from
+//  the broker, so it counts time the request waited for us since:
+
+int64_t
+mdwrk_budget (mdwrk_t *self)
+{
+    assert (self);
+    if (self->deadline < 0)
+        return -1;
+    int64_t left = (self->deadline - zclock_usecs ()) / 1000;
+    return left > 0? left: 0;
 }
@@ -16,6 +16,11 @@ extern "C" {
 //  Opaque class structure
 typedef struct _mdwrk_t mdwrk_t;
 
+//  Request handler for mdwrk_serve; takes ownership of the request and
+//  returns the reply, given the msecs left to answer or -1 for no limit
+typedef zmsg_t *(mdwrk_handler_fn) (zmsg_t *request, int64_t budget,
+                                    void *args);
+
 mdwrk_t *
     mdwrk_new (char *broker,char *service, int verbose);
 void
@@ -26,8 +31,25 @@ void
     mdwrk_set_heartbeat (mdwrk_t *self, int heartbeat);
 void
     mdwrk_set_reconnect (mdwrk_t *self, int reconnect);
+void
+    mdwrk_set_credit (mdwrk_t *self, int credit);
+void
+    mdwrk_set_cache (mdwrk_t *self, int ttl);
+void
+    mdwrk_set_coalesce (mdwrk_t *self, int coalesce);
+void
+    mdwrk_set_sticky (mdwrk_t *self, int sticky);
+void
+    mdwrk_set_batch (mdwrk_t *self, int size);
 zmsg_t *
     mdwrk_recv (mdwrk_t *self, zmsg_t **reply_p);
+zmsg_t **
+    mdwrk_recv_batch (mdwrk_t *self, zmsg_t **replies, size_t *size_p);
+int64_t
+    mdwrk_budget (mdwrk_t *self);
+void
+    mdwrk_serve (mdwrk_t *self, size_t threads, mdwrk_handler_fn *handler,
+                 void *args);
 
 #ifdef __cplusplus
 }